@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
@@ -35,7 +36,7 @@
 #include "common.h"
 
 /* Shared mask for all threads */
-sigset_t mask;
+static sigset_t mask;
 /* Ensures mutual exclusion for server linked list */
 pthread_mutex_t servers_lock = PTHREAD_MUTEX_INITIALIZER;
 /* Allow only 1 thread to write to stdin at once */
@@ -54,6 +55,12 @@ pthread_mutex_t client_slock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t client_sready = PTHREAD_COND_INITIALIZER;
 /* Changed when condition becomes true */
 int client_done;
+/* Where updates from removed servers left off, protected by servers_lock */
+struct resume_point resume_points[RESUME_MAX];
+/* Slot of resume_points to reuse next */
+int resume_next;
+/* Settings given on the command line */
+struct client_config cconfig = { FILTER_ALL, 0, { NULL }, DICT_MAX, COMPRESS_LZ, 0 };
 
 int start_client()
 {
@@ -221,13 +228,11 @@ int start_client()
 				} else if (i == init_server_pipes[0]) {
 					// LOCK io_buff
 					pthread_mutex_lock(&iobuff_lock);
-					// Get socket fd from init_server thread
-					if (read(init_server_pipes[0], io_buff, 1) <= 0) {
+					// Get socket fd from init_server thread, as a whole int
+					if (read(init_server_pipes[0], &server_socket, sizeof(int)) != sizeof(int)) {
 						fprintf(stderr, "\n\t  Cannot read from pipe.\n");
 						exit(1);
 					}
-					// Save server socket
-					server_socket = (int)io_buff[0];
 					// Add socket to address to listen too
 					FD_SET(server_socket, &master);
 					if (server_socket > fdmax) {
@@ -238,15 +243,13 @@ int start_client()
 				} else if (i == remove_server_pipes[0]) {
 					// LOCK io_buff
 					pthread_mutex_lock(&iobuff_lock);
-					// Get socket fd from remove_server thread
-					if (read(remove_server_pipes[0], io_buff, 1) <= 0) {
+					// Get socket fd from remove_server thread, as a whole int
+					if (read(remove_server_pipes[0], &server_socket, sizeof(int)) != sizeof(int)) {
 						fprintf(stderr, "\n\t  Cannot read from pipe.\n");
 						exit(1);
 					}
 					// UNLOCK io_buff
 					pthread_mutex_unlock(&iobuff_lock);
-					// Save server socket
-					server_socket = (int)io_buff[0];
 
 					// Make sure disconnect_from_server waits until
 					// the socket fd is removed from the master list
@@ -259,30 +262,17 @@ int start_client()
 					// Tell disconnect_from_server it can proceed
 					pthread_cond_signal(&client_sready);
 				} else {
-					byte b;
-					// Receiving data from a server...
-					b = read_byte(i);
-					if (b > 0 && b < 255) {
-						// Retrieve all updates from a server
-						get_updates(i, (int)b);
-					} else if (b == END_COM) {
-						// Error message has been sent from server
-						byte server_buff[128];
-						struct server* err_serv;
-						// LOCK
-						pthread_mutex_lock(&io_lock);
-						if (read_string(i, server_buff, 128) <= 0) {
-							fprintf(stderr, "\n\t  Could not read in error message");
-						} else {
-							err_serv = find_server_ref(i);
-							fprintf(stderr, "\n\t  ** Error from %s:%d --\n",
-								err_serv->host,
-								err_serv->port);
-							fprintf(stderr, "\n\t\t%s\n", server_buff);
-						}
-						// UNLOCK
-						pthread_mutex_unlock(&io_lock);
+					struct server* recv_server;
+					// Receiving data from a server. Whatever else it sent that
+					// has already been buffered is handled too, since select()
+					// will not report it again.
+					do {
+						if ((recv_server = find_server_ref(i)) == NULL)
+							break;  // Removed in the meantime
+						nbytes = read_server(recv_server);
+					} while (nbytes > 0);
 
+					if (nbytes < 0) {
 						// LOCK
 						pthread_mutex_lock(&servers_lock);
 						// Remove server ref
@@ -302,9 +292,56 @@ int start_client()
 	return 0;
 }
 
+int read_server(struct server* recv_server)
+{
+	struct reader* in;
+	byte server_buff[256];
+	byte b;
+	byte len;
+
+	in = recv_server->in;
+	len = 0;
+	b = reader_byte(in);
+
+	if (b == END_COM && (len = reader_byte(in)) == 0 && recv_server->version == PROTO_V1) {
+		// An empty error is where protocol v2 starts
+		if ((recv_server->version = read_hello_ack(recv_server)) < 0) {
+			pthread_mutex_lock(&io_lock);
+			fprintf(stderr, "\n\t  Cannot read in hello ack.\n");
+			pthread_mutex_unlock(&io_lock);
+			recv_server->version = PROTO_V1;
+		}
+	} else if (b > 0 && b != END_COM && recv_server->version == PROTO_V2) {
+		// Retrieve a whole frame from a server
+		get_frame(recv_server->socket, b);
+	} else if (b > 0 && b < 255) {
+		// Retrieve all updates from a server
+		get_updates(recv_server->socket, (int)b);
+	} else if (b == END_COM) {
+		// Error message has been sent from server
+		// LOCK
+		pthread_mutex_lock(&io_lock);
+		if (len == 0 || reader_buff(in, server_buff, len) < 0) {
+			fprintf(stderr, "\n\t  Could not read in error message");
+		} else {
+			server_buff[len] = '\0';
+			fprintf(stderr, "\n\t  ** Error from %s:%d --\n",
+				recv_server->host,
+				recv_server->port);
+			fprintf(stderr, "\n\t\t%s\n", server_buff);
+		}
+		// UNLOCK
+		pthread_mutex_unlock(&io_lock);
+
+		return -1;
+	}
+
+	return reader_pending(in);
+}
+
 void get_updates(int socketfd, int numdiffs)
 {
-	byte server_buff[128];                  /* Temp buff that holds an update from server */
+	byte server_buff[BUFF_MAX];             /* Temp buff that holds an update from server */
 	struct server* recv_server;             /* The sever that is sending the update(s) */
 	int j;                                                  /* Index to iterate through updates */
 
@@ -320,7 +357,7 @@ void get_updates(int socketfd, int numdiffs)
 	       recv_server->host,
 	       recv_server->port);
 	for (j = 0; j < numdiffs; j++) {
-		if (read_string(socketfd, server_buff, 128) <= 0) {
+		if (reader_string(recv_server->in, server_buff, BUFF_MAX) <= 0) {
 			fprintf(stderr, "\n\t  Cannot read in entry change.\n");
 			break;
 		} else {
@@ -341,6 +378,330 @@ void get_updates(int socketfd, int numdiffs)
 	pthread_mutex_unlock(&io_lock);
 }
 
+/* What each ATTR_* bit of a record stands for, lowest bit first */
+static const char* attr_desc[] = {
+	"permissions", "UID", "GID", "size", "last access time",
+	"last modfied time", "last file status time"
+};
+
+/* Reads a varint length followed by a string from buff, and advances past it.
+   The string is copied into name, cut short to fit in size bytes. */
+static int get_vstring(const byte** buff, const byte* end, char* name, size_t size)
+{
+	unsigned long len;
+	int n;
+
+	if ((n = get_varint(*buff, end - *buff, &len)) < 0 || len > end - *buff - n)
+		return -1;
+	*buff += n;
+
+	if (len >= size) {
+		memcpy(name, *buff, size - 1);
+		name[size - 1] = '\0';
+	} else {
+		memcpy(name, *buff, len);
+		name[len] = '\0';
+	}
+	*buff += len;
+
+	return 0;
+}
+
+/* Reads a name of a record, through the table of names of s if it has one */
+static int get_record_name(struct server* s, const byte** buff, const byte* end, char* name,
+                           size_t size)
+{
+	if (s->dict.size > 0)
+		return namedict_get_name(&s->dict, buff, end, name);
+
+	return get_vstring(buff, end, name, size);
+}
+
+/* Prints the records of a FRAME_UPDATES payload from s */
+static void print_records(struct server* s, const byte* buff, const byte* end)
+{
+	unsigned long count;            /* Number of records */
+	unsigned long attrs;            /* Attributes that were modified */
+	unsigned long j;                        /* Index of the current record */
+	int k;                                          /* Index of an attribute */
+	int n;
+	byte type;                                      /* Type of the current record */
+	char name[PATH_MAX];
+	char new_name[PATH_MAX];
+
+	if ((n = get_varint(buff, end - buff, &count)) < 0) {
+		fprintf(stderr, "\n\t  Cannot read in entry change.\n");
+		return;
+	}
+	buff += n;
+
+	for (j = 0; j < count; j++) {
+		attrs = 0;
+		if (buff >= end)
+			break;
+		type = *buff++;
+
+		if ((type == REC_MODIFIED || type == REC_RENAMED)
+		    && (n = get_varint(buff, end - buff, &attrs)) < 0)
+			break;
+		if (type == REC_MODIFIED || type == REC_RENAMED)
+			buff += n;
+
+		if (get_record_name(s, &buff, end, name, sizeof(name)) < 0)
+			break;
+
+		if (type == REC_RENAMED) {
+			if (get_record_name(s, &buff, end, new_name, sizeof(new_name)) < 0)
+				break;
+			printf("\t\tRenamed  :  %s -> %s\n", name, new_name);
+			strcpy(name, new_name);
+		} else if (type == REC_REMOVED) {
+			printf("\t\tRemoved  :  %s \n", name);
+		} else if (type == REC_ADDED) {
+			printf("\t\tAdded    :  %s \n", name);
+		}
+
+		for (k = 0; k < sizeof(attr_desc) / sizeof(attr_desc[0]); k++) {
+			if (attrs & (1 << k))
+				printf("\t\tModified :  %s -> %s\n", name, attr_desc[k]);
+		}
+	}
+
+	if (j < count)
+		fprintf(stderr, "\n\t  Cannot read in entry change.\n");
+}
+
+/* Replaces the payload of a FRAME_COMPRESSED with the type and payload of the
+   frame it holds. Returns 0 on success, -1 if it cannot be inflated. */
+static int inflate_frame(byte* type, byte** payload, unsigned long* len)
+{
+	byte* frame;                                    /* The frame that was compressed */
+	unsigned long flen;                             /* Its length */
+	unsigned long plen;                             /* Length of its payload */
+	int n;
+	int m;
+
+	if ((n = get_varint(*payload, *len, &flen)) < 0 || flen < 2 || flen > COMPRESS_MAX
+	    || (frame = (byte*)malloc(flen + 1)) == NULL)
+		return -1;
+
+	if (lz_decompress(*payload + n, *len - n, frame, flen) != (long)flen
+	    || (m = get_varint(frame + 1, flen - 1, &plen)) < 0 || plen != flen - 1 - m) {
+		free(frame);
+		return -1;
+	}
+
+	// The payload is moved to the front, so it is freed the same way
+	*type = frame[0];
+	memmove(frame, frame + 1 + m, plen);
+	free(*payload);
+	*payload = frame;
+	*len = plen;
+
+	return 0;
+}
+
+void get_frame(int socketfd, byte type)
+{
+	struct server* recv_server;             /* The sever that is sending the frame */
+	unsigned long len;                              /* Length of the payload */
+	unsigned long seq;                              /* Last change the frame brings us up to */
+	unsigned long period;                   /* Of a FRAME_PERIOD, in milliseconds */
+	byte* payload;                                  /* Body of the frame */
+	int n;
+
+	recv_server = find_server_ref(socketfd);
+
+	if (reader_varint(recv_server->in, &len) < 0) {
+		fprintf(stderr, "\n\t  Cannot read in frame.\n");
+		return;
+	}
+
+	if ((payload = (byte*)malloc(len + 1)) == NULL || reader_buff(recv_server->in, payload, len) < 0) {
+		fprintf(stderr, "\n\t  Cannot read in frame.\n");
+		free(payload);
+		return;
+	}
+
+	if (type == FRAME_COMPRESSED && inflate_frame(&type, &payload, &len) < 0) {
+		fprintf(stderr, "\n\t  Cannot inflate frame.\n");
+		free(payload);
+		return;
+	}
+
+	// The server has adapted its period to how busy the directory is
+	if (type == FRAME_PERIOD) {
+		if (get_varint(payload, len, &period) >= 0 && period > 0 && period <= INT_MAX) {
+			pthread_mutex_lock(recv_server->s_lock);
+			recv_server->period = (int)period;
+			pthread_mutex_unlock(recv_server->s_lock);
+		}
+		free(payload);
+		return;
+	}
+
+	// Frames of unknown types are skipped over
+	if ((type != FRAME_UPDATES && type != FRAME_RESYNC && type != FRAME_SNAPSHOT)
+	    || (n = get_varint(payload, len, &seq)) < 0) {
+		free(payload);
+		return;
+	}
+
+	// LOCK : Write to stdout
+	pthread_mutex_lock(&io_lock);
+	// LOCK : Ensure server cannot be removed while receiving updates
+	pthread_mutex_lock(recv_server->s_lock);
+	if (type == FRAME_SNAPSHOT && !recv_server->listing)
+		printf("\n\t * Contents of %s:%d  --\n",
+		       recv_server->host,
+		       recv_server->port);
+	else if (type == FRAME_RESYNC)
+		printf("\n\t * Fell behind %s:%d, everything there is now  --\n",
+		       recv_server->host,
+		       recv_server->port);
+	else if (type != FRAME_SNAPSHOT)
+		printf("\n\t * Updates from %s:%d  --\n",
+		       recv_server->host,
+		       recv_server->port);
+
+	// The server starts its table of names over with a resync
+	if (type == FRAME_RESYNC)
+		namedict_clear(&recv_server->dict);
+
+	print_records(recv_server, payload + n, payload + len);
+	recv_server->seq = seq;
+
+	// The pages of a snapshot are listed as one, up to the empty one
+	if (type == FRAME_SNAPSHOT)
+		recv_server->listing = n < len && payload[n] != 0;
+	if (!recv_server->listing)
+		printf("\n");
+
+	// UNLOCK
+	pthread_mutex_unlock(recv_server->s_lock);
+	pthread_mutex_unlock(&io_lock);
+
+	free(payload);
+}
+
+int send_hello(int socketfd, const struct resume_point* from)
+{
+	byte hello[1 + VARINT_MAX + HELLO_MAX]; /* REQ_HELLO, length, TLVs */
+	byte tlvs[HELLO_MAX];
+	byte filter[HELLO_MAX];         /* Value of TLV_FILTER */
+	size_t plen;                            /* Length of a pattern */
+	int len;                                        /* Bytes of TLVs */
+	int flen;                                       /* Bytes of filter */
+	int k;
+	int n;
+
+	len = 0;
+	tlvs[len++] = TLV_VERSION;
+	tlvs[len] = put_varint(tlvs + len + 1, PROTO_V2);
+	len += 1 + tlvs[len];
+
+	if (from != NULL) {
+		tlvs[len++] = TLV_RESUME;
+		tlvs[len] = put_varint(tlvs + len + 1, from->epoch);
+		tlvs[len] += put_varint(tlvs + len + 1 + tlvs[len], from->seq);
+		len += 1 + tlvs[len];
+	}
+
+	// Only ask for a filter if there is something to leave out. The
+	// value can be long, so it is built before its length is written.
+	if (cconfig.events != FILTER_ALL || cconfig.npatterns > 0) {
+		flen = put_varint(filter, cconfig.events);
+		for (k = 0; k < cconfig.npatterns; k++) {
+			plen = strlen(cconfig.patterns[k]);
+			if (flen + VARINT_MAX + plen > sizeof(filter))
+				return -1;
+			flen += put_varint(filter + flen, plen);
+			memcpy(filter + flen, cconfig.patterns[k], plen);
+			flen += plen;
+		}
+
+		if (len + 1 + VARINT_MAX + flen > sizeof(tlvs))
+			return -1;
+		tlvs[len++] = TLV_FILTER;
+		len += put_varint(tlvs + len, flen);
+		memcpy(tlvs + len, filter, flen);
+		len += flen;
+	}
+
+	if (cconfig.dict_size > 0) {
+		tlvs[len++] = TLV_DICT;
+		tlvs[len] = put_varint(tlvs + len + 1, cconfig.dict_size);
+		len += 1 + tlvs[len];
+	}
+
+	if (cconfig.compress != COMPRESS_NONE) {
+		tlvs[len++] = TLV_COMPRESS;
+		tlvs[len] = put_varint(tlvs + len + 1, cconfig.compress);
+		len += 1 + tlvs[len];
+	}
+
+	if (cconfig.snapshot) {
+		tlvs[len++] = TLV_SNAPSHOT;
+		tlvs[len++] = 0;
+	}
+
+	n = 0;
+	hello[n++] = REQ_HELLO;
+	n += put_varint(hello + n, len);
+	memcpy(hello + n, tlvs, len);
+	n += len;
+
+	return send_buff(socketfd, hello, n);
+}
+
+int read_hello_ack(struct server* s)
+{
+	byte tlvs[HELLO_MAX];           /* TLVs sent by the server */
+	unsigned long len;                      /* Bytes of TLVs */
+	unsigned long tlv_len;          /* Length of the value of a TLV */
+	unsigned long version;          /* Protocol version agreed on */
+	unsigned long dict_size;        /* Names the server binds */
+	unsigned long period;           /* Period of the server, in milliseconds */
+	unsigned long i;                        /* Offset of the current TLV */
+	byte tag;
+	int n;
+
+	if (reader_byte(s->in) != FRAME_HELLO_ACK || reader_varint(s->in, &len) < 0
+	    || len > HELLO_MAX || reader_buff(s->in, tlvs, len) < 0)
+		return -1;
+
+	version = PROTO_V1;
+	dict_size = 0;
+	period = 0;
+	for (i = 0; i < len; i += tlv_len) {
+		tag = tlvs[i++];
+		if (i >= len || (n = get_varint(tlvs + i, len - i, &tlv_len)) < 0 || tlv_len > len - i - n)
+			return -1;
+		i += n;
+
+		if (tag == TLV_VERSION && get_varint(tlvs + i, tlv_len, &version) < 0)
+			return -1;
+		if (tag == TLV_RESUME && ((n = get_varint(tlvs + i, tlv_len, &s->epoch)) < 0
+		                          || get_varint(tlvs + i + n, tlv_len - n, &s->seq) < 0))
+			return -1;
+		if (tag == TLV_DICT && (get_varint(tlvs + i, tlv_len, &dict_size) < 0 || dict_size > DICT_MAX))
+			return -1;
+		if (tag == TLV_PERIOD && get_varint(tlvs + i, tlv_len, &period) < 0)
+			return -1;
+	}
+
+	// More precise than the seconds of the handshake
+	if (period > 0 && period <= INT_MAX)
+		s->period = (int)period;
+
+	// Names come as references from the next frame on
+	free_namedict(&s->dict);
+	if (init_namedict(&s->dict, dict_size) < 0)
+		return -1;
+
+	return (int)version;
+}
+
 void* kill_servers(void* arg)
 {
 	struct server* p;       /* Used to iterate the servers list */
@@ -386,7 +747,7 @@ void list_servers()
 
 	// Now print out info of all connected servers
 	while (tmp != NULL) {
-		printf("\t    %s:%d - Directory: %s, Period: %d\n",
+		printf("\t    %s:%d - Directory: %s, Period: %d ms\n",
 		       tmp->host, tmp->port, tmp->path, tmp->period);
 
 		tmp = tmp->next;
@@ -417,7 +778,7 @@ void* remove_server(void* arg)
 	len = strlen(tmp);
 
 	// Copy hostname from temp to host
-	host = (char*)malloc(len * sizeof(char));
+	host = (char*)malloc((len + 1) * sizeof(char));
 	strcpy(host, tmp);
 
 	// Last token should be the port
@@ -474,9 +835,12 @@ void* init_server(void* arg)
 	byte buff[256];                                 /* Used as a tempory buffer in various places */
 	byte* path;                                             /* Store path of directory being monitored */
 	byte b;                                                 /* Tmp byte */
-	size_t len;                                             /* Stores length of various strings */
+	int len;                                                /* Stores length of various strings */
 	int socket_buff[1];                             /* Send socketfd back to main thread to add to
 	                                                                   master fd list */
+	struct reader* in;                              /* Buffers what the server sends */
+	struct resume_point* from;              /* Where updates from the server left off */
+	struct resume_point resume;             /* Copy of it, taken under servers_lock */
 
 	// MAX_SERVERS defined in common.h
 	// Deny connections to ANY server
@@ -547,15 +911,24 @@ void* init_server(void* arg)
 		pthread_exit((void*)1);
 	}
 
+	// The whole handshake usually arrives in one piece, so it is
+	// read through a buffer
+	if ((in = new_reader(socketfd)) == NULL) {
+		fprintf(stderr, "\n\t  ** Cannot malloc reader.\n\n");
+		close(socketfd);
+		pthread_exit((void*)1);
+	}
+
 	// Read acknowledgement from server 1
-	b = read_byte(socketfd);
+	b = reader_byte(in);
 
 	// Error from server
 	if (b == END_COM) {
 		pthread_mutex_lock(&io_lock);
-		read_string(socketfd, buff, 256);
-		printf("\n\t  ** %s\n", buff);
+		if (reader_string(in, buff, 256) > 0)
+			printf("\n\t  ** %s\n", buff);
 		close(socketfd);
+		free(in);
 		pthread_mutex_unlock(&io_lock);
 		pthread_exit((void*)1);
 	}
@@ -565,55 +938,78 @@ void* init_server(void* arg)
 		pthread_mutex_lock(&io_lock);
 		fprintf(stderr, "\n\t ** Unexpected response. Abort!\n\n");
 		close(socketfd);
+		free(in);
 		pthread_mutex_unlock(&io_lock);
 		pthread_exit((void*)1);
 	}
 
 	// Read acknowledgement from server 1
-	if (read_byte(socketfd) != INIT_CLIENT2) {
+	if (reader_byte(in) != INIT_CLIENT2) {
 		pthread_mutex_lock(&io_lock);
 		fprintf(stderr, "\n\t  ** Unexpected response. Abort!\n\n");
 		pthread_mutex_unlock(&io_lock);
+		free(in);
 		pthread_exit((void*)1);
 	}
 
 	// Read in the path name
-	len = read_string(socketfd, buff, 256);
-	path = (byte*)malloc(len * sizeof(byte));
+	len = reader_string(in, buff, 256);
 
 	// Make sure string is valid
 	if (len <= 0) {
 		fprintf(stderr, "\n\t  ** Cannot read in string.\n\n");
+		free(in);
 		pthread_exit((void*)1);
 	} else {
+		path = (byte*)malloc((len + 1) * sizeof(byte));
 		strcpy(path, buff);
 	}
 
-	// Read in period
-	if ((period = read_byte(socketfd)) <= 0) {
+	// Read in period, in seconds until a hello ack says otherwise
+	if ((period = reader_byte(in)) <= 0) {
 		fprintf(stderr, "\n\t ** Cannot read period.\n\n");
 		exit(1);
 	}
+	period *= 1000;
 
 	// Now add a reference to the server to store in the
-	// servers linked list
-	add_server_ref(host, path, port, period, socketfd);
+	// servers linked list. Anything read past the handshake
+	// stays in its reader.
+	add_server_ref(host, path, port, period, socketfd, in);
+
+	// Ask for protocol v2. Until the server agrees, updates keep
+	// coming in the v1 format. If the server was removed before, it
+	// is asked for what was missed since.
+	// LOCK : The resume points are shared with remove_server_ref
+	pthread_mutex_lock(&servers_lock);
+	from = find_resume_point(host, port);
+	if (from != NULL)
+		resume = *from;
+	// UNLOCK
+	pthread_mutex_unlock(&servers_lock);
+
+	if (send_hello(socketfd, from != NULL ? &resume : NULL) < 0) {
+		pthread_mutex_lock(&io_lock);
+		fprintf(stderr, "\n\t  ** Cannot send hello.\n\n");
+		pthread_mutex_unlock(&io_lock);
+	}
 
 	// Send socket fd to main thread so client knows
 	// about it
 	socket_buff[0] = socketfd;
-	write(pipe, socket_buff, 1);
+	write(pipe, socket_buff, sizeof(int));
 
 	// Print out the directory path and the refresh period of
 	// the server
 	pthread_mutex_lock(&io_lock);
-	printf("\n\t  Directory: %s, Period: %d\n\n", path, period);
+	printf("\n\t  Directory: %s, Period: %d ms\n\n", path, period);
 	pthread_mutex_unlock(&io_lock);
 
 	return((void*)0);
 }
 
-void add_server_ref(const char* host, const char* path, int port, int period, int socketfd)
+void add_server_ref(const char* host, const char* path, int port, int period, int socketfd,
+                    struct reader* in)
 {
 	struct server *s;       /* New reference for server connection */
 
@@ -631,6 +1027,12 @@ void add_server_ref(const char* host, const char* path, int port, int period, in
 	s->path = (char*)path;
 	s->port = port;
 	s->period = period;
+	s->version = PROTO_V1;
+	s->epoch = 0;
+	s->seq = 0;
+	s->in = in;
+	init_namedict(&s->dict, 0);
+	s->listing = 0;
 
 	// LOCK : To insert new server reference node
 	pthread_mutex_lock(&servers_lock);
@@ -690,6 +1092,10 @@ void remove_server_ref(int socketfd)
 	// UNLOCK
 	pthread_mutex_unlock(s->s_lock);
 
+	// Remember where updates left off, in case the server is added again
+	if (s->version == PROTO_V2)
+		save_resume_point(s);
+
 	// Deallocate client now
 	s->prev = NULL;
 	s->next = NULL;
@@ -697,11 +1103,41 @@ void remove_server_ref(int socketfd)
 	free(s->s_lock);
 	free(s->host);
 	free(s->path);
+	free(s->in);
+	free_namedict(&s->dict);
 	free(s);
 
 	servers->count--;
 }
 
+struct resume_point* find_resume_point(const char* host, int port)
+{
+	int i;
+
+	for (i = 0; i < RESUME_MAX; i++) {
+		if (resume_points[i].port == port && strcmp(resume_points[i].host, host) == 0)
+			return &resume_points[i];
+	}
+
+	return NULL;
+}
+
+void save_resume_point(struct server* s)
+{
+	struct resume_point* rp;
+
+	// The oldest one goes once every slot is taken
+	if ((rp = find_resume_point(s->host, s->port)) == NULL) {
+		rp = &resume_points[resume_next];
+		resume_next = (resume_next + 1) % RESUME_MAX;
+		snprintf(rp->host, sizeof(rp->host), "%s", s->host);
+		rp->port = s->port;
+	}
+
+	rp->epoch = s->epoch;
+	rp->seq = s->seq;
+}
+
 struct server* find_server_ref(int socketfd)
 {
 	struct server* p;               /* Used to traverse through servers linked list */
@@ -887,11 +1323,12 @@ int disconnect_from_server(int socketfd, int pipe)
 {
 	int pipe_buff[1];
 	byte buff[8];
+	byte req[2];
 
 	// Send request to remove the socket from the
 	// master file descriptor list
 	pipe_buff[0] = socketfd;
-	write(pipe, pipe_buff, 1);
+	write(pipe, pipe_buff, sizeof(int));
 
 	pthread_mutex_lock(&client_slock);
 	while (client_done == 0)
@@ -899,12 +1336,10 @@ int disconnect_from_server(int socketfd, int pipe)
 	client_done = 0;
 	pthread_mutex_unlock(&client_slock);
 
-	if (send_byte(socketfd, REQ_REMOVE1) != 1) {
-		shutdown(socketfd, SHUT_RDWR);
-		return -1;
-	}
-
-	if (send_byte(socketfd, REQ_REMOVE2) != 1) {
+	// Send both bytes of the request at once
+	req[0] = REQ_REMOVE1;
+	req[1] = REQ_REMOVE2;
+	if (send_buff(socketfd, req, 2) != 2) {
 		shutdown(socketfd, SHUT_RDWR);
 		return -1;
 	}
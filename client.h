@@ -22,6 +22,8 @@
 #include <pthread.h>
 
 #include "common.h"
+#include "namedict.h"
+#include "lz.h"
 
 #define SPACE                           0x20            /* ASCII value for a space character */
 
@@ -36,21 +38,51 @@
 #define LIST_SERVERS_C          '3'                     /* Byte value for the list servers command */
 #define QUIT_C                          '4'                     /* Byte value for the quit command */
 
+#define RESUME_MAX                      16                      /* Removed servers remembered to resume with */
+#define MAX_PATTERNS            32                      /* Most globs a client subscribes to */
+
 /* Macro function to check if the token matches a particular command */
 #define CMD_CMP(TOK, CMD)       (strcmp(TOK, CMD) == 0)
 
+/* Client settings given on the command line (defined in client.c) */
+struct client_config {
+	unsigned long events;           /* ATTR_* and FILTER_* bits subscribed to */
+	int npatterns;                          /* No patterns subscribes to every name */
+	const char* patterns[MAX_PATTERNS];
+	unsigned long dict_size;        /* Names to bind per server, 0 to always send them */
+	unsigned long compress;         /* COMPRESS_* codec offered to servers */
+	int snapshot;                           /* Whether servers are asked for what is there */
+};
+
+extern struct client_config cconfig;
+
 /* Represents a server that a client is connected to */
 struct server {
 	struct server* next;
 	struct server* prev;
 	int socket;
 	int port;
-	int period;
+	int period;                                     /* In milliseconds */
+	int version;                            /* PROTO_V1 until the server acks the hello */
+	unsigned long epoch;            /* Run of the server the sequence numbers belong to */
+	unsigned long seq;                      /* Sequence number of the last change seen */
 	char* host;
 	char* path;
+	struct reader* in;                      /* Everything from the server is read through it */
+	struct namedict dict;           /* Names bound by the server, if it agreed to TLV_DICT */
+	int listing;                            /* Whether a snapshot is being received */
 	pthread_mutex_t* s_lock;
 };
 
+/* Where updates from a removed server left off, to pick up from when it is
+   added again */
+struct resume_point {
+	char host[BUFF_MAX];
+	int port;
+	unsigned long epoch;
+	unsigned long seq;
+};
+
 /* A linked list that stores information pertaining to a connected server */
 struct serverlist {
 	struct server* head;
@@ -71,6 +103,19 @@ struct serverlist {
  */
 int start_client();
 
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  read_server(struct server* recv_server)
+ *  Description:  Reads in and handles one message from a server: updates, a frame,
+ *				  the switch to protocol v2 or an error
+ *	  Arguments:  recv_server : The server that has data waiting
+ *        Locks:  io_lock : Write to stdout
+ *      Returns:  -1 if the server sent an error and has to be removed, otherwise the
+ *				  number of bytes from the server that are still buffered
+ * =====================================================================================
+ */
+int read_server(struct server* recv_server);
+
 /*
  * ===  FUNCTION  ======================================================================
  *         Name:  get_updates(int socketfd, int numdiffs)
@@ -86,6 +131,52 @@ int start_client();
  */
 void get_updates(int socketfd, int numdiffs);
 
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  get_frame(int socketfd, byte type)
+ *  Description:  Reads in the rest of a protocol v2 frame from a given server socket,
+ *				  and prints out the records of a FRAME_UPDATES or FRAME_RESYNC. Frames
+ *				  of other types are skipped.
+ *	  Arguments:  socketfd : The socket of the server to retrieve the frame from
+ *				  type     : The type byte of the frame, already read in
+ *        Locks:  io_lock : Write the updates to stdout
+ *				  s_lock  : Don't allow the server reference to be removed while an
+ *							update is being printed.
+ *      Returns:  void
+ * =====================================================================================
+ */
+void get_frame(int socketfd, byte type);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  send_hello(int socketfd, const struct resume_point* from)
+ *  Description:  Asks the server for protocol v2, after the v1 handshake, for the
+ *				  updates missed since the server was last removed, for only the
+ *				  updates cconfig subscribes to, and for a table of names
+ *	  Arguments:  socketfd : The socket of the server
+ *				  from     : Where updates from the server left off, NULL if it
+ *							 has not been connected to before
+ *        Locks:  None
+ *      Returns:  Number of bytes sent, or -1 on error or if the hello does not fit
+ *				  in HELLO_MAX bytes
+ * =====================================================================================
+ */
+int send_hello(int socketfd, const struct resume_point* from);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  read_hello_ack(struct server* s)
+ *  Description:  Reads in the FRAME_HELLO_ACK that follows the END_COM and empty
+ *				  string the server sends when it switches to protocol v2, the
+ *				  sequence number updates from s pick up from, the size of the
+ *				  table of names and the period of the server in milliseconds
+ *	  Arguments:  s : The server
+ *        Locks:  None
+ *      Returns:  The protocol version agreed on, or -1 on error
+ * =====================================================================================
+ */
+int read_hello_ack(struct server* s);
+
 /*
  * ===  FUNCTION  ======================================================================
  *         Name:  kill_servers(int pipe)
@@ -182,19 +273,22 @@ void list_servers();
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  add_server_ref(host, path, port, period, socketfd)
+ *         Name:  add_server_ref(host, path, port, period, socketfd, in)
  *  Description:  Adds a new server reference to servers linked list, based on given
  *                parameters
  *	  Arguments:  host   : The host name of the server
  *				  path   : Path/name of the directory being monitored by the server
  *				  port   : Port number the server is listening on
- *				  period : The refresh period of the server
+ *				  period : The refresh period of the server, in milliseconds
+ *				  in     : Reader of socketfd, which may already hold data. The server
+ *						   reference takes it over.
  *        Locks:  servers_lock : Ensure servers is not altered while adding a new server
  *								 to servers
  *      Returns:  (void)
  * =====================================================================================
  */
-void add_server_ref(const char* host, const char* path, int port, int period, int socketfd);
+void add_server_ref(const char* host, const char* path, int port, int period, int socketfd,
+                    struct reader* in);
 
 /*
  * ===  FUNCTION  ======================================================================
@@ -208,6 +302,31 @@ void add_server_ref(const char* host, const char* path, int port, int period, in
  */
 void remove_server_ref(int socketfd);
 
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  find_resume_point(const char* host, int port)
+ *  Description:  Retrieves where updates from a removed server left off
+ *	  Arguments:  host : Host name of the server
+ *				  port : Port number of the server
+ *        Locks:  None, servers_lock must be held
+ *      Returns:  The resume point, or NULL if the server was never removed
+ *		  Free?:  No
+ * =====================================================================================
+ */
+struct resume_point* find_resume_point(const char* host, int port);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  save_resume_point(struct server* s)
+ *  Description:  Remembers where updates from s left off, for when it is added
+ *				  again. Only the last RESUME_MAX servers are remembered.
+ *	  Arguments:  s : The server being removed
+ *        Locks:  None, servers_lock must be held
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void save_resume_point(struct server* s);
+
 /*
  * ===  FUNCTION  ======================================================================
  *         Name:  find_server_ref(int socketfd)
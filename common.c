@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
@@ -87,21 +88,280 @@ int send_byte(int socketfd, byte b)
 
 int send_string(int socketfd, const char* str)
 {
+	struct iovec iov[2];
 	byte len;
 	len = strlen(str);
-	byte byte_str[len];
 
-	// Send the length of the string
-	if (send_byte(socketfd, len) != 1) {
+	// Send the length of the string along with the string itself
+	iov[0].iov_base = &len;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void*)str;
+	iov[1].iov_len = len;
+
+	if (send_iov(socketfd, iov, 2) != len + 1) {
 		return -1;
 	}
 
-	// Now send the string itself
-	strncpy(byte_str, str, len);
-	if (send(socketfd, byte_str, len, 0) <= 0) {
+	return len;
+}
+
+int send_buff(int socketfd, const byte* buff, size_t len)
+{
+	size_t sent;
+	ssize_t nbytes;
+
+	// A blocking send can still be cut short by a signal
+	for (sent = 0; sent < len; sent += nbytes) {
+		if ((nbytes = send(socketfd, buff + sent, len - sent, 0)) < 0) {
+			if (errno == EINTR) {
+				nbytes = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+
+	return len;
+}
+
+int read_buff(int socketfd, byte* buff, size_t len)
+{
+	size_t got;
+	ssize_t nbytes;
+
+	for (got = 0; got < len; got += nbytes) {
+		if ((nbytes = recv(socketfd, buff + got, len - got, MSG_WAITALL)) <= 0) {
+			if (nbytes < 0 && errno == EINTR) {
+				nbytes = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+
+	return len;
+}
+
+int put_varint(byte* buff, unsigned long v)
+{
+	int n;
+
+	for (n = 0; v >= 0x80; n++) {
+		buff[n] = (byte)(v | 0x80);
+		v >>= 7;
+	}
+	buff[n++] = (byte)v;
+
+	return n;
+}
+
+int get_varint(const byte* buff, size_t len, unsigned long* v)
+{
+	size_t n;
+	int shift;
+
+	*v = 0;
+	for (n = 0, shift = 0; n < len && n < VARINT_MAX; n++, shift += 7) {
+		*v |= (unsigned long)(buff[n] & 0x7F) << shift;
+		if ((buff[n] & 0x80) == 0)
+			return n + 1;
+	}
+
+	return -1;
+}
+
+int read_varint(int socketfd, unsigned long* v)
+{
+	byte buff[VARINT_MAX];
+	int n;
+
+	for (n = 0; n < VARINT_MAX; n++) {
+		if (read_buff(socketfd, buff + n, 1) < 0)
+			return -1;
+		if ((buff[n] & 0x80) == 0)
+			return get_varint(buff, n + 1, v);
+	}
+
+	return -1;
+}
+
+int send_iov(int socketfd, struct iovec* iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t nbytes;
+	int total;
+
+	total = 0;
+	memset(&msg, 0, sizeof(msg));
+
+	while (iovcnt > 0) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+
+		if ((nbytes = sendmsg(socketfd, &msg, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += nbytes;
+
+		// Skip over whatever made it out, in case it was cut short
+		while (iovcnt > 0 && nbytes >= iov->iov_len) {
+			nbytes -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (byte*)iov->iov_base + nbytes;
+			iov->iov_len -= nbytes;
+		}
+	}
+
+	return total;
+}
+
+struct reader* new_reader(int socketfd)
+{
+	struct reader* r;
+
+	if ((r = (struct reader*)malloc(sizeof(struct reader))) == NULL)
+		return NULL;
+
+	r->fd = socketfd;
+	r->start = 0;
+	r->end = 0;
+
+	return r;
+}
+
+size_t reader_pending(struct reader* r)
+{
+	return r->end - r->start;
+}
+
+const byte* reader_data(struct reader* r)
+{
+	return r->buff + r->start;
+}
+
+ssize_t reader_recv(struct reader* r)
+{
+	ssize_t got;
+	ssize_t nbytes;
+
+	// Move what is left to the front, to make room
+	if (r->start > 0) {
+		memmove(r->buff, r->buff + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+	}
+
+	for (got = 0; r->end < READER_BUFF; got += nbytes) {
+		nbytes = recv(r->fd, r->buff + r->end, READER_BUFF - r->end, MSG_DONTWAIT);
+		if (nbytes < 0 && errno == EINTR) {
+			nbytes = 0;
+			continue;
+		}
+		if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		// What came before a hang up is still handed out, the next
+		// call reports it
+		if (nbytes <= 0)
+			return got > 0 ? got : -1;
+
+		r->end += nbytes;
+	}
+
+	return got;
+}
+
+/* Reads in as much as the socket has, after whatever is still buffered */
+static int reader_fill(struct reader* r)
+{
+	ssize_t nbytes;
+
+	// Move what is left to the front, to make room
+	if (r->start > 0) {
+		memmove(r->buff, r->buff + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+	}
+
+	do {
+		nbytes = recv(r->fd, r->buff + r->end, READER_BUFF - r->end, 0);
+	} while (nbytes < 0 && errno == EINTR);
+
+	if (nbytes <= 0)
 		return -1;
+
+	r->end += nbytes;
+
+	return nbytes;
+}
+
+byte reader_byte(struct reader* r)
+{
+	if (r->start == r->end && reader_fill(r) < 0)
+		return 0;
+
+	return r->buff[r->start++];
+}
+
+int reader_buff(struct reader* r, byte* buff, size_t len)
+{
+	size_t got;
+	size_t n;
+
+	for (got = 0; got < len; got += n) {
+		if (r->start == r->end) {
+			// Not worth going through the buffer
+			if (len - got >= READER_BUFF)
+				return read_buff(r->fd, buff + got, len - got) < 0 ? -1 : len;
+			if (reader_fill(r) < 0)
+				return -1;
+		}
+
+		n = r->end - r->start;
+		if (n > len - got)
+			n = len - got;
+		memcpy(buff + got, r->buff + r->start, n);
+		r->start += n;
 	}
 
 	return len;
 }
 
+int reader_string(struct reader* r, byte* buff, int buff_size)
+{
+	int len;
+
+	// Read in the size of the string
+	if ((len = reader_byte(r)) <= 0 || len >= buff_size)
+		return -1;
+
+	// Read in the string itself
+	if (reader_buff(r, buff, len) < 0)
+		return -1;
+
+	// Make it a string now
+	buff[len] = '\0';
+
+	return len;
+}
+
+int reader_varint(struct reader* r, unsigned long* v)
+{
+	byte buff[VARINT_MAX];
+	int n;
+
+	for (n = 0; n < VARINT_MAX; n++) {
+		if (reader_buff(r, buff + n, 1) < 0)
+			return -1;
+		if ((buff[n] & 0x80) == 0)
+			return get_varint(buff, n + 1, v);
+	}
+
+	return -1;
+}
+
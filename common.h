@@ -19,6 +19,9 @@
 #ifndef DIRAPP_H
 #define DIRAPP_H
 
+#include <stddef.h>
+#include <sys/uio.h>
+
 #ifdef TESTS
 	#define SLEEP_TIME      3                       /* Give ample time for input during tests */
 #else
@@ -33,8 +36,86 @@
 #define NO_UPDATES              0x00            /* No updates to send to clients. */
 #define END_COM                 0xFF            /* Ends communication. */
 #define GOOD_BYE                "Goodbye"       /* Goodbye! */
+#define REQ_HELLO               0xC0            /* Client asks for a newer protocol. */
+
+#define PROTO_V1                1                       /* Count byte + strings of at most 255 bytes */
+#define PROTO_V2                2                       /* Length prefixed frames of typed records */
+
+/* Protocol v2. Once the server has agreed to it, it sends END_COM followed by
+   an empty string (which v1 never sends), then a FRAME_HELLO_ACK. From there
+   on, everything is a frame: a type byte, a varint length, then the payload.
+   END_COM keeps its v1 form, a one byte length followed by a string. */
+#define FRAME_UPDATES           0x01            /* Varint sequence number of the last change,
+                                                   varint count, then that many records */
+#define FRAME_HELLO_ACK         0x02            /* TLVs of the settings agreed on */
+#define FRAME_RESYNC            0x03            /* Updates were dropped, same payload as
+                                                   FRAME_UPDATES listing every entry */
+#define FRAME_COMPRESSED        0x04            /* Varint length of another frame, then that
+                                                   frame as an lz.h block */
+#define FRAME_SNAPSHOT          0x05            /* Same payload as FRAME_UPDATES, one page of
+                                                   the entries there are after that change.
+                                                   An empty page ends the snapshot. */
+#define FRAME_PERIOD            0x06            /* Varint period of the server in milliseconds,
+                                                   sent whenever it adapts it */
+
+#define REC_ADDED               0x01            /* name */
+#define REC_REMOVED             0x02            /* name */
+#define REC_MODIFIED            0x03            /* varint attrs, name */
+#define REC_RENAMED             0x04            /* varint attrs, old name, new name */
+
+/* Bits of the attrs of a record */
+#define ATTR_PERM               0x01
+#define ATTR_UID                0x02
+#define ATTR_GID                0x04
+#define ATTR_SIZE               0x08
+#define ATTR_LAT                0x10
+#define ATTR_LMT                0x20
+#define ATTR_LFST               0x40
+
+/* Kinds of records a filter lets through, along with the ATTR_* bits of the
+   modifications it wants to hear about */
+#define FILTER_ADDED            0x80
+#define FILTER_REMOVED          0x100
+#define FILTER_RENAMED          0x200
+#define FILTER_ALL              0x3FF
+
+/* REQ_HELLO and FRAME_HELLO_ACK carry a varint length followed by TLVs, each
+   a tag byte, a varint length and the value. Unknown tags are skipped. */
+#define TLV_VERSION             0x01            /* varint protocol version */
+#define TLV_RESUME              0x02            /* varint epoch, varint sequence number. In a
+                                                   hello, the last change the client saw of
+                                                   the server it was connected to. In an ack,
+                                                   the change it is at from here on. */
+#define TLV_FILTER              0x03            /* varint ATTR_* and FILTER_* bits, then any
+                                                   number of name globs, each a varint length
+                                                   and the characters. Only matching records
+                                                   are sent, v1 updates are not filtered. */
+#define TLV_DICT                0x04            /* varint number of names to bind. In an ack,
+                                                   the number agreed on, from which point the
+                                                   names of records are sent as references
+                                                   (see namedict.h). */
+#define TLV_COMPRESS            0x05            /* varint COMPRESS_* codec. In an ack, the one
+                                                   agreed on, from which point large frames
+                                                   may come as FRAME_COMPRESSED. */
+#define TLV_SNAPSHOT            0x06            /* Empty in a hello, asks for the entries there
+                                                   are. In an ack, varint number of entries,
+                                                   sent as FRAME_SNAPSHOT pages before any
+                                                   update. Not sent to a client that resumes. */
+#define TLV_PERIOD              0x07            /* In an ack, varint period of the server in
+                                                   milliseconds, later ones come as
+                                                   FRAME_PERIOD. The period of the handshake
+                                                   is in whole seconds, rounded up. */
+
+#define COMPRESS_NONE           0
+#define COMPRESS_LZ             1               /* See lz.h */
+#define COMPRESS_MIN            1024            /* Smallest frame compressed by default */
+#define COMPRESS_MAX            (1 << 28)       /* Largest frame a client inflates */
+
+#define DICT_MAX                4096            /* Most names bound on one connection */
+#define HELLO_MAX               4096                    /* Most bytes of TLVs in a hello */
+#define READER_BUFF             65536           /* Bytes pulled in at once by a reader */
+#define VARINT_MAX              10                      /* Most bytes in a varint */
 
-#define MAX_CLIENTS     10                      /* Max number of clients a server talk with */
 #define MAX_SERVERS     5               /* Max number of servers a client can talk to. */
 
 #define BUFF_MAX        256
@@ -45,15 +126,27 @@
 
 #define MAX_FILENAME    256                     /* Max number of characters in filename */
 
+typedef unsigned char byte;                     /* Defines a byte (0-255). */
+
 /* Used to pass multiple parameters to a thread */
 struct thread_arg {
 	char* buff;
 	int socket;
+	unsigned long id;                       /* Connection id of a client, on the server */
 	int pipe;
 	int period;
+	byte req[2];                            /* Remove request already read in, on the server */
 };
 
-typedef unsigned char byte;                     /* Defines a byte (0-255). */
+/* Buffers what is read from a socket, so a message does not take a system call
+   per byte or per string. Whatever is left in buff after a message is part of
+   the next one, which select() does not know about. */
+struct reader {
+	int fd;
+	size_t start;                                   /* First byte not yet handed out */
+	size_t end;                                             /* One past the last byte read in */
+	byte buff[READER_BUFF];
+};
 
 /*
  * ===  FUNCTION  ======================================================================
@@ -116,4 +209,183 @@ int send_string(int socketfd, const char* str);
  * =====================================================================================
  */
 int send_byte(int socketfd, byte b);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  send_buff(int socketfd, const byte* buff, size_t len)
+ *  Description:  Sends all len bytes of buff to the specified socket, as they are
+ *	  Arguments:  socketfd : The socket to send the bytes to
+ *				  buff     : The bytes to send
+ *				  len      : Number of bytes in buff
+ *        Locks:  None
+ *      Returns:  len if ok, -1 on error
+ * =====================================================================================
+ */
+int send_buff(int socketfd, const byte* buff, size_t len);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  send_iov(int socketfd, struct iovec* iov, int iovcnt)
+ *  Description:  Sends all the buffers of iov to the specified socket with as few
+ *				  system calls as possible (usually one). iov is used up in the
+ *				  process.
+ *	  Arguments:  socketfd : The socket to send the bytes to
+ *				  iov      : The buffers to send, in order
+ *				  iovcnt   : Number of buffers in iov
+ *        Locks:  None
+ *      Returns:  Total number of bytes sent, or -1 on error
+ * =====================================================================================
+ */
+int send_iov(int socketfd, struct iovec* iov, int iovcnt);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  read_buff(int socketfd, byte* buff, size_t len)
+ *  Description:  Reads exactly len bytes from the specified socket
+ *	  Arguments:  socketfd : The socket to read from
+ *				  buff     : Where to store the bytes
+ *				  len      : Number of bytes to read
+ *        Locks:  None
+ *      Returns:  len if ok, -1 on error or if the connection was closed
+ * =====================================================================================
+ */
+int read_buff(int socketfd, byte* buff, size_t len);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  put_varint(byte* buff, unsigned long v)
+ *  Description:  Encodes v as a varint, 7 bits per byte starting from the lowest,
+ *				  with the top bit set on every byte but the last
+ *	  Arguments:  buff : Where to write the varint, at least VARINT_MAX bytes
+ *				  v    : The value to encode
+ *        Locks:  None
+ *      Returns:  Number of bytes written
+ * =====================================================================================
+ */
+int put_varint(byte* buff, unsigned long v);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  get_varint(const byte* buff, size_t len, unsigned long* v)
+ *  Description:  Decodes a varint from the first len bytes of buff
+ *	  Arguments:  buff : The encoded bytes
+ *				  len  : Number of bytes available in buff
+ *				  v    : Receives the value
+ *        Locks:  None
+ *      Returns:  Number of bytes used, or -1 if buff does not hold a whole varint
+ * =====================================================================================
+ */
+int get_varint(const byte* buff, size_t len, unsigned long* v);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  read_varint(int socketfd, unsigned long* v)
+ *  Description:  Reads a varint from the specified socket
+ *	  Arguments:  socketfd : The socket to read from
+ *				  v        : Receives the value
+ *        Locks:  None
+ *      Returns:  Number of bytes read, or -1 on error
+ * =====================================================================================
+ */
+int read_varint(int socketfd, unsigned long* v);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  new_reader(int socketfd)
+ *  Description:  Allocates a buffered reader for socketfd
+ *	  Arguments:  socketfd : The socket to read from
+ *        Locks:  None
+ *      Returns:  A new reader or NULL if memory could not be allocated
+ *		  Free?:  Yes
+ * =====================================================================================
+ */
+struct reader* new_reader(int socketfd);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  reader_pending(struct reader* r)
+ *  Description:  Whether r already holds bytes that have not been handed out
+ *	  Arguments:  r : The reader
+ *        Locks:  None
+ *      Returns:  Number of buffered bytes
+ * =====================================================================================
+ */
+size_t reader_pending(struct reader* r);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  reader_data(struct reader* r)
+ *  Description:  The bytes r holds that have not been handed out, so a request
+ *				  can be looked at before it is read
+ *	  Arguments:  r : The reader
+ *        Locks:  None
+ *      Returns:  The first of reader_pending(r) bytes
+ * =====================================================================================
+ */
+const byte* reader_data(struct reader* r);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  reader_recv(struct reader* r)
+ *  Description:  Reads in whatever the socket of r has right now, for a non-blocking
+ *				  socket watched by an event loop. Stops once the socket has nothing
+ *				  more or the buffer is full.
+ *	  Arguments:  r : The reader
+ *        Locks:  None
+ *      Returns:  Number of bytes read in, which may be 0, or -1 if nothing was read
+ *				  in because the socket was hung up or failed
+ * =====================================================================================
+ */
+ssize_t reader_recv(struct reader* r);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  reader_byte(struct reader* r)
+ *  Description:  Same as read_byte(...), through the buffer of r
+ *	  Arguments:  r : The reader
+ *        Locks:  None
+ *      Returns:  The byte that was read in or 0 if nothing was read
+ * =====================================================================================
+ */
+byte reader_byte(struct reader* r);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  reader_buff(struct reader* r, byte* buff, size_t len)
+ *  Description:  Same as read_buff(...), through the buffer of r. Big reads go
+ *				  straight into buff once the buffer is used up.
+ *	  Arguments:  r    : The reader
+ *				  buff : Where to store the bytes
+ *				  len  : Number of bytes to read
+ *        Locks:  None
+ *      Returns:  len if ok, -1 on error or if the connection was closed
+ * =====================================================================================
+ */
+int reader_buff(struct reader* r, byte* buff, size_t len);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  reader_string(struct reader* r, byte* buff, int buff_size)
+ *  Description:  Same as read_string(...), through the buffer of r
+ *	  Arguments:  r         : The reader
+ *				  buff      : Where to store the read in string
+ *				  buff_size : Size of the buffer
+ *        Locks:  None
+ *      Returns:  Length of string read in (not including null terminator) or -1 if
+ *				  error has occured
+ * =====================================================================================
+ */
+int reader_string(struct reader* r, byte* buff, int buff_size);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  reader_varint(struct reader* r, unsigned long* v)
+ *  Description:  Same as read_varint(...), through the buffer of r
+ *	  Arguments:  r : The reader
+ *				  v : Receives the value
+ *        Locks:  None
+ *      Returns:  Number of bytes read, or -1 on error
+ * =====================================================================================
+ */
+int reader_varint(struct reader* r, unsigned long* v);
 #endif  // DIRAPP_H
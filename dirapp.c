@@ -20,20 +20,193 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <dirent.h>
 
 #include "server.h"
 #include "client.h"
 #include "common.h"
 
-int main(int argc, const char* argv[])
+static void usage()
 {
+	printf("Usage: dirapp [-e uring|sync] [-w workers] [-c maxclients] [-b backlog]\n"
+	       "              [-q queuebytes] [-o disconnect|resync] [-j journalbytes]\n"
+	       "              [-z compressbytes] [-r skip|coalesce|stretch] [-a floor,ceiling]\n"
+	       "              [portnumber] [dirname] [period[ms]]\n"
+	       "       dirapp [-m event,...] [-f glob]... [-d names] [-u] [-s]\n");
+	exit(1);
+}
+
+/* The ATTR_* and FILTER_* bits of a comma separated list of event names */
+static unsigned long parse_events(char* list)
+{
+	/* Names of the bits, lowest first */
+	static const char* names[] = {
+		"perm", "uid", "gid", "size", "lat", "lmt", "lfst", "added", "removed", "renamed"
+	};
+	unsigned long events;
+	char* tok;
+	int k;
+
+	events = 0;
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		for (k = 0; k < sizeof(names) / sizeof(names[0]) && strcmp(tok, names[k]) != 0; k++)
+			;
+		if (k == sizeof(names) / sizeof(names[0]))
+			err_quit("Events must be some of perm,uid,gid,size,lat,lmt,lfst,added,removed,renamed.");
+		events |= 1UL << k;
+	}
+
+	return events;
+}
+
+/* Milliseconds of a period given in seconds, which may have a fraction, or
+   in milliseconds with an ms suffix. Returns -1 if it is not a number. */
+static long parse_period(const char* arg)
+{
+	char* end;
+	double v;
+
+	v = strtod(arg, &end);
+	if (end == arg)
+		return -1;
+	if (strcmp(end, "ms") == 0)
+		return (long)(v + 0.5);
+	if (*end != '\0')
+		return -1;
+
+	return (long)(v * 1000 + 0.5);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	size_t filter_len;              /* Bytes of the globs, as sent in the hello */
+	char* ceiling;                  /* Second half of the -a range */
+
+	filter_len = 0;
+
+	// Server options, then client options
+	while ((opt = getopt(argc, argv, "e:w:c:b:q:o:j:z:r:a:m:f:d:us")) != -1) {
+		switch (opt) {
+		case 'e':
+			// How the server stats directory entries
+			if (strcmp(optarg, "uring") == 0)
+				gconfig.scan_engine = SCAN_URING;
+			else if (strcmp(optarg, "sync") == 0)
+				gconfig.scan_engine = SCAN_SYNC;
+			else
+				err_quit("Scan engine must be uring or sync.");
+			break;
+		case 'w':
+			// Threads that stat directory entries when not using io_uring
+			gconfig.scan_workers = atoi(optarg);
+			if (gconfig.scan_workers <= 0 || gconfig.scan_workers > MAX_SCAN_WORKERS)
+				err_quit("Scan workers must be 0 < workers <= 64");
+			break;
+		case 'c':
+			// Clients served at once
+			if ((gconfig.max_clients = atoi(optarg)) <= 0)
+				err_quit("Max clients must be > 0");
+			break;
+		case 'b':
+			// Connections the kernel queues up until they are accepted
+			if ((gconfig.backlog = atoi(optarg)) <= 0)
+				err_quit("Backlog must be > 0");
+			break;
+		case 'q':
+			// Bytes a client may fall behind by
+			if ((gconfig.queue_max = atol(optarg)) <= 0)
+				err_quit("Queue size must be > 0");
+			break;
+		case 'o':
+			// What happens to a client that falls further behind
+			if (strcmp(optarg, "disconnect") == 0)
+				gconfig.overflow = OVERFLOW_DISCONNECT;
+			else if (strcmp(optarg, "resync") == 0)
+				gconfig.overflow = OVERFLOW_RESYNC;
+			else
+				err_quit("Overflow policy must be disconnect or resync.");
+			break;
+		case 'j':
+			// Bytes of updates kept for clients that come back
+			if ((gconfig.journal_max = atol(optarg)) < 0)
+				err_quit("Journal size must be >= 0");
+			break;
+		case 'z':
+			// Smallest frame compressed for clients that ask, 0 to
+			// never compress
+			if ((gconfig.compress_min = atol(optarg)) < 0)
+				err_quit("Compression threshold must be >= 0");
+			break;
+		case 'r':
+			// What happens when a scan is still running at the
+			// next tick
+			if (strcmp(optarg, "skip") == 0)
+				gconfig.overrun = SCHED_SKIP;
+			else if (strcmp(optarg, "coalesce") == 0)
+				gconfig.overrun = SCHED_COALESCE;
+			else if (strcmp(optarg, "stretch") == 0)
+				gconfig.overrun = SCHED_STRETCH;
+			else
+				err_quit("Overrun policy must be skip, coalesce or stretch.");
+			break;
+		case 'a':
+			// The period gets shorter while the directory keeps
+			// changing, and longer while it does not
+			if ((ceiling = strchr(optarg, ',')) == NULL)
+				err_quit("Adaptive period must be floor,ceiling.");
+			*ceiling++ = '\0';
+			gconfig.period_min = parse_period(optarg);
+			gconfig.period_max = parse_period(ceiling);
+			if (gconfig.period_min < MIN_PERIOD_MS || gconfig.period_max > MAX_PERIOD_MS
+			    || gconfig.period_min > gconfig.period_max)
+				err_quit("Adaptive period must be 0.05 <= floor <= ceiling <= 255 seconds");
+			break;
+		case 'm':
+			// Only these events are sent to the client
+			if ((cconfig.events = parse_events(optarg)) == 0)
+				err_quit("At least one event must be given.");
+			break;
+		case 'f':
+			// Only entries with a name that matches one of the globs
+			// are reported to the client
+			filter_len += strlen(optarg) + VARINT_MAX;
+			if (cconfig.npatterns == MAX_PATTERNS || filter_len > HELLO_MAX / 2)
+				err_quit("Too many filter globs.");
+			cconfig.patterns[cconfig.npatterns++] = optarg;
+			break;
+		case 'd':
+			// Names each server refers to by number once they have
+			// been sent
+			cconfig.dict_size = atol(optarg);
+			if (atol(optarg) < 0 || cconfig.dict_size > DICT_MAX)
+				err_quit("Names must be 0 <= names <= 4096");
+			break;
+		case 'u':
+			// Updates are sent uncompressed, whatever their size
+			cconfig.compress = COMPRESS_NONE;
+			break;
+		case 's':
+			// Servers list what is there as soon as they are added
+			cconfig.snapshot = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc == 1) {
 		// Try to start client mode
 		start_client();
 	} else if (argc == 4) {
 		// Try to start server mode
-		int port_number, period;
+		int port_number;
+		long period;
 		DIR* d;
 		// Verify valid port number
 		if ((port_number = atoi(argv[1])) <= 0)
@@ -49,15 +222,14 @@ int main(int argc, const char* argv[])
 			closedir(d);
 		}
 		// Check valid period
-		if ((period = atoi(argv[3])) <= 0)
+		if ((period = parse_period(argv[3])) < 0)
 			err_quit("Invalid period.");
-		if (!(period > 0 && period <= 255))
-			err_quit("Period must be 0 < period <= 255");
+		if (!(period >= MIN_PERIOD_MS && period <= MAX_PERIOD_MS))
+			err_quit("Period must be 0.05 <= period <= 255 seconds");
 		// Valid parameters, try to start server
 		start_server(port_number, argv[2], period);
 	} else {
-		printf("Usage: dirapp [portnumber] [dirname] [period]\n");
-		return 1;
+		usage();
 	}
 
 	return 0;
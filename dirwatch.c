@@ -0,0 +1,235 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dirwatch.c
+ *
+ *    Description:  inotify based change backend. Collects the names of changed
+ *					entries in the monitored directory for the diff stage.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/2026 10:31:07
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "dirwatch.h"
+
+/* Every event that can change an attribute compared by the diff stage */
+#define DIRWATCH_EVENTS (IN_ATTRIB | IN_MODIFY | IN_ACCESS | IN_CREATE | IN_DELETE | \
+	                 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static unsigned int hash_name(const char* name)
+{
+	unsigned int h = 5381;
+
+	while (*name != '\0')
+		h = h * 33 + (unsigned char)*name++;
+
+	return h % DIRWATCH_BUCKETS;
+}
+
+/* Adds back the watch the kernel dropped. Called with dw->lock held. */
+static void rewatch(struct dirwatch* dw)
+{
+	int wd;
+
+	// A watch that is only on the wrong directory now is taken off first
+	inotify_rm_watch(dw->fd, dw->wd);
+
+	if ((wd = inotify_add_watch(dw->fd, dw->path, DIRWATCH_EVENTS)) < 0)
+		return;
+
+	dw->wd = wd;
+	dw->lost = 0;
+	syslog(LOG_INFO, "Watching %s again", dw->path);
+}
+
+/* Adds name to set, unless it is already there. Called with dw->lock held. */
+static void add_change(struct dirchangeset* set, const char* name)
+{
+	struct dirchange* p;
+	unsigned int h;
+
+	// Names do not matter anymore once a rescan is needed
+	if (set->rescan)
+		return;
+
+	h = hash_name(name);
+	for (p = set->buckets[h]; p != NULL; p = p->next) {
+		if (strcmp(p->name, name) == 0)
+			return;
+	}
+
+	// Too many changes to track one by one, a rescan is cheaper
+	if (set->count == DIRWATCH_MAX_PENDING
+	    || strlen(name) >= MAX_FILENAME
+	    || (p = (struct dirchange*)malloc(sizeof(struct dirchange))) == NULL) {
+		clear_dirchangeset(set);
+		set->rescan = 1;
+		return;
+	}
+
+	strcpy(p->name, name);
+	p->next = set->buckets[h];
+	set->buckets[h] = p;
+	set->count++;
+}
+
+struct dirwatch* dirwatch_init(const char* path, void (*notify)(void))
+{
+	struct dirwatch* dw;
+
+	dw = (struct dirwatch*)malloc(sizeof(struct dirwatch));
+	if (dw == NULL)
+		return NULL;
+
+	memset(dw, 0, sizeof(struct dirwatch));
+	dw->notify = notify;
+	pthread_mutex_init(&dw->lock, NULL);
+
+	if ((dw->path = strdup(path)) == NULL) {
+		free(dw);
+		return NULL;
+	}
+
+	if ((dw->fd = inotify_init1(IN_CLOEXEC)) < 0) {
+		syslog(LOG_WARNING, "inotify unavailable: %s", strerror(errno));
+		free(dw->path);
+		free(dw);
+		return NULL;
+	}
+
+	if ((dw->wd = inotify_add_watch(dw->fd, path, DIRWATCH_EVENTS)) < 0) {
+		syslog(LOG_WARNING, "Cannot watch %s: %s", path, strerror(errno));
+		close(dw->fd);
+		free(dw->path);
+		free(dw);
+		return NULL;
+	}
+
+	return dw;
+}
+
+void* dirwatch_thread(void* arg)
+{
+	struct dirwatch* dw;                    /* The watch to collect changes into */
+	struct inotify_event* ev;               /* Current event in buff */
+	char buff[DIRWATCH_EVENT_BUFF]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;                            /* Bytes read from the inotify instance */
+	char* p;                                /* Used to walk the events in buff */
+	int notify;                             /* Whether the server must be told */
+
+	dw = (struct dirwatch*)arg;
+
+	for (;; ) {
+		if ((len = read(dw->fd, buff, sizeof(buff))) <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Cannot read inotify events");
+			break;
+		}
+
+		// LOCK : Record the whole batch at once
+		pthread_mutex_lock(&dw->lock);
+
+		for (p = buff; p < buff + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event*)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				// Events were dropped, so the names cannot be trusted
+				clear_dirchangeset(&dw->pending);
+				dw->pending.rescan = 1;
+			} else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				// The directory itself is gone, or no longer at its
+				// path. Let a rescan report it, and the next take add
+				// the watch back.
+				if (ev->wd == dw->wd && !dw->lost) {
+					syslog(LOG_WARNING, "Lost watch on %s, rescanning until it is back",
+					       dw->path);
+					dw->lost = 1;
+				}
+				dw->pending.rescan = 1;
+			} else if (ev->len > 0) {
+				add_change(&dw->pending, ev->name);
+			}
+		}
+
+		notify = !dw->notified && (dw->pending.rescan || dw->pending.count > 0);
+		if (notify)
+			dw->notified = 1;
+
+		// UNLOCK
+		pthread_mutex_unlock(&dw->lock);
+
+		if (notify && dw->notify != NULL)
+			dw->notify();
+	}
+
+	return((void*)0);
+}
+
+int dirwatch_take(struct dirwatch* dw, struct dirchangeset* set)
+{
+	// LOCK : Watcher thread must not record while the set is moved
+	pthread_mutex_lock(&dw->lock);
+
+	*set = dw->pending;
+	memset(&dw->pending, 0, sizeof(struct dirchangeset));
+	dw->notified = 0;
+
+	// Nothing was reported while there was no watch, so the names
+	// cannot be trusted up to the take that adds it back
+	if (dw->lost) {
+		rewatch(dw);
+		set->rescan = 1;
+		set->rewatched = !dw->lost;
+	}
+
+	// UNLOCK
+	pthread_mutex_unlock(&dw->lock);
+
+	return set->rescan ? -1 : set->count;
+}
+
+int dirchangeset_contains(struct dirchangeset* set, const char* name)
+{
+	struct dirchange* p;
+
+	for (p = set->buckets[hash_name(name)]; p != NULL; p = p->next) {
+		if (strcmp(p->name, name) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+void clear_dirchangeset(struct dirchangeset* set)
+{
+	struct dirchange* p;
+	int i;
+
+	for (i = 0; i < DIRWATCH_BUCKETS; i++) {
+		while ((p = set->buckets[i]) != NULL) {
+			set->buckets[i] = p->next;
+			free(p);
+		}
+	}
+
+	set->count = 0;
+	set->rescan = 0;
+	set->rewatched = 0;
+}
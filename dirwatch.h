@@ -0,0 +1,125 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dirwatch.h
+ *
+ *    Description:  Definitions for the inotify based change backend of the server.
+ *					A watcher thread collects the names of the entries that the
+ *					kernel reports as changed, so the diff stage only has to look
+ *					at those entries instead of rescanning the whole directory.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/2026 10:12:41
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef DIRWATCH_H
+#define DIRWATCH_H
+
+#include <pthread.h>
+
+#include "common.h"
+
+#define DIRWATCH_BUCKETS        256             /* Buckets in the pending name table */
+#define DIRWATCH_MAX_PENDING    4096            /* Past this many names, just rescan */
+#define DIRWATCH_EVENT_BUFF     4096            /* Size of the inotify read buffer */
+
+/* The name of a directory entry that has changed since the last scan */
+struct dirchange {
+	struct dirchange* next;
+	char name[MAX_FILENAME];
+};
+
+/* Set of changed entry names handed over to the diff stage */
+struct dirchangeset {
+	int count;
+	int rescan;                                     /* Names are unreliable, rescan everything */
+	int rewatched;                                  /* The watch was added back, on whatever
+	                                                   directory is at the path now */
+	struct dirchange* buckets[DIRWATCH_BUCKETS];
+};
+
+/* An inotify watch on the monitored directory */
+struct dirwatch {
+	int fd;                                         /* inotify instance */
+	int wd;                                         /* Watch descriptor of the directory */
+	char* path;                                     /* Path the watch is added back on */
+	int lost;                                       /* The kernel dropped the watch */
+	int notified;                                   /* notify() called since last take */
+	void (*notify)(void);                           /* Called when a change is pending */
+	struct dirchangeset pending;
+	pthread_mutex_t lock;                           /* Protects pending, notified, wd and lost */
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  dirwatch_init(const char* path, void (*notify)(void))
+ *  Description:  Creates an inotify watch on the directory given by path. The first
+ *				  change that is recorded after each call to dirwatch_take(...) will
+ *				  call notify, so the caller can run an update early.
+ *	  Arguments:  path   : The name/path of the directory to watch
+ *				  notify : Called from the watcher thread when a change is pending
+ *        Locks:  None
+ *      Returns:  A new dirwatch structure or NULL if inotify is unavailable
+ *		  Free?:  No
+ * =====================================================================================
+ */
+struct dirwatch* dirwatch_init(const char* path, void (*notify)(void));
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  dirwatch_thread(void* arg)
+ *  Description:  Reads events from the inotify instance and records the names of
+ *				  the changed entries. Runs for the lifetime of the server.
+ *	  Arguments:  arg : The dirwatch structure to collect changes into
+ *        Locks:  lock : Held while a batch of events is recorded
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void* dirwatch_thread(void* arg);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  dirwatch_take(struct dirwatch* dw, struct dirchangeset* set)
+ *  Description:  Moves all the pending changes of dw into set, leaving dw empty. If
+ *				  the kernel dropped the watch, because the directory was deleted,
+ *				  moved or unmounted, it is added back on the path first. Until that
+ *				  works, every take asks for a full rescan.
+ *	  Arguments:  dw  : The watch to take the changes from
+ *				  set : Receives the pending changes
+ *        Locks:  lock : Held while the changes are moved
+ *      Returns:  The number of changed names, or -1 if a full rescan is needed
+ * =====================================================================================
+ */
+int dirwatch_take(struct dirwatch* dw, struct dirchangeset* set);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  dirchangeset_contains(struct dirchangeset* set, const char* name)
+ *  Description:  Checks whether name is one of the changed entries in set
+ *	  Arguments:  set  : The set of changed entries
+ *				  name : The entry name to look for
+ *        Locks:  None
+ *      Returns:  1 if name is in set, 0 otherwise
+ * =====================================================================================
+ */
+int dirchangeset_contains(struct dirchangeset* set, const char* name);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  clear_dirchangeset(struct dirchangeset* set)
+ *  Description:  Frees every name in set and resets it to empty
+ *	  Arguments:  set : The set to clear
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void clear_dirchangeset(struct dirchangeset* set);
+
+#endif  // DIRWATCH_H
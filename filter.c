@@ -0,0 +1,305 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  filter.c
+ *
+ *    Description:  Subscription filters of v2 clients.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/2026 10:31:52
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#define _GNU_SOURCE                     /* strndup */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "filter.h"
+
+/* Orders patterns for qsort */
+static int compare_patterns(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void free_filter(struct filter* f)
+{
+	int k;
+
+	for (k = 0; k < f->npatterns; k++)
+		free(f->patterns[k]);
+	for (k = 0; k < FILTER_CACHE; k++) {
+		if (f->src[k] != NULL)
+			updatebuf_unref(f->src[k]);
+		if (f->out[k] != NULL)
+			updatebuf_unref(f->out[k]);
+	}
+	free(f);
+}
+
+struct filter* new_filter(const byte* tlv, size_t len)
+{
+	struct filter* f;
+	unsigned long plen;                     /* Length of the current pattern */
+	size_t i;                                       /* Offset of the current pattern */
+	size_t l;
+	int n;
+	int k;
+
+	if ((f = (struct filter*)calloc(1, sizeof(struct filter))) == NULL)
+		return NULL;
+	f->refs = 1;
+
+	if ((n = get_varint(tlv, len, &f->events)) < 0)
+		goto fail;
+	f->events &= FILTER_ALL;
+
+	for (i = n; i < len; i += plen) {
+		if (f->npatterns == FILTER_PATTERNS || (n = get_varint(tlv + i, len - i, &plen)) < 0
+		    || plen > len - i - n)
+			goto fail;
+		i += n;
+
+		if ((f->patterns[f->npatterns] = strndup((const char*)tlv + i, plen)) == NULL)
+			goto fail;
+		f->npatterns++;
+	}
+
+	qsort(f->patterns, f->npatterns, sizeof(char*), compare_patterns);
+
+	// Most patterns are a prefix, which does not need the full glob
+	// matcher
+	for (k = 0; k < f->npatterns; k++) {
+		l = strlen(f->patterns[k]);
+		if (l > 1 && f->patterns[k][l - 1] == '*'
+		    && strcspn(f->patterns[k], "*?[\\") == l - 1)
+			f->prefix[k] = l - 1;
+	}
+
+	return f;
+
+ fail:
+	free_filter(f);
+	return NULL;
+}
+
+/* Whether a and b ask for the same thing */
+static int same_filter(struct filter* a, struct filter* b)
+{
+	int k;
+
+	if (a->events != b->events || a->npatterns != b->npatterns)
+		return 0;
+
+	for (k = 0; k < a->npatterns; k++) {
+		if (strcmp(a->patterns[k], b->patterns[k]) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+struct filter* filter_intern(struct filterset* fs, struct filter* f)
+{
+	struct filter* e;
+
+	// Those clients are sent the same frames as everyone else
+	if (f->events == FILTER_ALL && f->npatterns == 0) {
+		free_filter(f);
+		return NULL;
+	}
+
+	for (e = fs->head; e != NULL; e = e->next) {
+		if (same_filter(e, f)) {
+			free_filter(f);
+			e->refs++;
+			return e;
+		}
+	}
+
+	f->next = fs->head;
+	fs->head = f;
+	fs->count++;
+
+	return f;
+}
+
+struct filter* filter_ref(struct filter* f)
+{
+	f->refs++;
+	return f;
+}
+
+void filter_release(struct filterset* fs, struct filter* f)
+{
+	struct filter** link;
+
+	if (f == NULL || --f->refs > 0)
+		return;
+
+	for (link = &fs->head; *link != f; link = &(*link)->next)
+		;
+	*link = f->next;
+	fs->count--;
+
+	free_filter(f);
+}
+
+/* Whether name matches one of the patterns of f */
+static int match_name(struct filter* f, const char* name)
+{
+	int k;
+
+	if (f->npatterns == 0)
+		return 1;
+
+	for (k = 0; k < f->npatterns; k++) {
+		if (f->prefix[k] > 0 ? strncmp(name, f->patterns[k], f->prefix[k]) == 0
+		    : fnmatch(f->patterns[k], name, 0) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+int filter_record(struct filter* f, byte frame_type, byte* type, unsigned long* attrs,
+                  const char* name, const char* new_name)
+{
+	// A resync or a snapshot is what there is, not what happened
+	if (frame_type == FRAME_RESYNC || frame_type == FRAME_SNAPSHOT)
+		return match_name(f, name);
+
+	switch (*type) {
+	case REC_ADDED:
+		return (f->events & FILTER_ADDED) && match_name(f, name);
+	case REC_REMOVED:
+		return (f->events & FILTER_REMOVED) && match_name(f, name);
+	case REC_MODIFIED:
+		*attrs &= f->events;
+		return *attrs != 0 && match_name(f, name);
+	case REC_RENAMED:
+		if (!match_name(f, name) && !match_name(f, new_name))
+			return 0;
+		*attrs &= f->events;
+		if (f->events & FILTER_RENAMED)
+			return 1;
+		*type = REC_MODIFIED;
+		return *attrs != 0;
+	default:
+		return 0;
+	}
+}
+
+struct updatebuf* filter_frame(struct filter* f, struct updatebuf* frame)
+{
+	struct updatebuf* records;      /* Records that are kept */
+	struct updatebuf* out;          /* The filtered frame */
+	const byte* p;                          /* Current position in frame */
+	const byte* end;
+	unsigned long seq;                      /* Sequence number of the last change */
+	unsigned long count;            /* Number of records in frame */
+	unsigned long kept;                     /* Number of records kept */
+	unsigned long attrs;            /* Attributes of the current record */
+	unsigned long sent_attrs;       /* The ones that are kept */
+	unsigned long j;                        /* Index of the current record */
+	byte frame_type;
+	byte type;                                      /* Type of the current record */
+	byte sent_type;                         /* Type it is kept as */
+	int same;                                       /* Whether every record is kept as it is */
+	int err;
+	char name[PATH_MAX];
+	char new_name[PATH_MAX];
+
+	frame_type = frame->data[0];
+	if (f == NULL || (frame_type != FRAME_UPDATES && frame_type != FRAME_RESYNC
+	                  && frame_type != FRAME_SNAPSHOT))
+		return updatebuf_ref(frame);
+
+	if (get_frame_records(frame, &seq, &count, &p) < 0 || (records = new_updatebuf()) == NULL)
+		return NULL;
+	end = frame->data + frame->len;
+
+	err = 0;
+	kept = 0;
+	same = 1;
+	for (j = 0; j < count && err == 0; j++) {
+		if ((err = get_record(&p, end, &type, &attrs, name, new_name)) < 0)
+			break;
+
+		sent_type = type;
+		sent_attrs = attrs;
+		if (!filter_record(f, frame_type, &sent_type, &sent_attrs, name, new_name)) {
+			same = 0;
+			continue;
+		}
+		if (sent_type != type || sent_attrs != attrs)
+			same = 0;
+
+		// A rename kept as a modification is about the new name
+		err = updatebuf_put_record(records, sent_type, sent_attrs,
+		                           sent_type != type ? new_name : name, new_name);
+		kept++;
+	}
+
+	out = NULL;
+	if (err == 0 && same)
+		// Nothing was filtered out, so the bytes can be shared
+		out = updatebuf_ref(frame);
+	else if (err == 0 && (kept > 0 || frame_type == FRAME_RESYNC || count == 0))
+		out = new_records_frame(frame_type, seq, kept, records);
+	updatebuf_unref(records);
+
+	return out;
+}
+
+struct updatebuf* filter_cached(struct filter* f, struct updatebuf* frame)
+{
+	int k;
+
+	for (k = 0; k < FILTER_CACHE; k++) {
+		if (f->src[k] == frame)
+			return f->out[k];
+	}
+
+	// Take the first free slot, or the first one if there is none
+	for (k = 0; k < FILTER_CACHE && f->src[k] != NULL; k++)
+		;
+	if (k == FILTER_CACHE) {
+		k = 0;
+		updatebuf_unref(f->src[k]);
+		if (f->out[k] != NULL)
+			updatebuf_unref(f->out[k]);
+	}
+
+	// The source is held on to, so its address cannot be reused while
+	// it is in the cache
+	f->src[k] = updatebuf_ref(frame);
+	f->out[k] = filter_frame(f, frame);
+
+	return f->out[k];
+}
+
+void filterset_flush(struct filterset* fs)
+{
+	struct filter* f;
+	int k;
+
+	for (f = fs->head; f != NULL; f = f->next) {
+		for (k = 0; k < FILTER_CACHE; k++) {
+			if (f->src[k] != NULL)
+				updatebuf_unref(f->src[k]);
+			if (f->out[k] != NULL)
+				updatebuf_unref(f->out[k]);
+			f->src[k] = NULL;
+			f->out[k] = NULL;
+		}
+	}
+}
@@ -0,0 +1,186 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  filter.h
+ *
+ *    Description:  Subscription filters of v2 clients. A filter lets through the
+ *					records of the kinds and attributes a client asked for, about the
+ *					names that match one of its globs. Clients that ask for the same
+ *					thing share one filter, so each update is filtered once per
+ *					distinct filter rather than once per client.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/2026 10:12:37
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+#include "common.h"
+#include "updatebuf.h"
+
+#define FILTER_PATTERNS         32                      /* Most globs in one filter */
+#define FILTER_CACHE            2                       /* Frames remembered per filter, an update
+                                                   and a resync */
+
+/* What one or more clients asked for */
+struct filter {
+	struct filter* next;            /* Next filter in the set */
+	int refs;                                       /* Clients using it */
+	unsigned long events;           /* ATTR_* and FILTER_* bits */
+	int npatterns;                          /* No patterns matches every name */
+	char* patterns[FILTER_PATTERNS];        /* Sorted, so equal filters compare equal */
+	size_t prefix[FILTER_PATTERNS];         /* Length of a pattern that is only a prefix
+	                                           followed by '*', 0 for any other glob */
+	struct updatebuf* src[FILTER_CACHE];    /* Frames filtered by filter_cached(...) */
+	struct updatebuf* out[FILTER_CACHE];    /* What came out of them, may be NULL */
+};
+
+/* Every filter in use, each one only once */
+struct filterset {
+	struct filter* head;
+	int count;
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  new_filter(const byte* tlv, size_t len)
+ *  Description:  Builds a filter from the value of a TLV_FILTER: a varint of the
+ *				  events asked for, followed by any number of globs, each a varint
+ *				  length and the characters
+ *	  Arguments:  tlv : The value of the TLV
+ *				  len : Number of bytes in tlv
+ *        Locks:  None
+ *      Returns:  A new filter or NULL if tlv is malformed or memory could not be
+ *				  allocated
+ *		  Free?:  Yes, with free_filter, or filter_release once it has been interned
+ * =====================================================================================
+ */
+struct filter* new_filter(const byte* tlv, size_t len);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  free_filter(struct filter* f)
+ *  Description:  Frees a filter that is not in any set, and the frames it has kept
+ *	  Arguments:  f : The filter
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void free_filter(struct filter* f);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  filter_intern(struct filterset* fs, struct filter* f)
+ *  Description:  Looks for a filter equal to f in fs. If there is one, f is freed
+ *				  and a reference to the existing one is returned, otherwise f is
+ *				  added to fs.
+ *	  Arguments:  fs : The set of filters in use
+ *				  f  : A filter from new_filter(...)
+ *        Locks:  None, the owner of fs serializes access to it
+ *      Returns:  The filter to use, with one reference held by the caller. NULL if
+ *				  f lets everything through, f is freed then too.
+ * =====================================================================================
+ */
+struct filter* filter_intern(struct filterset* fs, struct filter* f);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  filter_ref(struct filter* f)
+ *  Description:  Takes one more reference to an interned filter, so it outlives the
+ *				  clients that use it
+ *	  Arguments:  f : The filter
+ *        Locks:  None, the owner of the set of f serializes access to it
+ *      Returns:  f
+ *		  Free?:  Yes, with filter_release
+ * =====================================================================================
+ */
+struct filter* filter_ref(struct filter* f);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  filter_release(struct filterset* fs, struct filter* f)
+ *  Description:  Drops a reference to f, and takes it out of fs and frees it once
+ *				  no client uses it
+ *	  Arguments:  fs : The set f was interned in
+ *				  f  : The filter, may be NULL
+ *        Locks:  None, the owner of fs serializes access to it
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void filter_release(struct filterset* fs, struct filter* f);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  filter_record(f, frame_type, type, attrs, name, new_name)
+ *  Description:  Decides what f makes of one record of a frame. A modified record
+ *				  keeps only the attributes asked for, a rename that is not asked
+ *				  for is reported as its attributes under the new name.
+ *	  Arguments:  f          : The filter
+ *				  frame_type : FRAME_* type of the frame the record is in
+ *				  type       : REC_* type of the record, changed to what is sent
+ *				  attrs      : ATTR_* bits of the record, changed to what is sent
+ *				  name       : Name of the record
+ *				  new_name   : New name of a REC_RENAMED, or NULL
+ *        Locks:  None
+ *      Returns:  1 if the record is sent, 0 if it is not
+ * =====================================================================================
+ */
+int filter_record(struct filter* f, byte frame_type, byte* type, unsigned long* attrs,
+                  const char* name, const char* new_name);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  filter_frame(struct filter* f, struct updatebuf* frame)
+ *  Description:  Re-encodes a FRAME_UPDATES, FRAME_RESYNC or FRAME_SNAPSHOT with only
+ *				  the records f lets through. A modified record keeps only the
+ *				  attributes asked for, a rename that is not asked for is reported as
+ *				  its attributes under the new name. A resync or a snapshot lists
+ *				  every entry that matches, whatever the events. Frames of other types
+ *				  are left alone.
+ *	  Arguments:  f     : The filter, NULL lets everything through
+ *				  frame : The frame to filter
+ *        Locks:  None
+ *      Returns:  The filtered frame with one reference held by the caller, or NULL if
+ *				  no record of a FRAME_UPDATES or of a snapshot page that was not
+ *				  empty is left, or memory could not be allocated
+ *		  Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* filter_frame(struct filter* f, struct updatebuf* frame);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  filter_cached(struct filter* f, struct updatebuf* frame)
+ *  Description:  Same as filter_frame(...), but the result is kept in f, so every
+ *				  client that shares f is sent the same bytes
+ *	  Arguments:  f     : The filter
+ *				  frame : The frame to filter, a reference is taken until
+ *						  filterset_flush(...)
+ *        Locks:  None, the owner of the set of f serializes access to it
+ *      Returns:  The filtered frame, still owned by f, or NULL if nothing is left
+ * =====================================================================================
+ */
+struct updatebuf* filter_cached(struct filter* f, struct updatebuf* frame);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  filterset_flush(struct filterset* fs)
+ *  Description:  Lets go of the frames every filter in fs has kept
+ *	  Arguments:  fs : The set of filters
+ *        Locks:  None, the owner of fs serializes access to it
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void filterset_flush(struct filterset* fs);
+
+#endif  // FILTER_H
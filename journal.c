@@ -0,0 +1,105 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  journal.c
+ *
+ *    Description:  Ring of the most recent v2 update frames.
+ *
+ *        Version:  1.0
+ *        Created:  19/10/2026 16:20:09
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+
+#include "journal.h"
+
+/* The entry k updates after the oldest one */
+#define JOURNAL_AT(J, K)        (&(J)->ring[((J)->start + (K)) % (J)->size])
+
+int init_journal(struct journal* j, unsigned long size, size_t max_bytes)
+{
+	if ((j->ring = (struct journal_entry*)calloc(size, sizeof(struct journal_entry))) == NULL)
+		return -1;
+
+	j->size = size;
+	j->start = 0;
+	j->count = 0;
+	j->bytes = 0;
+	j->max_bytes = max_bytes;
+
+	return 0;
+}
+
+/* Lets go of the oldest frame */
+static void drop_oldest(struct journal* j)
+{
+	struct journal_entry* e;
+
+	e = JOURNAL_AT(j, 0);
+	j->bytes -= e->frame->len;
+	updatebuf_unref(e->frame);
+	e->frame = NULL;
+
+	j->start = (j->start + 1) % j->size;
+	j->count--;
+}
+
+void journal_append(struct journal* j, unsigned long first, unsigned long last,
+                    struct updatebuf* frame)
+{
+	struct journal_entry* e;
+
+	while (j->count > 0 && (j->count == j->size || j->bytes + frame->len > j->max_bytes))
+		drop_oldest(j);
+
+	// Keeping it would break the bound, and a client that missed it
+	// has to start over anyway
+	if (frame->len > j->max_bytes)
+		return;
+
+	e = JOURNAL_AT(j, j->count);
+	e->first = first;
+	e->last = last;
+	e->frame = updatebuf_ref(frame);
+
+	j->bytes += frame->len;
+	j->count++;
+}
+
+long journal_find(struct journal* j, unsigned long seq)
+{
+	unsigned long lo;
+	unsigned long hi;
+	unsigned long mid;
+
+	if (j->count > 0 && JOURNAL_AT(j, j->count - 1)->last == seq)
+		return j->count;
+
+	// The frames are in order, so look for the one right after seq
+	lo = 0;
+	hi = j->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (JOURNAL_AT(j, mid)->first <= seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == j->count || JOURNAL_AT(j, lo)->first != seq + 1)
+		return -1;
+
+	return (long)lo;
+}
+
+struct updatebuf* journal_frame(struct journal* j, unsigned long k)
+{
+	return JOURNAL_AT(j, k)->frame;
+}
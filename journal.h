@@ -0,0 +1,101 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  journal.h
+ *
+ *    Description:  Ring of the most recent v2 update frames, so a client that comes
+ *					back can be sent what it missed instead of everything there is.
+ *					Every change gets a sequence number, a frame covers the changes
+ *					first to last.
+ *
+ *        Version:  1.0
+ *        Created:  19/10/2026 16:02:44
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+#include "updatebuf.h"
+
+/* The frame of one update */
+struct journal_entry {
+	unsigned long first;            /* Sequence number of the first change */
+	unsigned long last;                     /* Sequence number of the last change */
+	struct updatebuf* frame;
+};
+
+/* Frames in the order they were sent, the oldest go once the ring is full */
+struct journal {
+	struct journal_entry* ring;
+	unsigned long size;                     /* Entries the ring holds */
+	unsigned long start;            /* Index of the oldest entry */
+	unsigned long count;
+	size_t bytes;                           /* Bytes of the frames in the ring */
+	size_t max_bytes;                       /* The oldest frames go before bytes gets over it */
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  init_journal(struct journal* j, unsigned long size, size_t max_bytes)
+ *  Description:  Initializes an empty journal
+ *	  Arguments:  j         : The journal
+ *				  size      : Most frames kept
+ *				  max_bytes : Most bytes of frames kept
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int init_journal(struct journal* j, unsigned long size, size_t max_bytes);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  journal_append(struct journal* j, unsigned long first,
+ *				                unsigned long last, struct updatebuf* frame)
+ *  Description:  Adds the frame of the newest update, dropping the oldest ones to
+ *				  make room. A frame bigger than max_bytes leaves the journal empty.
+ *	  Arguments:  j     : The journal
+ *				  first : Sequence number of the first change in frame
+ *				  last  : Sequence number of the last change in frame
+ *				  frame : The frame, a reference is taken
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void journal_append(struct journal* j, unsigned long first, unsigned long last,
+                    struct updatebuf* frame);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  journal_find(struct journal* j, unsigned long seq)
+ *  Description:  Finds where a client that has seen every change up to seq picks up
+ *	  Arguments:  j   : The journal
+ *				  seq : Sequence number of the last change the client has seen
+ *        Locks:  None
+ *      Returns:  Index of the first frame the client is missing, j->count if it is
+ *				  not missing any, or -1 if the changes after seq are not all in j
+ * =====================================================================================
+ */
+long journal_find(struct journal* j, unsigned long seq);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  journal_frame(struct journal* j, unsigned long k)
+ *  Description:  The frame k updates after the oldest one in j
+ *	  Arguments:  j : The journal
+ *				  k : Index of the frame, less than j->count
+ *        Locks:  None
+ *      Returns:  The frame, still owned by j
+ * =====================================================================================
+ */
+struct updatebuf* journal_frame(struct journal* j, unsigned long k);
+
+#endif  // JOURNAL_H
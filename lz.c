@@ -0,0 +1,243 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  lz.c
+ *
+ *    Description:  A small LZ77 block codec, and the FRAME_COMPRESSED frames built
+ *					with it.
+ *
+ *        Version:  1.0
+ *        Created:  21/10/2026 09:52:10
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Four bytes of p, in whatever order the machine keeps them */
+static uint32_t read32(const byte* p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Slot of the hash table four bytes are remembered in */
+static uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the extra bytes of a nibble that was 15 */
+static byte* put_length(byte* op, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = (byte)n;
+
+	return op;
+}
+
+/* Writes one sequence, a match of length 0 being the last one. Returns where
+   the next one goes, or NULL if out is full. */
+static byte* put_sequence(byte* op, byte* oend, const byte* lit, size_t nlit, size_t off,
+                          size_t mlen)
+{
+	byte* token;
+
+	// Room for the worst case, lengths of the most bytes
+	if ((size_t)(oend - op) < 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1)
+		return NULL;
+
+	token = op++;
+	*token = (byte)((nlit >= 15 ? 15 : nlit) << 4);
+	if (nlit >= 15)
+		op = put_length(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (mlen == 0)
+		return op;
+
+	*op++ = (byte)(off & 0xFF);
+	*op++ = (byte)(off >> 8);
+	mlen -= LZ_MIN_MATCH;
+	*token |= (byte)(mlen >= 15 ? 15 : mlen);
+	if (mlen >= 15)
+		op = put_length(op, mlen - 15);
+
+	return op;
+}
+
+size_t lz_compress(const byte* in, size_t len, byte* out, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];  /* Last offset each hash was seen at */
+	const byte* ip;                     /* Current position in in */
+	const byte* anchor;                 /* First byte not written yet */
+	const byte* limit;                  /* Where matches stop being looked for */
+	const byte* mlimit;                 /* Where matches stop being extended */
+	const byte* ref;                    /* Candidate match */
+	byte* op;                           /* Current position in out */
+	size_t mlen;
+	uint32_t h;
+
+	memset(table, 0, sizeof(table));
+	ip = in;
+	anchor = in;
+	op = out;
+	limit = len > LZ_LAST_LITERALS + LZ_MIN_MATCH ? in + len - LZ_LAST_LITERALS - LZ_MIN_MATCH : in;
+	mlimit = len > LZ_LAST_LITERALS ? in + len - LZ_LAST_LITERALS : in;
+
+	while (ip < limit) {
+		h = hash32(read32(ip));
+		ref = in + table[h];
+		table[h] = (uint32_t)(ip - in);
+
+		// An empty slot points at the start, which is never ahead of ip
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		for (mlen = LZ_MIN_MATCH; ip + mlen < mlimit && ref[mlen] == ip[mlen]; mlen++)
+			;
+
+		if ((op = put_sequence(op, out + cap, anchor, ip - anchor, ip - ref, mlen)) == NULL)
+			return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+
+	if ((op = put_sequence(op, out + cap, anchor, in + len - anchor, 0, 0)) == NULL)
+		return 0;
+
+	return op - out;
+}
+
+/* Reads the extra bytes of a nibble that was 15 and adds them to *n */
+static int get_length(const byte** ip, const byte* iend, size_t* n)
+{
+	byte b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+long lz_decompress(const byte* in, size_t len, byte* out, size_t cap)
+{
+	const byte* ip;
+	const byte* iend;
+	byte* op;
+	byte* oend;
+	size_t nlit;
+	size_t mlen;
+	size_t off;
+	size_t from;                            /* Where the match starts in out */
+	size_t k;
+	byte token;
+
+	ip = in;
+	iend = in + len;
+	op = out;
+	oend = out + cap;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		nlit = token >> 4;
+		if (nlit == 15 && get_length(&ip, iend, &nlit) < 0)
+			return -1;
+		if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+
+		// The last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		// A match can only reach back into what is already out
+		if (off == 0 || off > (size_t)(op - out))
+			return -1;
+		from = (op - out) - off;
+
+		mlen = token & 0x0F;
+		if (mlen == 15 && get_length(&ip, iend, &mlen) < 0)
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+
+		// Byte by byte, a match may overlap what it copies
+		for (k = 0; k < mlen; k++)
+			op[k] = out[from + k];
+		op += mlen;
+	}
+
+	return op - out;
+}
+
+struct updatebuf* compress_frame(struct updatebuf* frame, size_t min)
+{
+	struct updatebuf* packed;
+	struct updatebuf* expected;
+	byte* block;
+	size_t blen;
+	byte head[VARINT_MAX];
+	int n;
+
+	if (frame->len < min || (frame->data[0] != FRAME_UPDATES && frame->data[0] != FRAME_RESYNC
+	                         && frame->data[0] != FRAME_SNAPSHOT))
+		return updatebuf_ref(frame);
+
+	if ((packed = __atomic_load_n(&frame->packed, __ATOMIC_ACQUIRE)) != NULL)
+		return updatebuf_ref(packed);
+
+	// Anything that does not come out smaller is sent as it is
+	n = put_varint(head, frame->len);
+	if ((block = (byte*)malloc(frame->len)) == NULL)
+		return updatebuf_ref(frame);
+	blen = lz_compress(frame->data, frame->len, block + n, frame->len - n);
+	if (blen == 0 || blen + n + 1 + VARINT_MAX >= frame->len) {
+		// Kept as its own compressed copy, so it is not tried again
+		packed = frame;
+	} else {
+		memcpy(block, head, n);
+		packed = new_frame(FRAME_COMPRESSED, block, blen + n);
+	}
+	free(block);
+	if (packed == NULL)
+		return updatebuf_ref(frame);
+
+	expected = NULL;
+	if (!__atomic_compare_exchange_n(&frame->packed, &expected, packed, 0, __ATOMIC_ACQ_REL,
+	                                 __ATOMIC_ACQUIRE)) {
+		// Someone else got there first
+		if (packed != frame)
+			updatebuf_unref(packed);
+		packed = expected;
+	}
+
+	return updatebuf_ref(packed);
+}
@@ -0,0 +1,84 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  lz.h
+ *
+ *    Description:  A small LZ77 block codec, and the FRAME_COMPRESSED frames built
+ *					with it. A block is a run of sequences, each a token byte, the
+ *					literals, a two byte offset and the length of the match. The high
+ *					nibble of the token is the number of literals, the low one the
+ *					length of the match minus LZ_MIN_MATCH. A nibble of 15 is followed
+ *					by bytes that add to it, up to and including the first one that
+ *					is not 255. The last sequence has literals only.
+ *
+ *        Version:  1.0
+ *        Created:  21/10/2026 09:37:25
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+#include "common.h"
+#include "updatebuf.h"
+
+#define LZ_HASH_BITS		13			/* Positions remembered while compressing */
+#define LZ_MIN_MATCH		4			/* Shortest match worth a sequence */
+#define LZ_MAX_OFFSET		65535		/* Farthest back a match may start */
+#define LZ_LAST_LITERALS	5			/* Bytes at the end that are always literals */
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  lz_compress(const byte* in, size_t len, byte* out, size_t cap)
+ *  Description:  Compresses len bytes of in as one block
+ *	  Arguments:  in  : The bytes to compress
+ *				  len : Number of bytes in in
+ *				  out : Receives the block
+ *				  cap : Room in out
+ *        Locks:  None
+ *      Returns:  Size of the block, or 0 if it does not fit in cap bytes
+ * =====================================================================================
+ */
+size_t lz_compress(const byte* in, size_t len, byte* out, size_t cap);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  lz_decompress(const byte* in, size_t len, byte* out, size_t cap)
+ *  Description:  Decompresses a block made by lz_compress(...)
+ *	  Arguments:  in  : The block
+ *				  len : Size of the block
+ *				  out : Receives the bytes
+ *				  cap : Room in out
+ *        Locks:  None
+ *      Returns:  Number of bytes written to out, or -1 if the block is malformed or
+ *				  does not fit in cap bytes
+ * =====================================================================================
+ */
+long lz_decompress(const byte* in, size_t len, byte* out, size_t cap);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  compress_frame(struct updatebuf* frame, size_t min)
+ *  Description:  Wraps a FRAME_UPDATES, FRAME_RESYNC or FRAME_SNAPSHOT of at least min
+ *				  bytes in a FRAME_COMPRESSED. The compressed frame is kept with frame, so a
+ *				  frame shared by many clients is only compressed once. Frames that
+ *				  are smaller, of another type, or that do not shrink are left alone.
+ *	  Arguments:  frame : The frame to send
+ *				  min   : Smallest frame worth compressing
+ *        Locks:  None, the frame it is kept in is swapped in atomically
+ *      Returns:  The frame to send with one reference held by the caller, either the
+ *				  compressed one or frame itself
+ *		  Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* compress_frame(struct updatebuf* frame, size_t min);
+
+#endif  // LZ_H
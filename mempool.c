@@ -4,32 +4,158 @@
 
 #include "mempool.h"
 
-struct mempool*  init_mempool(unsigned long usize, unsigned long num_units)
+/* Bytes in front of the first unit of a slab */
+#define SLAB_HEADER     ((sizeof(struct memslab) + MEMPOOL_ALIGN - 1) & ~(MEMPOOL_ALIGN - 1))
+
+/* Marks a slab that is being released by mempool_trim */
+#define SLAB_DEAD       ((unsigned long)-1)
+
+/* Header of the unit that holds p */
+#define UNIT_OF(p)      ((struct memunit*)((char*)(p) - sizeof(struct memunit)))
+
+/* Pushes the chain head..tail onto the shared free list. Nothing is ever
+   popped without holding the lock, so this is safe without one. */
+static void push_units(struct mempool* mp, struct memunit* head, struct memunit* tail)
 {
-	struct mempool* new_mempool;
+	struct memunit* old;
+
+	old = __atomic_load_n(&mp->free_memblock, __ATOMIC_RELAXED);
+	do {
+		tail->next = old;
+	} while (!__atomic_compare_exchange_n(&mp->free_memblock, &old, head, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Pops a unit off the shared free list. Must hold lock, so a unit cannot
+   be popped and pushed back in between (ABA). */
+static struct memunit* pop_unit(struct mempool* mp)
+{
+	struct memunit* old;
+
+	old = __atomic_load_n(&mp->free_memblock, __ATOMIC_ACQUIRE);
+	while (old != NULL && !__atomic_compare_exchange_n(&mp->free_memblock, &old, old->next, 1,
+	                                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		;
+
+	return old;
+}
+
+/* Allocates a new slab and puts all of its units on the shared free list. Must
+   hold lock. */
+static int grow_mempool(struct mempool* mp)
+{
+	struct memslab* slab;
 	struct memunit* cur_unit;
+	struct memunit* first;
+	struct memunit* last;
 	unsigned long i;
 
-	new_mempool = (struct mempool*)malloc(sizeof(struct mempool));
-	new_mempool->unit_size = usize;
-	new_mempool->allocated_memblock = NULL;
-	new_mempool->free_memblock = NULL;
-	new_mempool->memblock_size = num_units * (usize + sizeof(struct memunit));
-	new_mempool->memblock = malloc(new_mempool->memblock_size);
+	slab = (struct memslab*)malloc(SLAB_HEADER + mp->num_units * mp->unit_stride);
+	if (slab == NULL)
+		return -1;
+
+	// Chain the units together, in address order
+	first = (struct memunit*)((char*)slab + SLAB_HEADER);
+	first->slab = slab;
+	last = first;
+	for (i = 1; i < mp->num_units; i++) {
+		cur_unit = (struct memunit*)((char*)first + i * mp->unit_stride);
+		cur_unit->slab = slab;
+		last->next = cur_unit;
+		last = cur_unit;
+	}
+	last->next = NULL;
 
-	if (new_mempool->memblock != NULL) {
-		for (i = 0; i < num_units; i++) {
-			cur_unit = (struct memunit*)((char*)new_mempool->memblock + i * (new_mempool->unit_size + sizeof(struct memunit)));
+	slab->next = mp->slabs;
+	slab->nfree = 0;
+	mp->slabs = slab;
+	mp->nslabs++;
 
-			cur_unit->prev = NULL;
-			cur_unit->next = new_mempool->free_memblock;
+	push_units(mp, first, last);
 
-			if (new_mempool->free_memblock != NULL) {
-				new_mempool->free_memblock->prev = cur_unit;
-			}
+	return 0;
+}
 
-			new_mempool->free_memblock = cur_unit;
-		}
+/* Gives the first n units of cache back to the shared free list */
+static void flush_cache(struct memcache* cache, int n)
+{
+	struct memunit* head;
+	struct memunit* tail;
+	int i;
+
+	if (n <= 0)
+		return;
+
+	head = cache->head;
+	tail = head;
+	for (i = 1; i < n; i++)
+		tail = tail->next;
+
+	cache->head = tail->next;
+	cache->count -= n;
+
+	push_units(cache->mp, head, tail);
+}
+
+/* Runs when a thread that has a cache exits */
+static void free_cache(void* arg)
+{
+	struct memcache* cache;
+
+	cache = (struct memcache*)arg;
+	flush_cache(cache, cache->count);
+	free(cache);
+}
+
+/* The cache of the calling thread, NULL if it could not be allocated */
+static struct memcache* get_cache(struct mempool* mp)
+{
+	struct memcache* cache;
+
+	if ((cache = (struct memcache*)pthread_getspecific(mp->cache_key)) != NULL)
+		return cache;
+
+	cache = (struct memcache*)calloc(1, sizeof(struct memcache));
+	if (cache == NULL)
+		return NULL;
+
+	cache->mp = mp;
+	if (pthread_setspecific(mp->cache_key, cache) != 0) {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+struct mempool*  init_mempool(unsigned long usize, unsigned long num_units)
+{
+	struct mempool* new_mempool;
+
+	new_mempool = (struct mempool*)calloc(1, sizeof(struct mempool));
+	if (new_mempool == NULL)
+		return NULL;
+
+	if (num_units == 0)
+		num_units = 1;
+
+	new_mempool->unit_size = usize;
+	new_mempool->unit_stride = (sizeof(struct memunit) + usize + MEMPOOL_ALIGN - 1) & ~(MEMPOOL_ALIGN - 1);
+	new_mempool->num_units = num_units;
+
+	// A thread never keeps more than half a slab to itself
+	new_mempool->cache_max = num_units / 2 < MEMPOOL_CACHE ? num_units / 2 : MEMPOOL_CACHE;
+
+	pthread_mutex_init(&new_mempool->lock, NULL);
+	if (pthread_key_create(&new_mempool->cache_key, free_cache) != 0) {
+		free(new_mempool);
+		return NULL;
+	}
+
+	if (grow_mempool(new_mempool) < 0) {
+		pthread_key_delete(new_mempool->cache_key);
+		free(new_mempool);
+		return NULL;
 	}
 
 	return new_mempool;
@@ -37,51 +163,169 @@ struct mempool*  init_mempool(unsigned long usize, unsigned long num_units)
 
 void free_mempool(struct mempool* mp)
 {
-	free(mp->memblock);
+	struct memslab* slab;
+
+	while ((slab = mp->slabs) != NULL) {
+		mp->slabs = slab->next;
+		free(slab);
+	}
+
+	pthread_key_delete(mp->cache_key);
+	pthread_mutex_destroy(&mp->lock);
+	free(mp);
 }
 
 void* mempool_alloc(struct mempool* mp, unsigned long usize)
 {
-	if (usize > mp->unit_size || mp->memblock == NULL || mp->free_memblock == NULL) {
-		return malloc(usize);
+	struct memcache* cache;
+	struct memunit* cur_unit;
+	struct memunit* extra;                  /* Taken along for the cache */
+	int i;
+
+	// Too big for a unit, so it gets a header of its own
+	if (usize > mp->unit_size) {
+		if ((cur_unit = (struct memunit*)malloc(sizeof(struct memunit) + usize)) == NULL)
+			return NULL;
+		cur_unit->slab = NULL;
+		return (void*)((char*)cur_unit + sizeof(struct memunit));
 	}
 
-	struct memunit* cur_unit = mp->free_memblock;
+	cache = get_cache(mp);
 
-	mp->free_memblock = cur_unit->next;
-	if (mp->free_memblock != NULL) {
-		mp->free_memblock->prev = NULL;
+	if (cache != NULL && cache->head != NULL) {
+		cur_unit = cache->head;
+		cache->head = cur_unit->next;
+		cache->count--;
+		return (void*)((char*)cur_unit + sizeof(struct memunit));
 	}
 
-	cur_unit->next = mp->allocated_memblock;
+	// LOCK : Take a unit, and some more for the cache, off the shared
+	//        free list, growing the pool if it is empty
+	pthread_mutex_lock(&mp->lock);
+
+	if ((cur_unit = pop_unit(mp)) == NULL && grow_mempool(mp) == 0)
+		cur_unit = pop_unit(mp);
 
-	if (mp->allocated_memblock != NULL) {
-		mp->allocated_memblock->prev = cur_unit;
+	if (cur_unit != NULL && cache != NULL) {
+		for (i = 0; i < mp->cache_max / 2; i++) {
+			if ((extra = pop_unit(mp)) == NULL)
+				break;
+			extra->next = cache->head;
+			cache->head = extra;
+			cache->count++;
+		}
 	}
 
-	mp->allocated_memblock = cur_unit;
+	// UNLOCK
+	pthread_mutex_unlock(&mp->lock);
+
+	if (cur_unit == NULL)
+		return NULL;
 
 	return (void*)((char*)cur_unit + sizeof(struct memunit));
 }
 
 void mempool_free(struct mempool* mp, void* p)
 {
-	if (mp->memblock < p && p < (void*)((char*)mp->memblock + mp->memblock_size)) {
-		struct memunit* cur_unit = (struct memunit*)((char*)p - sizeof(struct memunit));
+	struct memcache* cache;
+	struct memunit* cur_unit;
 
-		mp->allocated_memblock = cur_unit->next;
-		if (mp->allocated_memblock != NULL) {
-			mp->allocated_memblock->prev = NULL;
-		}
+	if (p == NULL)
+		return;
 
-		cur_unit->next = mp->free_memblock;
-		if (mp->free_memblock != NULL) {
-			mp->free_memblock->prev = cur_unit;
-		}
+	cur_unit = UNIT_OF(p);
+	if (cur_unit->slab == NULL) {
+		free(cur_unit);
+		return;
+	}
 
-		mp->free_memblock = cur_unit;
-	} else {
-		free(p);
+	if ((cache = get_cache(mp)) == NULL) {
+		push_units(mp, cur_unit, cur_unit);
+		return;
 	}
+
+	cur_unit->next = cache->head;
+	cache->head = cur_unit;
+	cache->count++;
+
+	// Keep half, so alternating frees and allocations stay in the cache
+	if (cache->count > mp->cache_max)
+		flush_cache(cache, cache->count - mp->cache_max / 2);
 }
 
+int mempool_trim(struct mempool* mp)
+{
+	struct memcache* cache;
+	struct memslab* slab;
+	struct memslab** link;
+	struct memunit* list;                   /* The whole shared free list */
+	struct memunit* cur_unit;
+	struct memunit* next;
+	struct memunit* head;                   /* Units that are kept */
+	struct memunit* tail;
+	int released;
+
+	// Units this thread holds on to would keep their slabs alive
+	if ((cache = (struct memcache*)pthread_getspecific(mp->cache_key)) != NULL)
+		flush_cache(cache, cache->count);
+
+	// LOCK : Nothing may be popped while the free list is taken apart
+	pthread_mutex_lock(&mp->lock);
+
+	if (mp->nslabs <= 1) {
+		pthread_mutex_unlock(&mp->lock);
+		return 0;
+	}
+
+	// Count the free units of each slab. Frees that happen meanwhile go
+	// on the (now empty) shared list and are simply not counted.
+	list = __atomic_exchange_n(&mp->free_memblock, NULL, __ATOMIC_ACQUIRE);
+	for (slab = mp->slabs; slab != NULL; slab = slab->next)
+		slab->nfree = 0;
+	for (cur_unit = list; cur_unit != NULL; cur_unit = cur_unit->next)
+		cur_unit->slab->nfree++;
+
+	// A slab with every unit free is released, as long as one slab is left
+	released = 0;
+	for (slab = mp->slabs; slab != NULL; slab = slab->next) {
+		if (slab->nfree == mp->num_units && mp->nslabs - released > 1) {
+			slab->nfree = SLAB_DEAD;
+			released++;
+		}
+	}
+
+	// Put the units of the remaining slabs back
+	head = NULL;
+	tail = NULL;
+	for (cur_unit = list; cur_unit != NULL; cur_unit = next) {
+		next = cur_unit->next;
+		if (cur_unit->slab->nfree == SLAB_DEAD)
+			continue;
+
+		cur_unit->next = NULL;
+		if (head == NULL)
+			head = cur_unit;
+		else
+			tail->next = cur_unit;
+		tail = cur_unit;
+	}
+
+	if (head != NULL)
+		push_units(mp, head, tail);
+
+	link = &mp->slabs;
+	while ((slab = *link) != NULL) {
+		if (slab->nfree == SLAB_DEAD) {
+			*link = slab->next;
+			free(slab);
+			mp->nslabs--;
+		} else {
+			link = &slab->next;
+		}
+	}
+
+	// UNLOCK
+	pthread_mutex_unlock(&mp->lock);
+
+	return released;
+}
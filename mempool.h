@@ -3,32 +3,58 @@
 #ifndef MEMPOOL_H
 #define MEMPOOL_H
 
-/* Stores the next and previous beginnings
-   of an entry in mempool */
+#include <pthread.h>
+
+#define MEMPOOL_CACHE           32              /* Most free units a thread keeps to itself */
+#define MEMPOOL_ALIGN           16              /* Alignment of every unit */
+
+struct memslab;
+
+/* Stores the beginning of an entry in mempool. next is only used
+   while the unit is free, slab is NULL if the unit was malloced. */
 struct memunit {
 	struct memunit* next;
-	struct memunit* prev;
+	struct memslab* slab;
+};
+
+/* A chunk of units, allocated in one go */
+struct memslab {
+	struct memslab* next;
+	unsigned long nfree;                    /* Only used while trimming */
+};
+
+/* Free units kept by one thread, so most allocations do not touch the
+   shared free list */
+struct memcache {
+	struct mempool* mp;
+	struct memunit* head;
+	int count;
 };
 
 /* A pool of memory */
 struct mempool {
-	void* memblock;
-
-	struct memunit* allocated_memblock;
-	struct memunit* free_memblock;
+	struct memunit* free_memblock;  /* Shared free list, pushed to without a lock */
+	struct memslab* slabs;
 
 	unsigned long unit_size;
-	unsigned long memblock_size;
+	unsigned long unit_stride;              /* Unit with its header, aligned */
+	unsigned long num_units;                /* Units in a slab */
+	unsigned long nslabs;
+	int cache_max;
+
+	pthread_mutex_t lock;                   /* Serializes taking from the free list and growing */
+	pthread_key_t cache_key;                /* The memcache of each thread */
 };
 
 /*
  * ===  FUNCTION  ======================================================================
  *         Name:  init_mempool(unsigned long usize, unsigned long num_units)
- *  Description:  Initializes a mempool structure
+ *  Description:  Initializes a mempool structure, with one slab of num_units units.
+ *				  The pool grows by a slab at a time when it runs out.
  *	  Arguments:  usize     : The size of the structure to store in the memory pool
- *				  num_units : How many structures that can be stored in mempool
+ *				  num_units : How many structures are stored in each slab
  *        Locks:  None
- *      Returns:  A new mempool structure
+ *      Returns:  A new mempool structure, or NULL if memory could not be allocated
  *		  Free?:  Yes
  * =====================================================================================
  */
@@ -37,12 +63,13 @@ struct mempool*  init_mempool(unsigned long usize, unsigned long num_units);
 /*
  * ===  FUNCTION  ======================================================================
  *         Name:  mempool_alloc(struct mempool* mp, unsigned long usize)
- *  Description:  Returns a portion of memory managed by the memory pool
+ *  Description:  Returns a portion of memory managed by the memory pool. Safe to call
+ *				  from any thread.
  *	  Arguments:  mp    : The memory pool to grab a chunk out of
  *				  usize : Size of structure to allocate
- *        Locks:  None
- *      Returns:  A chunk of memory in mp, or a newly malloced chunk of memory if
- *				  mempool is full
+ *        Locks:  lock : Only when the thread's own cache is empty
+ *      Returns:  A chunk of memory in mp, a newly malloced chunk of memory if usize
+ *				  is bigger than a unit, or NULL if memory could not be allocated
  *		  Free?:  Yes, with mempool_free
  * =====================================================================================
  */
@@ -51,7 +78,9 @@ void* mempool_alloc(struct mempool* mp, unsigned long usize);
 /*
  * ===  FUNCTION  ======================================================================
  *         Name:  mempool_free(struct mempool* mp, void* p)
- *  Description:  Frees p from mp
+ *  Description:  Frees p from mp. Safe to call from any thread, the unit is kept by
+ *				  the calling thread and returned to the shared free list once it has
+ *				  too many.
  *	  Arguments:  mp  : The memory pool to operate on
  *				  p   : The object to release back into mp
  *        Locks:  None
@@ -60,10 +89,24 @@ void* mempool_alloc(struct mempool* mp, unsigned long usize);
  */
 void  mempool_free(struct mempool* mp, void* p);
 
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  mempool_trim(struct mempool* mp)
+ *  Description:  Gives the memory of every slab whose units are all on the shared
+ *				  free list back to the system, keeping at least one slab. The calling
+ *				  thread's cache is flushed first, units cached by other threads keep
+ *				  their slab around.
+ *	  Arguments:  mp  : The memory pool to trim
+ *        Locks:  lock : While the free list is taken apart
+ *      Returns:  Number of slabs released
+ * =====================================================================================
+ */
+int mempool_trim(struct mempool* mp);
+
 /*
  * ===  FUNCTION  ======================================================================
  *         Name:  free_mempool(struct mempool* mp)
- *  Description:  Frees the chunk of memory used by mp
+ *  Description:  Frees every slab of mp, and mp itself
  *	  Arguments:  mp    : The memory pool to free
  *        Locks:  None
  *      Returns:  (void)
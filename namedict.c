@@ -0,0 +1,215 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  namedict.c
+ *
+ *    Description:  Per-connection table of names for protocol v2.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/2026 16:02:51
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "namedict.h"
+
+int init_namedict(struct namedict* d, unsigned long size)
+{
+	unsigned long i;
+
+	d->slots = NULL;
+	d->buckets = NULL;
+	d->size = 0;
+	d->next = 0;
+
+	if (size == 0)
+		return 0;
+
+	d->slots = (struct namedict_slot*)calloc(size, sizeof(struct namedict_slot));
+	d->buckets = (long*)malloc(size * sizeof(long));
+	if (d->slots == NULL || d->buckets == NULL) {
+		free(d->slots);
+		free(d->buckets);
+		d->slots = NULL;
+		d->buckets = NULL;
+		return -1;
+	}
+
+	for (i = 0; i < size; i++)
+		d->buckets[i] = NAMEDICT_NONE;
+	d->size = size;
+
+	return 0;
+}
+
+void namedict_clear(struct namedict* d)
+{
+	unsigned long i;
+
+	for (i = 0; i < d->size; i++) {
+		free(d->slots[i].name);
+		d->slots[i].name = NULL;
+		d->buckets[i] = NAMEDICT_NONE;
+	}
+	d->next = 0;
+}
+
+void free_namedict(struct namedict* d)
+{
+	namedict_clear(d);
+	free(d->slots);
+	free(d->buckets);
+	d->slots = NULL;
+	d->buckets = NULL;
+	d->size = 0;
+}
+
+/* Bucket of a name, one bucket per slot */
+static unsigned long hash_name(struct namedict* d, const char* name)
+{
+	unsigned long h = 5381;
+
+	while (*name != '\0')
+		h = h * 33 + (unsigned char)*name++;
+
+	return h % d->size;
+}
+
+/* Slot name is bound to, or NAMEDICT_NONE */
+static long find_name(struct namedict* d, const char* name)
+{
+	long s;
+
+	for (s = d->buckets[hash_name(d, name)]; s != NAMEDICT_NONE; s = d->slots[s].hnext) {
+		if (strcmp(d->slots[s].name, name) == 0)
+			return s;
+	}
+
+	return NAMEDICT_NONE;
+}
+
+/* Binds name to the next slot, unbinding whatever was there */
+static int bind_name(struct namedict* d, const char* name)
+{
+	struct namedict_slot* slot;
+	long* link;
+	long s;
+	char* copy;
+
+	if ((copy = strdup(name)) == NULL)
+		return -1;
+
+	s = d->next;
+	d->next = (d->next + 1) % d->size;
+	slot = &d->slots[s];
+
+	if (slot->name != NULL) {
+		for (link = &d->buckets[hash_name(d, slot->name)]; *link != s; link = &d->slots[*link].hnext)
+			;
+		*link = slot->hnext;
+		free(slot->name);
+	}
+
+	slot->name = copy;
+	link = &d->buckets[hash_name(d, copy)];
+	slot->hnext = *link;
+	*link = s;
+
+	return 0;
+}
+
+int namedict_put_name(struct namedict* d, struct updatebuf* ub, const char* name)
+{
+	long s;
+
+	if ((s = find_name(d, name)) != NAMEDICT_NONE)
+		return updatebuf_put_varint(ub, s + 1);
+
+	if (bind_name(d, name) < 0 || updatebuf_put_varint(ub, 0) < 0)
+		return -1;
+
+	return updatebuf_put_vstring(ub, name);
+}
+
+int namedict_get_name(struct namedict* d, const byte** p, const byte* end, char* name)
+{
+	unsigned long ref;                      /* Slot plus one, or 0 for a new name */
+	unsigned long len;
+	int n;
+
+	if ((n = get_varint(*p, end - *p, &ref)) < 0)
+		return -1;
+	*p += n;
+
+	if (ref > 0) {
+		if (ref > d->size || d->slots[ref - 1].name == NULL)
+			return -1;
+		strcpy(name, d->slots[ref - 1].name);
+		return 0;
+	}
+
+	if ((n = get_varint(*p, end - *p, &len)) < 0 || len > end - *p - n || len >= PATH_MAX)
+		return -1;
+
+	memcpy(name, *p + n, len);
+	name[len] = '\0';
+	*p += n + len;
+
+	return bind_name(d, name);
+}
+
+struct updatebuf* namedict_frame(struct namedict* d, struct updatebuf* frame)
+{
+	struct updatebuf* records;      /* The records, with names from d */
+	struct updatebuf* out;
+	const byte* p;                          /* Current position in frame */
+	const byte* end;
+	unsigned long seq;                      /* Sequence number of the last change */
+	unsigned long count;            /* Number of records */
+	unsigned long attrs;            /* Attributes of the current record */
+	unsigned long j;                        /* Index of the current record */
+	byte frame_type;
+	byte type;                                      /* Type of the current record */
+	int err;
+	char name[PATH_MAX];
+	char new_name[PATH_MAX];
+
+	frame_type = frame->data[0];
+	if (frame_type != FRAME_UPDATES && frame_type != FRAME_RESYNC && frame_type != FRAME_SNAPSHOT)
+		return updatebuf_ref(frame);
+
+	if (get_frame_records(frame, &seq, &count, &p) < 0 || (records = new_updatebuf()) == NULL)
+		return NULL;
+	end = frame->data + frame->len;
+
+	// Whatever was dropped before a resync may have bound names the
+	// other end never saw, so both ends start over
+	if (frame_type == FRAME_RESYNC)
+		namedict_clear(d);
+
+	err = 0;
+	for (j = 0; j < count && err == 0; j++) {
+		if ((err = get_record(&p, end, &type, &attrs, name, new_name)) < 0)
+			break;
+
+		err = updatebuf_put_byte(records, type);
+		if (type == REC_MODIFIED || type == REC_RENAMED)
+			err |= updatebuf_put_varint(records, attrs);
+		err |= namedict_put_name(d, records, name);
+		if (type == REC_RENAMED)
+			err |= namedict_put_name(d, records, new_name);
+	}
+
+	out = err == 0 ? new_records_frame(frame_type, seq, count, records) : NULL;
+	updatebuf_unref(records);
+
+	return out;
+}
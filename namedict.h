@@ -0,0 +1,128 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  namedict.h
+ *
+ *    Description:  Per-connection table of names for protocol v2. The first time a
+ *					name is sent it is bound to the next slot of the table, and from
+ *					then on records refer to it by the slot. Once every slot is taken,
+ *					they are reused in order. Both ends bind names the same way, so
+ *					the table itself is never sent. Every table is in a state of its
+ *					own, so each client that has one is sent frames encoded for it
+ *					alone rather than the ones shared by everyone.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/2026 15:44:09
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef NAMEDICT_H
+#define NAMEDICT_H
+
+#include "common.h"
+#include "updatebuf.h"
+
+#define NAMEDICT_NONE           (-1)            /* No slot */
+
+/* One slot of the table */
+struct namedict_slot {
+	char* name;                                     /* NULL until a name is bound to it */
+	long hnext;                                     /* Next slot in the same bucket */
+};
+
+/* Names bound on one connection */
+struct namedict {
+	struct namedict_slot* slots;
+	long* buckets;                          /* Slots by the hash of their name */
+	unsigned long size;                     /* Number of slots, 0 if names are sent as they are */
+	unsigned long next;                     /* Slot the next name is bound to */
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  init_namedict(struct namedict* d, unsigned long size)
+ *  Description:  Initializes an empty table
+ *	  Arguments:  d    : The table
+ *				  size : Number of slots, at most DICT_MAX. 0 leaves d unused.
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int init_namedict(struct namedict* d, unsigned long size);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  free_namedict(struct namedict* d)
+ *  Description:  Frees every name and slot of d, which is left unused
+ *	  Arguments:  d : The table
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void free_namedict(struct namedict* d);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  namedict_clear(struct namedict* d)
+ *  Description:  Unbinds every name, the next one goes to the first slot again
+ *	  Arguments:  d : The table
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void namedict_clear(struct namedict* d);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  namedict_put_name(struct namedict* d, struct updatebuf* ub, name)
+ *  Description:  Appends name to ub as a varint reference: the slot plus one if name
+ *				  is bound, otherwise 0 followed by the name as a varint length and
+ *				  the characters, which binds it
+ *	  Arguments:  d    : The table
+ *				  ub   : The buffer to append to
+ *				  name : The name
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int namedict_put_name(struct namedict* d, struct updatebuf* ub, const char* name);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  namedict_get_name(struct namedict* d, p, end, name)
+ *  Description:  Reads a name written by namedict_put_name(...), binding it if it
+ *				  is new, and advances past it
+ *	  Arguments:  d    : The table
+ *				  p    : Where the reference starts
+ *				  end  : One past the last byte that may be read
+ *				  name : Receives the name, PATH_MAX bytes long
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if the reference is malformed or memory could not
+ *				  be allocated
+ * =====================================================================================
+ */
+int namedict_get_name(struct namedict* d, const byte** p, const byte* end, char* name);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  namedict_frame(struct namedict* d, struct updatebuf* frame)
+ *  Description:  Re-encodes a FRAME_UPDATES, FRAME_RESYNC or FRAME_SNAPSHOT with every
+ *				  name written by namedict_put_name(...). A resync starts d over
+ *				  first. Frames of other types are left alone.
+ *	  Arguments:  d     : The table of the connection the frame is sent on
+ *				  frame : The frame, encoded the usual way
+ *        Locks:  None
+ *      Returns:  The frame to send with one reference held by the caller, or NULL if
+ *				  frame is malformed or memory could not be allocated
+ *		  Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* namedict_frame(struct namedict* d, struct updatebuf* frame);
+
+#endif  // NAMEDICT_H
@@ -0,0 +1,414 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  pending.c
+ *
+ *    Description:  Changes a client has not been sent yet, merged per inode.
+ *
+ *        Version:  1.0
+ *        Created:  19/10/2026 13:40:06
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pending.h"
+
+void pending_init(struct pending* pd, struct mempool* pool)
+{
+	pd->table = NULL;
+	pd->size = 0;
+	pd->count = 0;
+	pd->seq = 0;
+	pd->pool = pool;
+}
+
+/* Bucket to look for a (dev, ino) pair in */
+static unsigned long pending_bucket(struct pending* pd, dev_t dev, ino_t ino)
+{
+	unsigned long long h;
+
+	// Mix the bits, since inode numbers tend to be close together
+	h = ((unsigned long long)ino ^ ((unsigned long long)dev << 32)) * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+
+	return (unsigned long)(h & (pd->size - 1));
+}
+
+/* Doubles the number of buckets of pd (or allocates the first ones) */
+static int grow_pending(struct pending* pd)
+{
+	struct pending_entry** old;
+	struct pending_entry* e;
+	struct pending_entry* next;
+	unsigned long old_size;
+	unsigned long i;
+	unsigned long b;
+
+	old = pd->table;
+	old_size = pd->size;
+
+	pd->size = old_size == 0 ? PENDING_MIN : old_size * 2;
+	if ((pd->table = (struct pending_entry**)calloc(pd->size, sizeof(struct pending_entry*))) == NULL) {
+		pd->table = old;
+		pd->size = old_size;
+		return -1;
+	}
+
+	for (i = 0; i < old_size; i++) {
+		for (e = old[i]; e != NULL; e = next) {
+			next = e->hnext;
+			b = pending_bucket(pd, e->dev, e->ino);
+			e->hnext = pd->table[b];
+			pd->table[b] = e;
+		}
+	}
+	free(old);
+
+	return 0;
+}
+
+/* The entry the client knows (or will know) as name, for hard links share an inode */
+static struct pending_entry* find_live(struct pending* pd, dev_t dev, ino_t ino, const char* name)
+{
+	struct pending_entry* e;
+
+	for (e = pd->table[pending_bucket(pd, dev, ino)]; e != NULL; e = e->hnext) {
+		if (e->ino == ino && e->dev == dev && e->state != PENDING_REMOVED
+		    && strcmp(e->name, name) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+/* Adds an entry for the inode of ch. Either name may be NULL. */
+static int add_entry(struct pending* pd, const struct pending_change* ch, int state,
+                     const char* old_name, const char* name, unsigned long attrs)
+{
+	struct pending_entry* e;
+	unsigned long b;
+
+	// Keep about one entry per bucket. If the table cannot grow, the
+	// chains just get longer.
+	if (pd->count >= pd->size)
+		grow_pending(pd);
+
+	if ((e = (struct pending_entry*)mempool_alloc(pd->pool, sizeof(struct pending_entry))) == NULL)
+		return -1;
+
+	e->dev = ch->dev;
+	e->ino = ch->ino;
+	e->state = state;
+	e->attrs = attrs;
+	e->old_name = old_name != NULL ? strdup(old_name) : NULL;
+	e->name = name != NULL ? strdup(name) : NULL;
+	if ((old_name != NULL && e->old_name == NULL) || (name != NULL && e->name == NULL)) {
+		free(e->old_name);
+		free(e->name);
+		mempool_free(pd->pool, e);
+		return -1;
+	}
+
+	b = pending_bucket(pd, e->dev, e->ino);
+	e->hnext = pd->table[b];
+	pd->table[b] = e;
+	pd->count++;
+
+	return 0;
+}
+
+/* Unlinks e from its bucket and frees it */
+static void remove_entry(struct pending* pd, struct pending_entry* e)
+{
+	struct pending_entry** link;
+
+	link = &pd->table[pending_bucket(pd, e->dev, e->ino)];
+	while (*link != e)
+		link = &(*link)->hnext;
+	*link = e->hnext;
+
+	free(e->old_name);
+	free(e->name);
+	mempool_free(pd->pool, e);
+	pd->count--;
+}
+
+/* Points e at a new current name */
+static int rename_entry(struct pending_entry* e, const char* name)
+{
+	char* copy;
+
+	if ((copy = strdup(name)) == NULL)
+		return -1;
+
+	free(e->name);
+	e->name = copy;
+
+	return 0;
+}
+
+int pending_merge(struct pending* pd, const struct pending_change* ch)
+{
+	struct pending_entry* e;
+
+	if (pd->size == 0 && grow_pending(pd) < 0)
+		return -1;
+
+	// A new file is new whatever came before it, a removed one that
+	// comes back is reported as removed and then added again
+	if (ch->type == REC_ADDED)
+		return add_entry(pd, ch, PENDING_ADDED, NULL, ch->name, 0);
+
+	if ((e = find_live(pd, ch->dev, ch->ino, ch->name)) == NULL) {
+		// First the client hears of this entry since it fell behind
+		if (ch->type == REC_REMOVED)
+			return add_entry(pd, ch, PENDING_REMOVED, ch->name, NULL, 0);
+		if (ch->type == REC_RENAMED)
+			return add_entry(pd, ch, PENDING_PRESENT, ch->name, ch->new_name, ch->attrs);
+		return add_entry(pd, ch, PENDING_PRESENT, ch->name, ch->name, ch->attrs);
+	}
+
+	switch (ch->type) {
+	case REC_REMOVED:
+		// Added and removed again, the client never needs to know
+		if (e->state == PENDING_ADDED) {
+			remove_entry(pd, e);
+		} else {
+			e->state = PENDING_REMOVED;
+			e->attrs = 0;
+			free(e->name);
+			e->name = NULL;
+		}
+		return 0;
+	case REC_RENAMED:
+		if (rename_entry(e, ch->new_name) < 0)
+			return -1;
+		if (e->state == PENDING_PRESENT)
+			e->attrs |= ch->attrs;
+		return 0;
+	default:
+		// An added entry goes out with whatever attributes it ends up with
+		if (e->state == PENDING_PRESENT)
+			e->attrs |= ch->attrs;
+		return 0;
+	}
+}
+
+/* Whether e still has something to tell the client */
+static int entry_changed(struct pending_entry* e)
+{
+	return e->state != PENDING_PRESENT || e->attrs != 0 || strcmp(e->old_name, e->name) != 0;
+}
+
+/* Whether e goes out as a rename, which may have to wait for another one */
+static int entry_moved(struct pending_entry* e)
+{
+	return e->state == PENDING_PRESENT && strcmp(e->old_name, e->name) != 0;
+}
+
+/* Appends the record of e to ub, unless it is a rename */
+static int put_entry(struct updatebuf* ub, struct pending_entry* e)
+{
+	if (e->state == PENDING_ADDED)
+		return updatebuf_put_record(ub, REC_ADDED, 0, e->name, NULL);
+	if (e->state == PENDING_REMOVED)
+		return updatebuf_put_record(ub, REC_REMOVED, 0, e->old_name, NULL);
+
+	return updatebuf_put_record(ub, REC_MODIFIED, e->attrs, e->name, NULL);
+}
+
+static int compare_moves(const void* a, const void* b)
+{
+	return strcmp(((const struct pending_move*)a)->e->old_name,
+	              ((const struct pending_move*)b)->e->old_name);
+}
+
+/* Works out the order the n renames of pd go out in, so that no entry is
+   renamed to a name another one still goes by. A name is only ever left by
+   one rename and taken by one, so they form chains and cycles. A chain goes
+   out from its far end, a cycle has one entry parked under a name no entry
+   can have first. Fills recs in, at most 2n of them, and returns how many. */
+static int order_moves(struct pending* pd, struct pending_move* moves, int n,
+                       struct pending_rec* recs)
+{
+	struct pending_move key;
+	struct pending_move* m;
+	struct pending_entry* e;
+	unsigned long i;
+	int nrecs;
+	int k;
+	int j;
+
+	k = 0;
+	for (i = 0; i < pd->size; i++) {
+		for (e = pd->table[i]; e != NULL; e = e->hnext) {
+			if (!entry_moved(e))
+				continue;
+			moves[k].e = e;
+			moves[k].via = NULL;
+			moves[k].blocker = -1;
+			moves[k].pred = -1;
+			moves[k].done = 0;
+			k++;
+		}
+	}
+
+	// The rename that leaves the name each one goes to
+	qsort(moves, n, sizeof(struct pending_move), compare_moves);
+	for (k = 0; k < n; k++) {
+		key.e = &(struct pending_entry) { .old_name = moves[k].e->name };
+		m = (struct pending_move*)bsearch(&key, moves, n, sizeof(struct pending_move),
+		                                  compare_moves);
+		if (m != NULL) {
+			moves[k].blocker = m - moves;
+			m->pred = k;
+		}
+	}
+
+	nrecs = 0;
+	for (k = 0; k < n; k++) {
+		if (moves[k].done)
+			continue;
+
+		// Follow what is in the way, to the end of the chain or back to k
+		for (j = k; moves[j].blocker >= 0 && !moves[moves[j].blocker].done
+		     && moves[j].blocker != k; j = moves[j].blocker)
+			;
+
+		if (moves[j].blocker == k) {
+			// A name with a '/' in it is never an entry
+			e = moves[k].e;
+			if ((moves[k].via = (char*)malloc(strlen(e->old_name) + 2)) == NULL)
+				return -1;
+			sprintf(moves[k].via, "%s/", e->old_name);
+
+			recs[nrecs].from = e->old_name;
+			recs[nrecs].to = moves[k].via;
+			recs[nrecs].attrs = 0;
+			nrecs++;
+			j = moves[k].pred;
+		}
+
+		// Each rename frees the name the one before it goes to
+		for (; j >= 0 && !moves[j].done; j = moves[j].pred) {
+			e = moves[j].e;
+			recs[nrecs].from = moves[j].via != NULL ? moves[j].via : e->old_name;
+			recs[nrecs].to = e->name;
+			recs[nrecs].attrs = e->attrs;
+			nrecs++;
+			moves[j].done = 1;
+		}
+	}
+
+	return nrecs;
+}
+
+int pending_encode(struct pending* pd, struct updatebuf** frame)
+{
+	/* Order the records go out in, so that a name is freed before it is reused */
+	static const int order[] = { PENDING_REMOVED, PENDING_PRESENT, PENDING_ADDED };
+	struct updatebuf* records;      /* Payload of the frame */
+	struct pending_entry* e;
+	struct pending_move* moves;     /* Renames of the PRESENT group */
+	struct pending_rec* recs;       /* Their records, in the order they go out in */
+	unsigned long count;            /* Number of records */
+	unsigned long i;
+	int nmoves;
+	int nrecs;
+	int k;
+	int err;
+
+	count = 0;
+	nmoves = 0;
+	for (i = 0; i < pd->size; i++) {
+		for (e = pd->table[i]; e != NULL; e = e->hnext) {
+			count += entry_changed(e);
+			nmoves += entry_moved(e);
+		}
+	}
+
+	*frame = NULL;
+	if (count == 0) {
+		pending_clear(pd);
+		return 0;
+	}
+
+	if ((records = new_updatebuf()) == NULL)
+		return -1;
+
+	moves = NULL;
+	recs = NULL;
+	nrecs = 0;
+	err = 0;
+	if (nmoves > 0
+		    && ((moves = (struct pending_move*)malloc(nmoves * sizeof(struct pending_move))) == NULL
+	        || (recs = (struct pending_rec*)malloc(2 * nmoves * sizeof(struct pending_rec))) == NULL
+	        || (nrecs = order_moves(pd, moves, nmoves, recs)) < 0))
+		err = -1;
+
+	// Breaking a cycle takes one more record
+	count += nrecs - nmoves;
+	err |= updatebuf_put_varint(records, pd->seq) | updatebuf_put_varint(records, count);
+	for (k = 0; err == 0 && k < sizeof(order) / sizeof(order[0]); k++) {
+		for (i = 0; i < pd->size; i++) {
+			for (e = pd->table[i]; e != NULL; e = e->hnext) {
+				if (e->state == order[k] && entry_changed(e) && !entry_moved(e))
+					err |= put_entry(records, e);
+			}
+		}
+
+		if (order[k] != PENDING_PRESENT)
+			continue;
+		for (i = 0; i < nrecs; i++)
+			err |= updatebuf_put_record(records, REC_RENAMED, recs[i].attrs, recs[i].from,
+			                            recs[i].to);
+	}
+
+	if (err == 0)
+		*frame = new_frame(FRAME_UPDATES, records->data, records->len);
+	updatebuf_unref(records);
+
+	if (moves != NULL) {
+		for (k = 0; k < nmoves; k++)
+			free(moves[k].via);
+	}
+	free(moves);
+	free(recs);
+
+	// What could not be encoded is still there to be told
+	if (*frame == NULL)
+		return -1;
+	pending_clear(pd);
+
+	return 0;
+}
+
+void pending_clear(struct pending* pd)
+{
+	struct pending_entry* e;
+	struct pending_entry* next;
+	unsigned long i;
+
+	for (i = 0; i < pd->size; i++) {
+		for (e = pd->table[i]; e != NULL; e = next) {
+			next = e->hnext;
+			free(e->old_name);
+			free(e->name);
+			mempool_free(pd->pool, e);
+		}
+	}
+
+	free(pd->table);
+	pd->table = NULL;
+	pd->size = 0;
+	pd->count = 0;
+}
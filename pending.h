@@ -0,0 +1,141 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  pending.h
+ *
+ *    Description:  Changes a client has not been sent yet, merged per inode. A client
+ *					that falls behind gets the latest state of each entry, instead of
+ *					every step along the way.
+ *
+ *        Version:  1.0
+ *        Created:  19/10/2026 13:22:48
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef PENDING_H
+#define PENDING_H
+
+#include <sys/types.h>
+
+#include "common.h"
+#include "mempool.h"
+#include "updatebuf.h"
+
+#define PENDING_MIN             64                      /* Initial buckets of a table */
+
+#define PENDING_ADDED           1                       /* The client has not heard of the entry */
+#define PENDING_PRESENT         2                       /* The client knows the entry as old_name */
+#define PENDING_REMOVED         3                       /* The client knows the entry as old_name,
+                                                   which is gone */
+
+/* One change of an update, as it would go out in a record */
+struct pending_change {
+	byte type;                                      /* REC_* */
+	unsigned long attrs;            /* ATTR_* bits of REC_MODIFIED and REC_RENAMED */
+	dev_t dev;
+	ino_t ino;
+	const char* name;
+	const char* new_name;           /* Only for REC_RENAMED */
+};
+
+/* What a client has to be told about one inode. An inode that was removed
+   and then shows up again (or is reused) has a second, live entry. */
+struct pending_entry {
+	struct pending_entry* hnext;
+	dev_t dev;
+	ino_t ino;
+	int state;                                      /* PENDING_* */
+	unsigned long attrs;            /* Attributes modified since the client last heard */
+	char* old_name;                         /* Name the client knows, NULL if PENDING_ADDED */
+	char* name;                                     /* Current name, NULL if PENDING_REMOVED */
+};
+
+/* A rename of a PRESENT entry, while the order the renames go out in is
+   worked out */
+struct pending_move {
+	struct pending_entry* e;
+	char* via;                                      /* Name it is parked under in a cycle, or NULL */
+	int blocker;                            /* Rename away from the name it goes to, or -1 */
+	int pred;                                       /* Rename to the name it leaves, or -1 */
+	int done;                                       /* Whether its record has gone out */
+};
+
+/* One rename record, as it goes out */
+struct pending_rec {
+	const char* from;
+	const char* to;
+	unsigned long attrs;
+};
+
+/* Hash of pending entries by (dev, ino) */
+struct pending {
+	struct pending_entry** table;
+	unsigned long size;                     /* Number of buckets, a power of 2, 0 until used */
+	unsigned long count;            /* Number of entries */
+	unsigned long seq;                      /* Sequence number of the last change merged in */
+	struct mempool* pool;           /* Where entries come from */
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  pending_init(struct pending* pd, struct mempool* pool)
+ *  Description:  Initializes an empty table. Buckets are only allocated once the
+ *				  first change is merged in.
+ *	  Arguments:  pd   : The table
+ *				  pool : Memory pool of struct pending_entry to take entries from
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void pending_init(struct pending* pd, struct mempool* pool);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  pending_merge(struct pending* pd, const struct pending_change* ch)
+ *  Description:  Merges a change into the entry for its inode. Attribute bits are
+ *				  OR'ed together, renames keep the name the client knows, and an
+ *				  entry that is added and then removed again is forgotten altogether.
+ *	  Arguments:  pd : The table
+ *				  ch : The change, the names are copied
+ *        Locks:  None, the owner of pd serializes access to it
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int pending_merge(struct pending* pd, const struct pending_change* ch);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  pending_encode(struct pending* pd, struct updatebuf** frame)
+ *  Description:  Encodes every entry of pd as a FRAME_UPDATES up to pd->seq, removals
+ *				  first and additions last, and empties pd. A rename goes out after
+ *				  the one that frees the name it takes. Renames that swap names around
+ *				  have one entry parked under its old name followed by a '/' first.
+ *				  If the frame cannot be built, pd is left as it was.
+ *	  Arguments:  pd    : The table
+ *				  frame : Receives the frame with one reference held by the caller,
+ *				          or NULL if the changes cancelled each other out
+ *        Locks:  None, the owner of pd serializes access to it
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ *		  Free?:  Yes, the frame with updatebuf_unref
+ * =====================================================================================
+ */
+int pending_encode(struct pending* pd, struct updatebuf** frame);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  pending_clear(struct pending* pd)
+ *  Description:  Forgets every entry of pd, and gives its buckets back
+ *	  Arguments:  pd : The table
+ *        Locks:  None, the owner of pd serializes access to it
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void pending_clear(struct pending* pd);
+
+#endif  // PENDING_H
@@ -0,0 +1,277 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  sched.c
+ *
+ *    Description:  Runs the scans of the server from a timerfd, one at a time on a
+ *					long-lived worker thread.
+ *
+ *        Version:  1.0
+ *        Created:  22/10/2026 10:31:44
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "sched.h"
+
+/* Arms the timer to fire in ms, and every period after that unless the scans
+   stretch it */
+static void arm_timer(struct sched* s, long ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if (s->policy != SCHED_STRETCH)
+		its.it_interval = its.it_value;
+
+	if (timerfd_settime(s->timer_fd, 0, &its, NULL) < 0)
+		syslog(LOG_ERR, "Cannot arm scan timer: %s", strerror(errno));
+}
+
+/* Milliseconds from a to b */
+static long elapsed_ms(const struct timespec* a, const struct timespec* b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000L + (b->tv_nsec - a->tv_nsec) / 1000000L;
+}
+
+/* Handles ticks that are due at once, one of them a wake up if woken.
+   Called with lock held. */
+static void tick(struct sched* s, uint64_t ticks, int woken)
+{
+	// Periods that went by before the scheduler got to look were missed
+	// while it was busy, as good as skipped
+	if (ticks > 1) {
+		s->stats.overruns += ticks - 1;
+		s->stats.skipped += ticks - 1;
+	}
+
+	if (!s->running) {
+		s->due = 1;
+		pthread_cond_signal(&s->start);
+		return;
+	}
+
+	s->stats.overruns++;
+
+	// A wake up asks for changes the scan may have read the directory too
+	// early to see, so it is owed a scan whatever the policy. Only timer
+	// ticks are dropped, and a stretched timer is not armed during a scan.
+	if (s->policy == SCHED_SKIP && !woken) {
+		s->stats.skipped++;
+	} else {
+		s->stats.coalesced++;
+		s->due = 1;
+	}
+}
+
+static void* scheduler_thread(void* arg)
+{
+	struct sched* s;
+	struct pollfd fds[2];
+	uint64_t n;                                     /* Expirations, or wake ups */
+	uint64_t ticks;
+	int woken;
+
+	s = (struct sched*)arg;
+	fds[0].fd = s->timer_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = s->wake_fd;
+	fds[1].events = POLLIN;
+
+	for (;; ) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Scheduler cannot poll: %s", strerror(errno));
+			exit(1);
+		}
+
+		ticks = 0;
+		woken = 0;
+		if ((fds[0].revents & POLLIN) && read(s->timer_fd, &n, sizeof(n)) == sizeof(n))
+			ticks += n;
+		// Any number of wake ups is one scan
+		if ((fds[1].revents & POLLIN) && read(s->wake_fd, &n, sizeof(n)) == sizeof(n)) {
+			ticks++;
+			woken = 1;
+		}
+
+		if (ticks == 0)
+			continue;
+
+		// LOCK : The worker looks at due and running
+		pthread_mutex_lock(&s->lock);
+		tick(s, ticks, woken);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return((void*)0);
+}
+
+static void* worker_thread(void* arg)
+{
+	struct sched* s;
+	struct timespec begin;
+	struct timespec end;
+	long ms;
+
+	s = (struct sched*)arg;
+
+	for (;; ) {
+		// LOCK : Wait for a scan to be due
+		pthread_mutex_lock(&s->lock);
+		while (!s->due && !s->stop)
+			pthread_cond_wait(&s->start, &s->lock);
+		if (s->stop) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		s->due = 0;
+		s->running = 1;
+		pthread_mutex_unlock(&s->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		s->fn(s->arg);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ms = elapsed_ms(&begin, &end);
+
+		// LOCK : Account for the scan
+		pthread_mutex_lock(&s->lock);
+		s->running = 0;
+		s->stats.runs++;
+		s->stats.last_ms = ms;
+		if (ms > s->stats.longest_ms)
+			s->stats.longest_ms = ms;
+		if (s->policy == SCHED_STRETCH && ms > s->period_ms)
+			s->stats.stretched++;
+
+		// The next period starts now
+		if (s->policy == SCHED_STRETCH)
+			arm_timer(s, s->period_ms);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return((void*)0);
+}
+
+struct sched* sched_init(long period_ms, long min_ms, long max_ms, int policy, sched_fn fn,
+                         void* arg)
+{
+	struct sched* s;
+	pthread_attr_t tattr;                   /* The scheduler thread is never joined */
+	pthread_t worker;                       /* Only joined if the scheduler cannot start */
+	pthread_t tid;
+
+	if ((s = (struct sched*)calloc(1, sizeof(struct sched))) == NULL)
+		return NULL;
+
+	s->period_ms = period_ms;
+	s->min_ms = min_ms;
+	s->max_ms = max_ms;
+	s->policy = policy;
+	s->fn = fn;
+	s->arg = arg;
+	s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	s->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (s->timer_fd < 0 || s->wake_fd < 0) {
+		syslog(LOG_ERR, "Cannot create scan timer: %s", strerror(errno));
+		if (s->timer_fd >= 0)
+			close(s->timer_fd);
+		if (s->wake_fd >= 0)
+			close(s->wake_fd);
+		free(s);
+		return NULL;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->start, NULL);
+
+	pthread_attr_init(&tattr);
+	pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&worker, NULL, worker_thread, (void*)s) != 0)
+		goto fail;
+
+	if (pthread_create(&tid, &tattr, scheduler_thread, (void*)s) != 0) {
+		// LOCK : The worker would wait for a scan that never comes
+		pthread_mutex_lock(&s->lock);
+		s->stop = 1;
+		pthread_cond_signal(&s->start);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(worker, NULL);
+		goto fail;
+	}
+	pthread_detach(worker);
+	pthread_attr_destroy(&tattr);
+
+	arm_timer(s, period_ms);
+
+	return s;
+
+ fail:
+	syslog(LOG_ERR, "Cannot start scan threads");
+	pthread_attr_destroy(&tattr);
+	pthread_cond_destroy(&s->start);
+	pthread_mutex_destroy(&s->lock);
+	close(s->timer_fd);
+	close(s->wake_fd);
+	free(s);
+	return NULL;
+}
+
+void sched_wake(struct sched* s)
+{
+	uint64_t one = 1;
+
+	if (write(s->wake_fd, &one, sizeof(one)) != sizeof(one))
+		syslog(LOG_WARNING, "Cannot wake scheduler: %s", strerror(errno));
+}
+
+void sched_get_stats(struct sched* s, struct sched_stats* stats)
+{
+	// LOCK : Copy them all as of one moment
+	pthread_mutex_lock(&s->lock);
+	*stats = s->stats;
+	stats->period_ms = s->period_ms;
+	pthread_mutex_unlock(&s->lock);
+}
+
+long sched_adapt(struct sched* s, int found)
+{
+	long period;
+
+	// LOCK : The period is shared with the worker and the stats
+	pthread_mutex_lock(&s->lock);
+	period = found ? s->period_ms / 2 : s->period_ms * 2;
+	if (period < s->min_ms)
+		period = s->min_ms;
+	if (period > s->max_ms)
+		period = s->max_ms;
+
+	// A stretched timer is armed once the scan is done
+	if (period != s->period_ms && s->policy != SCHED_STRETCH)
+		arm_timer(s, period);
+	s->period_ms = period;
+	pthread_mutex_unlock(&s->lock);
+
+	return period;
+}
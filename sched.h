@@ -0,0 +1,130 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  sched.h
+ *
+ *    Description:  Runs the scans of the server from a timerfd. A scheduler thread
+ *					waits for the timer, and for early wake ups, and hands each scan to
+ *					one long-lived worker thread, so scans never overlap. What happens
+ *					to a tick that comes while a scan is still running is up to the
+ *					overrun policy. Given a range, the period adapts to how often the
+ *					scans find something: it is halved after a scan that did, and
+ *					doubled after one that did not, as told by sched_adapt(...).
+ *
+ *        Version:  1.0
+ *        Created:  22/10/2026 10:14:06
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <pthread.h>
+
+#define SCHED_SKIP              0               /* A timer tick during a scan is dropped,
+                                                   a wake up is not */
+#define SCHED_COALESCE          1               /* Ticks during a scan make one more scan
+                                                   right after it */
+#define SCHED_STRETCH           2               /* The next tick is a period after the scan
+                                                   ends, however long it took */
+
+/* Runs one scan */
+typedef void* (*sched_fn)(void* arg);
+
+/* What the scheduler has been through */
+struct sched_stats {
+	unsigned long runs;                     /* Scans run */
+	unsigned long overruns;                 /* Ticks that came while a scan was running */
+	unsigned long skipped;                  /* Of those, the ones dropped */
+	unsigned long coalesced;                /* The ones folded into the scan after */
+	unsigned long stretched;                /* Scans that took longer than the period, which
+	                                           pushed the next tick back */
+	long period_ms;                         /* Period in effect */
+	long last_ms;                           /* How long the last scan took */
+	long longest_ms;                        /* How long the longest one took */
+};
+
+/* The scheduler thread, the worker and what they share */
+struct sched {
+	int timer_fd;                           /* Fires every period */
+	int wake_fd;                            /* eventfd written to by sched_wake(...) */
+	long min_ms;                            /* Range the period adapts within */
+	long max_ms;
+	int policy;                             /* SCHED_SKIP, SCHED_COALESCE or SCHED_STRETCH */
+	sched_fn fn;
+	void* arg;
+	pthread_mutex_t lock;                   /* Protects everything below */
+	pthread_cond_t start;                   /* Signalled when a scan is due */
+	int due;                                /* A scan is owed, never more than one */
+	int running;                            /* The worker is in a scan */
+	int stop;                               /* Tells the worker to return, when the
+	                                           scheduler thread cannot start */
+	long period_ms;                         /* Time between two ticks right now */
+	struct sched_stats stats;
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sched_init(period_ms, min_ms, max_ms, policy, fn, arg)
+ *  Description:  Starts the scheduler and worker threads, which inherit the signal
+ *				  mask of the caller. The first scan is a period from now.
+ *	  Arguments:  period_ms : Time between two ticks to start with
+ *				  min_ms    : Shortest the period adapts down to
+ *				  max_ms    : Longest it backs off to, the same as min_ms to keep
+ *							  the period fixed
+ *				  policy    : SCHED_SKIP, SCHED_COALESCE or SCHED_STRETCH
+ *				  fn        : Run by the worker for each scan
+ *				  arg       : Passed to fn
+ *        Locks:  None
+ *      Returns:  A new sched structure or NULL on error
+ *		  Free?:  No
+ * =====================================================================================
+ */
+struct sched* sched_init(long period_ms, long min_ms, long max_ms, int policy, sched_fn fn,
+                         void* arg);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sched_wake(struct sched* s)
+ *  Description:  Asks for a scan right away, as if the timer had fired. Safe to
+ *				  call from any thread.
+ *	  Arguments:  s : The scheduler
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void sched_wake(struct sched* s);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sched_get_stats(struct sched* s, struct sched_stats* stats)
+ *  Description:  Copies what the scheduler has been through so far
+ *	  Arguments:  s     : The scheduler
+ *				  stats : Receives the counters
+ *        Locks:  lock : Held while they are copied
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void sched_get_stats(struct sched* s, struct sched_stats* stats);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sched_adapt(struct sched* s, int found)
+ *  Description:  Halves the period if a scan found something, doubles it if not,
+ *				  within the range given to sched_init(...). The timer is re-armed
+ *				  with the new period from now. Called by a scan, before it is done.
+ *	  Arguments:  s     : The scheduler
+ *				  found : Whether the scan found anything
+ *        Locks:  lock : Held while the period is changed
+ *      Returns:  The period in milliseconds from here on
+ * =====================================================================================
+ */
+long sched_adapt(struct sched* s, int found);
+
+#endif  // SCHED_H
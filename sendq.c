@@ -0,0 +1,155 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  sendq.c
+ *
+ *    Description:  Queue of encoded buffers waiting to be written to one non-blocking
+ *					socket.
+ *
+ *        Version:  1.0
+ *        Created:  19/10/2026 09:58:03
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "sendq.h"
+
+void sendq_init(struct sendq* q, struct mempool* pool)
+{
+	q->head = NULL;
+	q->tail = NULL;
+	q->bytes = 0;
+	q->pool = pool;
+}
+
+int sendq_push(struct sendq* q, struct updatebuf* ub)
+{
+	struct sendq_entry* e;
+
+	if ((e = (struct sendq_entry*)mempool_alloc(q->pool, sizeof(struct sendq_entry))) == NULL)
+		return -1;
+
+	e->next = NULL;
+	e->ub = updatebuf_ref(ub);
+	e->off = 0;
+
+	if (q->tail == NULL)
+		q->head = e;
+	else
+		q->tail->next = e;
+	q->tail = e;
+	q->bytes += ub->len;
+
+	return 0;
+}
+
+/* Takes the head off q and lets go of its buffer */
+static void pop_entry(struct sendq* q)
+{
+	struct sendq_entry* e;
+
+	e = q->head;
+	q->head = e->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+
+	q->bytes -= e->ub->len - e->off;
+	updatebuf_unref(e->ub);
+	mempool_free(q->pool, e);
+}
+
+int sendq_flush(struct sendq* q, int socketfd)
+{
+	struct iovec iov[SENDQ_IOV];
+	struct msghdr msg;
+	struct sendq_entry* e;
+	ssize_t nbytes;
+	size_t left;
+	int flags;
+	int n;
+
+	while (q->head != NULL) {
+		// Gather up as many buffers as one call takes
+		n = 0;
+		for (e = q->head; e != NULL && n < SENDQ_IOV; e = e->next) {
+			iov[n].iov_base = e->ub->data + e->off;
+			iov[n].iov_len = e->ub->len - e->off;
+			n++;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		// Only the last call lets a segment that is not full go out
+		flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+		if (e != NULL)
+			flags |= MSG_MORE;
+
+		if ((nbytes = sendmsg(socketfd, &msg, flags)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		// Let go of whatever made it out in full
+		while (nbytes > 0) {
+			left = q->head->ub->len - q->head->off;
+			if (nbytes < left) {
+				q->head->off += nbytes;
+				q->bytes -= nbytes;
+				break;
+			}
+			nbytes -= left;
+			pop_entry(q);
+		}
+	}
+
+	return 1;
+}
+
+int sendq_drop(struct sendq* q)
+{
+	struct sendq_entry* keep;       /* Partly written head, if there is one */
+	int dropped;
+
+	dropped = 0;
+	keep = NULL;
+	if (q->head != NULL && q->head->off > 0) {
+		keep = q->head;
+		q->head = keep->next;
+		keep->next = NULL;
+		q->bytes -= keep->ub->len - keep->off;
+	}
+
+	while (q->head != NULL) {
+		pop_entry(q);
+		dropped++;
+	}
+
+	if (keep != NULL) {
+		q->head = keep;
+		q->tail = keep;
+		q->bytes = keep->ub->len - keep->off;
+	}
+
+	return dropped;
+}
+
+void sendq_clear(struct sendq* q)
+{
+	while (q->head != NULL)
+		pop_entry(q);
+}
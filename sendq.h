@@ -0,0 +1,108 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  sendq.h
+ *
+ *    Description:  Queue of encoded buffers waiting to be written to one non-blocking
+ *					socket. Entries hold a reference to a shared updatebuf, so the same
+ *					bytes can sit in the queues of many clients without being copied.
+ *
+ *        Version:  1.0
+ *        Created:  19/10/2026 09:41:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <stddef.h>
+
+#include "mempool.h"
+#include "updatebuf.h"
+
+#define SENDQ_IOV               64                      /* Most entries written with one sendmsg() */
+
+/* One buffer in a queue, off bytes of which have been written already */
+struct sendq_entry {
+	struct sendq_entry* next;
+	struct updatebuf* ub;
+	size_t off;
+};
+
+/* Buffers waiting to be written, oldest first */
+struct sendq {
+	struct sendq_entry* head;
+	struct sendq_entry* tail;
+	size_t bytes;                           /* Bytes not written yet */
+	struct mempool* pool;           /* Where entries come from */
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sendq_init(struct sendq* q, struct mempool* pool)
+ *  Description:  Initializes an empty queue
+ *	  Arguments:  q    : The queue
+ *				  pool : Memory pool of struct sendq_entry to take entries from
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void sendq_init(struct sendq* q, struct mempool* pool);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sendq_push(struct sendq* q, struct updatebuf* ub)
+ *  Description:  Appends ub to q, taking a reference to it
+ *	  Arguments:  q  : The queue
+ *				  ub : The buffer to write out after everything already in q
+ *        Locks:  None, the owner of q serializes access to it
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int sendq_push(struct sendq* q, struct updatebuf* ub);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sendq_flush(struct sendq* q, int socketfd)
+ *  Description:  Writes as much of q to socketfd as it takes without blocking, and
+ *				  lets go of every buffer that has been written out in full. Every
+ *				  call to sendmsg() but the one with the end of q is made with
+ *				  MSG_MORE, so the buffers go out in full segments.
+ *	  Arguments:  q        : The queue
+ *				  socketfd : A non-blocking socket
+ *        Locks:  None, the owner of q serializes access to it
+ *      Returns:  1 if q is now empty, 0 if the socket is full, -1 on error
+ * =====================================================================================
+ */
+int sendq_flush(struct sendq* q, int socketfd);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sendq_drop(struct sendq* q)
+ *  Description:  Lets go of every buffer nothing has been written of. A buffer that
+ *				  is partly written is kept, so the stream stays in one piece.
+ *	  Arguments:  q : The queue
+ *        Locks:  None, the owner of q serializes access to it
+ *      Returns:  Number of buffers dropped
+ * =====================================================================================
+ */
+int sendq_drop(struct sendq* q);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  sendq_clear(struct sendq* q)
+ *  Description:  Lets go of every buffer in q
+ *	  Arguments:  q : The queue
+ *        Locks:  None, the owner of q serializes access to it
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void sendq_clear(struct sendq* q);
+
+#endif  // SENDQ_H
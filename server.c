@@ -16,6 +16,8 @@
  * =====================================================================================
  */
 
+#define _GNU_SOURCE                     /* statx */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,17 +26,31 @@
 #include <syslog.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <errno.h>
 #include <signal.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 
 #include "server.h"
 #include "common.h"
 #include "mempool.h"
+#include "dirwatch.h"
+#include "uring.h"
+#include "workpool.h"
+#include "updatebuf.h"
+#include "filter.h"
+#include "namedict.h"
+#include "lz.h"
+#include "stageq.h"
 
 // Do we want to daemonize?
 //#define DAEMONIZE
@@ -42,7 +58,7 @@
 /* Ensures mutual exclusion for clients linked list */
 pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
 /* Shared mask for all threads */
-sigset_t mask;
+static sigset_t mask;
 /* The name/path of the directory, as passed in the commandline argument */
 char init_dir[PATH_MAX];
 /* The full path to the directory */
@@ -50,284 +66,416 @@ char full_path[PATH_MAX];
 /* Represents all the currently connected clients */
 struct clientlist* clients;
 /* The previous contents/attributes of directory being monitored */
-struct direntrylist* prevdir;
-/* The current contents/attributes of directory being monitored */
-struct direntrylist* curdir;
-/* The period to monitor the directory */
+struct snapshot* prevdir;
+/* The current contents/attributes of directory being monitored, only set
+   while the diff stage holds update_lock */
+struct snapshot* curdir;
+/* The period to monitor the directory, in milliseconds, as last told to the
+   clients. Only changed by the main loop, with clients_lock held. */
 int gperiod;
 /* The update buffer */
-byte update_buff[MAX_FILENAME];
-/* Pipe used to send sockets to remove from the master list in the main thread */
-int remove_client_pipes[2];
-/* Memory pool for directory entry nodes */
-struct mempool* direntry_pool;
-/* Absolute path for file names */
-char abspath[PATH_MAX];
-/* Used to ensure that a socket is removed from the master fd list before proceeding */
-pthread_cond_t sready = PTHREAD_COND_INITIALIZER;
-/* Mutex that protects the sready condition */
-pthread_mutex_t slock = PTHREAD_MUTEX_INITIALIZER;
-/* Used in tandum with slock and sready */
-int done;
-
-struct direntrylist* init_direntrylist()
+byte update_buff[UPDATE_BUFF];
+/* epoll instance of the main loop */
+int epoll_fd;
+/* Memory pool for the connections watched by the main loop */
+struct mempool* conn_pool;
+/* Memory pool for the entries of the send queues */
+struct mempool* sendq_pool;
+/* Memory pool for the entries of the pending tables */
+struct mempool* pending_pool;
+/* Id of the next connection, only used by the main thread */
+unsigned long next_conn_id;
+/* Memory pool for snapshot segments */
+struct mempool* snapseg_pool;
+/* The monitored directory, kept open so entries are looked up relative to it */
+int dir_fd;
+/* Raw directory entries read in by exploredir, reused for every scan */
+byte dirent_buff[DIRENT_BUFF] __attribute__ ((aligned(8)));
+/* Names of the entries waiting to be stat'ed in one go, and the result for each */
+const char* scan_names[SCAN_BATCH];
+int scan_res[SCAN_BATCH];
+/* Attributes and io_uring requests of the entries in a batch */
+struct statx scan_stx[SCAN_BATCH];
+struct uring_statx_req scan_reqs[SCAN_BATCH];
+/* io_uring used to stat a batch at once, NULL for synchronous scans */
+struct uring* ring;
+/* Threads that share a synchronous stat batch, NULL for a single thread */
+struct workpool* scan_pool;
+/* Settings given on the command line */
+struct server_config gconfig = { SCAN_URING, 0, DEFAULT_MAX_CLIENTS, DEFAULT_BACKLOG,
+	                          DEFAULT_QUEUE_MAX, OVERFLOW_RESYNC, DEFAULT_JOURNAL_MAX,
+	                          DEFAULT_COMPRESS_MIN, SCHED_COALESCE, 0, 0 };
+/* inotify watch on the monitored directory, NULL if it is rescanned every period */
+struct dirwatch* watch;
+/* Runs scan_updates every period, and whenever the watch sees a change */
+struct sched* scheduler;
+/* Identifies this run of the server, sequence numbers start over with it */
+unsigned long gepoch;
+/* Sequence number of the last change sent out. Only changed by the main loop,
+   with clients_lock held. */
+unsigned long gseq;
+/* The most recent v2 updates, protected the same way as gseq */
+struct journal journal;
+/* Filters of the v2 clients, protected by clients_lock */
+struct filterset filters;
+/* Held by the diff stage while it works on prevdir and curdir */
+pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+/* prevdir as it was last paged out for a snapshot, protected by update_lock */
+struct snappages* snap_pages;
+/* Snapshots filled in by the scan stage, for the diff stage. NULL for a scan
+   that found nothing to look at. */
+struct stageq scanned;
+/* update_batch structures encoded by the diff stage, for the main loop */
+struct stageq encoded;
+/* Snapshots the main loop is done with, for the scan stage to fill in again */
+struct stageq free_snaps;
+/* eventfd of encoded, watched by the main loop */
+int updates_fd;
+/* Snapshot last filled in by the scan stage, which the next scan starts from */
+struct snapshot* last_scan;
+/* Sequence number of the last change encoded, protected by update_lock */
+unsigned long dseq;
+/* Batches queued by the diff stage, under update_lock, and batches sent out
+   by the main loop. The main loop is caught up when they are the same. */
+unsigned long dbatch;
+unsigned long fbatch;
+/* Set when a client is owed a resync, taken by the diff stage */
+int resync_wanted;
+/* Period the diff stage last encoded, only used by it */
+long dperiod;
+
+/* Copies the attributes returned by statx into attrs */
+static void set_snapattrs(struct snapattrs* attrs, const struct statx* stx)
 {
-	struct direntrylist* list;      /* New directory list */
-
-	// Allocate memory for a new directory list
-	list = (struct direntrylist*)malloc(sizeof(struct direntrylist));
-	if (list == NULL)
-		return NULL;
-
-	// Initialize to default values
-	list->count = 0;
-	list->head = NULL;
-	list->tail = NULL;
-
-	return list;
+	attrs->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	attrs->ino = stx->stx_ino;
+	attrs->mode = stx->stx_mode;
+	attrs->uid = stx->stx_uid;
+	attrs->gid = stx->stx_gid;
+	attrs->size = stx->stx_size;
+	attrs->atime.tv_sec = stx->stx_atime.tv_sec;
+	attrs->atime.tv_nsec = stx->stx_atime.tv_nsec;
+	attrs->mtime.tv_sec = stx->stx_mtime.tv_sec;
+	attrs->mtime.tv_nsec = stx->stx_mtime.tv_nsec;
+	attrs->ctime.tv_sec = stx->stx_ctime.tv_sec;
+	attrs->ctime.tv_nsec = stx->stx_ctime.tv_nsec;
 }
 
-void reuse_direntrylist(struct direntrylist* list)
+/* Synchronously stats the entries from (inclusive) to to (exclusive) of a stat_job */
+static void stat_range(void* arg, int from, int to)
 {
-	struct direntry* p;             /* Used to traverse the linked list */
-
-	p = list->head;
-	while (p != NULL) {
-		list->head = list->head->next;
-		p->next = NULL;
-		// Return memory back to pool
-		mempool_free(direntry_pool, p);
-		p = list->head;
-		list->count--;
+	struct stat_job* job;           /* The batch being stat'ed */
+	int i;                                          /* Index of the current entry */
+
+	job = (struct stat_job*)arg;
+
+	// Get the attributes of each entry, relative to the directory so the
+	// kernel does not walk the whole path again. Only what the diff
+	// compares is asked for, and cached attributes are good enough.
+	for (i = from; i < to; i++) {
+		if (statx(job->dirfd, job->names[i], DIRENTRY_STATX_FLAGS,
+		          DIRENTRY_STATX_MASK, &job->stx[i]) < 0)
+			job->results[i] = -errno;
+		else
+			job->results[i] = 0;
 	}
-
-	// NULL for both head and tail
-	list->tail = list->head;
 }
 
-int add_direntry(struct direntrylist* list, struct direntry* entry)
+int stat_direntries(const char** names, struct statx* stx, int* results, int n, int dirfd)
 {
-	// Make sure list is not empty
-	if (list == NULL)
-		return -1;
+	struct stat_job job;            /* Handed to the scan workers */
+	int i;                                          /* Index of the current entry */
+
+	// Submit the whole batch at once if there is a ring
+	if (ring != NULL) {
+		for (i = 0; i < n; i++) {
+			scan_reqs[i].name = names[i];
+			scan_reqs[i].buff = &stx[i];
+		}
+
+		if (uring_statx(ring, dirfd, DIRENTRY_STATX_FLAGS, DIRENTRY_STATX_MASK, scan_reqs, n) == 0) {
+			for (i = 0; i < n; i++)
+				results[i] = scan_reqs[i].res;
 
-	if (list->head == NULL) {           // List is emptry
-		list->head = entry;
-		list->tail = list->head;
-	} else if (list->head->next == NULL) { // 1 item in list
-		list->head->next = entry;
-		list->tail = list->head->next;
-	} else {                                                        // More than 1 item
-		list->tail->next = entry;
-		list->tail = entry;
+			return 0;
+		}
+
+		// The ring itself broke, so carry on without it
+		syslog(LOG_WARNING, "io_uring failed, using synchronous scans: %s", strerror(errno));
+		free_uring(ring);
+		ring = NULL;
 	}
 
-	list->count++;
+	job.names = names;
+	job.stx = stx;
+	job.results = results;
+	job.dirfd = dirfd;
 
-	return 1;
+	// Split big batches between the scan workers. Every entry keeps its
+	// own slot, so the batch comes out in the same order either way.
+	if (scan_pool != NULL && n >= SCAN_PARALLEL_MIN)
+		workpool_run(scan_pool, stat_range, (void*)&job, n);
+	else
+		stat_range((void*)&job, 0, n);
+
+	return 0;
 }
 
-struct direntry* find_direntry(struct direntrylist* list, struct direntry* entry)
+/* Stats the first n entries of scan_names and adds the ones that still exist to snap */
+static void add_scan_batch(struct snapshot* snap, int dirfd, int n)
 {
-	struct direntry* p;
-
-	// Make sure list is not empty
-	if (list == NULL)
-		return NULL;
-
-	p = list->head;
-	while (p != NULL) {
-		// Check for equality based on the inode, which should
-		// be unique under the assumption that all the files
-		// in the monitored directory are on the same filesystem
-		if (p->attrs.st_ino == entry->attrs.st_ino) {
-			return p;
+	struct snapattrs attrs;         /* Attributes of the current entry */
+	int i;                                          /* Index of the current entry */
+
+	stat_direntries(scan_names, scan_stx, scan_res, n, dirfd);
+
+	for (i = 0; i < n; i++) {
+		if (scan_res[i] == 0) {
+			set_snapattrs(&attrs, &scan_stx[i]);
+			if (snapshot_add(snap, scan_names[i], &attrs) < 0) {
+				kill_clients("Unrecoverable server error! ; Exiting now!");
+				syslog(LOG_ERR, "Cannot grow snapshot");
+				exit(1);
+			}
+			continue;
 		}
 
-		p = p->next;
-	}
+		// The entry was removed (or renamed away) after it was listed
+		if (scan_res[i] == -ENOENT)
+			continue;
 
-	return NULL;
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot get stats on file: %s", scan_names[i]);
+		exit(1);
+	}
 }
 
-int exploredir(struct direntrylist* list, const char* path)
+int exploredir(struct snapshot* snap, int dirfd)
 {
-	struct stat fattr;                      /* Used to store attributes of a file entry */
-	struct direntry* list_entry;    /* Used to capture information about file entry */
-	struct dirent** entries;        /* Stores each file entry's name and stuff */
-	int n;                                                  /* How many file entries are in the directory */
-	int i;                                                  /* Used to traverse file entries */
-
-	// Alphabetize the entries in the directory since Linux is stupid
-	// and doesn't do this by default, which Mac OS X does...
-	if ((n = scandir(path, &entries, 0, alphasort)) < 0) {
-		// Send error message to all clients and then exit
-		kill_clients(remove_client_pipes[1], "Cannot open directory! ; Exiting now!");
-		syslog(LOG_ERR, "Cannot open directory: %s", path);
-		exit(1);
-	}
+	struct linux_dirent64* dent;    /* Current entry in dirent_buff */
+	long n;                                                 /* How many bytes of entries were read in */
+	long i;                                                 /* Offset of the current entry in dirent_buff */
+	int nbatch;                                             /* Entries in scan_names */
 
-	// Delete reference to current directory (.)
-	free(entries[0]);
-	// Delete reference to parent directory (..)
-	free(entries[1]);
+	// Start reading from the first entry again
+	if (lseek(dirfd, 0, SEEK_SET) < 0)
+		return -1;
 
-	// Start after . and ..
-	i = 2;
-	while (i < n) {
-		list_entry = (struct direntry*)mempool_alloc(direntry_pool, sizeof(struct direntry));
-		list_entry->next = NULL;
-		memset(list_entry, 0, sizeof(list_entry));
+	// Read the raw entries a buffer full at a time, and get the attributes
+	// of everything that was read in one batch. The order is whatever the
+	// filesystem returns, since the diff does not care. The names are used
+	// straight out of dirent_buff, so a batch never outlives its buffer.
+	nbatch = 0;
+	while ((n = syscall(SYS_getdents64, dirfd, dirent_buff, sizeof(dirent_buff))) > 0) {
+		for (i = 0; i < n; i += dent->d_reclen) {
+			dent = (struct linux_dirent64*)(dirent_buff + i);
 
-		if (list_entry == NULL) {
-			// Mempool has no free nodes and malloc failed
-			kill_clients(remove_client_pipes[1], "Unrecoverable server error! ; Exiting now!");
-			syslog(LOG_ERR, "Cannot malloc direntry");
-			exit(1);
-		}
+			// Skip current (.) and parent (..) directory
+			if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+				continue;
 
-		// Make sure absolute path is not too long
-		if ((strlen(path) + strlen(entries[i]->d_name) + 1) >= PATH_MAX) {
-			kill_clients(remove_client_pipes[1], "Unrecoverable server error! ; Exiting now!");
-			syslog(LOG_ERR, "Path is too long.");
-			exit(1);
-		} else {
-			strcpy(abspath, path);
-			strcat(abspath, "/");
-			strcat(abspath, entries[i]->d_name);
+			scan_names[nbatch++] = dent->d_name;
+
+			if (nbatch == SCAN_BATCH) {
+				add_scan_batch(snap, dirfd, nbatch);
+				nbatch = 0;
+			}
 		}
 
-		// Get the attributes of the file entry
-		if (stat(abspath, &fattr) < 0) {
-			kill_clients(remove_client_pipes[1], "Unrecoverable server error! ; Exiting now!");
-			syslog(LOG_ERR, "Cannot get stats on file: %s", entries[i]->d_name);
-			exit(1);
+		if (nbatch > 0) {
+			add_scan_batch(snap, dirfd, nbatch);
+			nbatch = 0;
 		}
+	}
+
+	return n < 0 ? -1 : 0;
+}
 
-		// Make sure just the file name is not too long
-		if (strlen(entries[i]->d_name) > MAX_FILENAME) {
-			syslog(LOG_ERR, "Filename is too long to be saved.");
+int refreshdir(struct snapshot* snap, struct snapshot* prev,
+               struct dirchangeset* changes, int dirfd)
+{
+	struct dirchange* change;               /* Used to traverse changes */
+	int i;                                                  /* Index of an entry in prev, or a bucket in changes */
+	int nbatch;                                             /* Entries in scan_names */
+
+	// Entries the kernel reported nothing for still have the same
+	// attributes, so they are copied over without going to the disk
+	for (i = 0; i < prev->count; i++) {
+		if (dirchangeset_contains(changes, SNAP_NAME(prev, i)))
+			continue;
+
+		if (snapshot_copy(snap, prev, i) < 0) {
+			kill_clients("Unrecoverable server error! ; Exiting now!");
+			syslog(LOG_ERR, "Cannot grow snapshot");
 			exit(1);
 		}
+	}
 
-		// Copy the file entry name into direntry representation
-		strcpy(list_entry->filename, entries[i]->d_name);
-		list_entry->attrs = fattr;
-
-		// Add the list entry now
-		add_direntry(list, list_entry);
+	// Only the changed entries need to be looked at again
+	nbatch = 0;
+	for (i = 0; i < DIRWATCH_BUCKETS; i++) {
+		for (change = changes->buckets[i]; change != NULL; change = change->next) {
+			scan_names[nbatch++] = change->name;
 
-		free(entries[i]);
-		i++;
+			if (nbatch == SCAN_BATCH) {
+				add_scan_batch(snap, dirfd, nbatch);
+				nbatch = 0;
+			}
+		}
 	}
 
-	free(entries);
+	if (nbatch > 0)
+		add_scan_batch(snap, dirfd, nbatch);
 
 	return 0;
 }
 
 void append_diff(byte* buff, const char* mode, const char* filename, const char* desc)
 {
-	size_t len;             /* Used to find length of filename */
+	// (! OR - OR + OR >) filename human_description, cut short
+	// if it does not fit in a single string of the protocol
+	snprintf(buff, UPDATE_BUFF, "%s %s%s", mode, filename, desc);
+}
 
-	// Zero out buffer
-	memset(buff, 0, sizeof(buff));
+/* Sets the bits of every attribute that differs between entry i of prev and entry
+   j of cur in the mask of i, and returns how many there are. A rename always
+   changes the file status time, so it is not reported again for a renamed entry. */
+static int compare_entries(struct snapshot* prev, int i, struct snapshot* cur, int j, int renamed)
+{
+	struct snapseg* p;                      /* Segment of entry i */
+	struct snapseg* c;                      /* Segment of entry j */
+	int ndiffs;                             /* Number of differences found */
+
+	p = SNAP_SEG(prev, i);
+	c = SNAP_SEG(cur, j);
+	i = SNAP_SLOT(i);
+	j = SNAP_SLOT(j);
+	ndiffs = 0;
 
-	// (! OR - OR +) filename human_description
-	len = strlen(filename);
-	strcat(buff, mode);
-	strcat(buff + 1, " ");
-	strcat(buff + 2, filename);
-	strcat(buff + 2 + len, desc);
+	// Permissions
+	if (p->mode[i] != c->mode[j]) {
+		SET_MODIFIED(p->mask[i]);
+		SET_PERM(p->mask[i]);
+		ndiffs++;
+	}
+	// UID
+	if (p->uid[i] != c->uid[j]) {
+		SET_MODIFIED(p->mask[i]);
+		SET_UID(p->mask[i]);
+		ndiffs++;
+	}
+	// GID
+	if (p->gid[i] != c->gid[j]) {
+		SET_MODIFIED(p->mask[i]);
+		SET_GID(p->mask[i]);
+		ndiffs++;
+	}
+	// Size
+	if (p->size[i] != c->size[j]) {
+		SET_MODIFIED(p->mask[i]);
+		SET_SIZE(p->mask[i]);
+		ndiffs++;
+	}
+	// Access time
+	if (!SNAP_TIME_EQ(p->atime[i], c->atime[j])) {
+		SET_MODIFIED(p->mask[i]);
+		SET_LAT(p->mask[i]);
+		ndiffs++;
+	}
+	// Modified time
+	if (!SNAP_TIME_EQ(p->mtime[i], c->mtime[j])) {
+		SET_MODIFIED(p->mask[i]);
+		SET_LMT(p->mask[i]);
+		ndiffs++;
+	}
+	// File status time
+	if (!SNAP_TIME_EQ(p->ctime[i], c->ctime[j]) && !renamed) {
+		SET_MODIFIED(p->mask[i]);
+		SET_LFST(p->mask[i]);
+		ndiffs++;
+	}
+
+	return ndiffs;
+}
+
+/* Whether entry j of cur is entry i of prev under the same name */
+static int same_entry(struct snapshot* prev, int i, struct snapshot* cur, int j)
+{
+	return j < cur->count
+	       && SNAP_FIELD(cur, ino, j) == SNAP_FIELD(prev, ino, i)
+	       && SNAP_FIELD(cur, dev, j) == SNAP_FIELD(prev, dev, i)
+	       && strcmp(SNAP_NAME(cur, j), SNAP_NAME(prev, i)) == 0;
 }
 
 int difference_direntrylist()
 {
 	int ndiffs;                                             /* Number of differences found */
-	struct direntry* entry_prev;    /* Pointer to iterate through previous direntrylist */
-	struct direntry* entry_cur;             /* Pointer to iterate through current direntry list */
+	int i;                                                  /* Index of an entry in prevdir */
+	int j;                                                  /* Index of an entry in curdir */
+	int next;                                               /* Entry of curdir after the last match */
 
 	ndiffs = 0;
 
-	// Populate the curdir list with entries in directory right now
-	exploredir(curdir, (const char*)full_path);  /* Global variable: full_path */
-
 	// No differences if there is no entries in the directory
 	if (curdir->count == 0 && prevdir->count == 0) {
 		return 0;
 	}
 
-	entry_prev = prevdir->head;
-	while (entry_prev != NULL) {
-		if ((entry_cur = find_direntry(curdir, entry_prev)) != NULL
-		    && !IS_CHECKED(entry_prev->mask)) {
-			// Permissions
-			if (entry_prev->attrs.st_mode != entry_cur->attrs.st_mode) {
-				SET_MODIFIED(entry_prev->mask);
-				SET_PERM(entry_prev->mask);
-				ndiffs++;
-			}
-			// UID
-			if (entry_prev->attrs.st_uid != entry_cur->attrs.st_uid) {
-				SET_MODIFIED(entry_prev->mask);
-				SET_UID(entry_prev->mask);
-				ndiffs++;
-			}
-			// GID
-			if (entry_prev->attrs.st_gid != entry_cur->attrs.st_gid) {
-				SET_MODIFIED(entry_prev->mask);
-				SET_GID(entry_prev->mask);
-				ndiffs++;
-			}
-			// Size
-			if (entry_prev->attrs.st_size != entry_cur->attrs.st_size) {
-				SET_MODIFIED(entry_prev->mask);
-				SET_SIZE(entry_prev->mask);
-				ndiffs++;
-			}
-			// Access time
-			if (entry_prev->attrs.st_atime != entry_cur->attrs.st_atime) {
-				SET_MODIFIED(entry_prev->mask);
-				SET_LAT(entry_prev->mask);
-				ndiffs++;
-			}
-			// Modified time
-			if (entry_prev->attrs.st_mtime != entry_cur->attrs.st_mtime) {
-				SET_MODIFIED(entry_prev->mask);
-				SET_LMT(entry_prev->mask);
-				ndiffs++;
-			}
-			// File status time
-			if (entry_prev->attrs.st_ctime != entry_cur->attrs.st_ctime) {
-				SET_MODIFIED(entry_prev->mask);
-				SET_LFST(entry_prev->mask);
-				ndiffs++;
-			}
+	// First match up the entries that still have the same name, so a
+	// hard link to an entry cannot be mistaken for a rename of it. Both
+	// snapshots tend to list the entries in the same order, so the entry
+	// after the last match is tried before going through the index.
+	next = 0;
+	for (i = 0; i < prevdir->count; i++) {
+		j = next;
+		if (!same_entry(prevdir, i, curdir, j)) {
+			j = snapshot_find(curdir, SNAP_FIELD(prevdir, dev, i), SNAP_FIELD(prevdir, ino, i),
+			                  SNAP_NAME(prevdir, i), 1 << CHECKED);
+			if (j == SNAP_NONE || strcmp(SNAP_NAME(curdir, j), SNAP_NAME(prevdir, i)) != 0)
+				continue;
+		}
+
+		ndiffs += compare_entries(prevdir, i, curdir, j, 0);
+
+		// Show that the entries have been checked for differences
+		// and not to check them again
+		SET_CHECKED(SNAP_FIELD(prevdir, mask, i));
+		SET_CHECKED(SNAP_FIELD(curdir, mask, j));
+		next = j + 1;
+	}
 
-			// Show that the entries have been checked for differences
-			// and not to check them again
-			SET_CHECKED(entry_prev->mask);
-			SET_CHECKED(entry_cur->mask);
+	// Whatever is left was either renamed or removed
+	for (i = 0; i < prevdir->count; i++) {
+		if (IS_CHECKED(SNAP_FIELD(prevdir, mask, i)))
+			continue;
+
+		j = snapshot_find(curdir, SNAP_FIELD(prevdir, dev, i), SNAP_FIELD(prevdir, ino, i),
+		                  SNAP_NAME(prevdir, i), 1 << CHECKED);
+		if (j != SNAP_NONE) {
+			// Same file under a different name, report it as one rename
+			// rather than a remove and an add
+			SET_RENAMED(SNAP_FIELD(prevdir, mask, i));
+			SNAP_FIELD(prevdir, match, i) = j;
+			ndiffs++;
+			ndiffs += compare_entries(prevdir, i, curdir, j, 1);
+
+			SET_CHECKED(SNAP_FIELD(prevdir, mask, i));
+			SET_CHECKED(SNAP_FIELD(curdir, mask, j));
 		} else {
 			// If a previous entry cannot be found in the current directory,
 			// it was removed
-			SET_REMOVED(entry_prev->mask);
+			SET_REMOVED(SNAP_FIELD(prevdir, mask, i));
 			ndiffs++;
 		}
-
-		entry_prev = entry_prev->next;
 	}
 
 	// Now check for any entries that have been added to the monitored
 	// directory
-	entry_cur = curdir->head;
-	while (entry_cur != NULL) {
-		if (!IS_CHECKED(entry_cur->mask)) {
-			SET_ADDED(entry_cur->mask);
+	for (j = 0; j < curdir->count; j++) {
+		if (!IS_CHECKED(SNAP_FIELD(curdir, mask, j))) {
+			SET_ADDED(SNAP_FIELD(curdir, mask, j));
 			ndiffs++;
 		}
-
-		entry_cur = entry_cur->next;
 	}
 
 	return ndiffs;
@@ -360,22 +508,33 @@ void create_daemon(const char* name)
 	openlog(name, LOG_CONS, LOG_DAEMON);
 }
 
+static void wake_updates(void)
+{
+	// Have the scheduler run an update right away
+	if (scheduler != NULL)
+		sched_wake(scheduler);
+}
+
+/* Logs what the scan scheduler has been through */
+static void log_sched_stats(void)
+{
+	struct sched_stats st;
+
+	if (scheduler == NULL)
+		return;
+
+	sched_get_stats(scheduler, &st);
+	syslog(LOG_INFO, "Scans: %lu run every %ld ms, last %ld ms, longest %ld ms; %lu overruns, "
+	       "%lu skipped, %lu coalesced, %lu stretched", st.runs, st.period_ms, st.last_ms,
+	       st.longest_ms, st.overruns, st.skipped, st.coalesced, st.stretched);
+}
+
 static void* signal_thread(void* arg)
 {
-	pthread_attr_t tattr;           /* Used to set thread to detached mode */
 	int err;                                        /* Indicates an error from sigwait */
 	int signo;                                      /* The signal number that has been caught */
-	pthread_t tid;                          /* ID of the thread that has been spawnned */
-
-	// Make sure any threads that are spawned are detached, so the OS
-	// can reclaim the resources in a timely fashion
-	pthread_attr_init(&tattr);
-	pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
 
 	for (;; ) {
-		// Check directory for updates
-		alarm(gperiod);
-
 		// Block until signal has been caught
 		err = sigwait(&mask, &signo);
 		if (err != 0) {
@@ -387,21 +546,20 @@ static void* signal_thread(void* arg)
 		case SIGHUP:
 			// Finish transfers, remove all clients
 			syslog(LOG_INFO, "Received SIGHUP");
-			kill_clients(remove_client_pipes[1], "Server received SIGHUP; Disconnect all clients.");
+			kill_clients("Server received SIGHUP; Disconnect all clients.");
 			break;
-		case SIGALRM:
-			// See if directory has updated
-			syslog(LOG_INFO, "Received SIGALRM");
-			pthread_create(&tid, &tattr, send_updates, NULL);
+		case SIGUSR1:
+			// How the scans have kept up with the period
+			log_sched_stats();
 			break;
 		case SIGINT:
 			// Mainly used when not running in daemon mode
 			syslog(LOG_INFO, "Received SIGINT");
-			kill_clients(remove_client_pipes[1], "Server received SIGINT; Disconnect all clients.");
+			kill_clients("Server received SIGINT; Disconnect all clients.");
 			exit(0);
 		case SIGTERM:
 			syslog(LOG_INFO, "Received SIGTERM");
-			kill_clients(remove_client_pipes[1], "Server received SIGTERM; Disconnect all clients.");
+			kill_clients("Server received SIGTERM; Disconnect all clients.");
 			exit(0);
 		default:
 			syslog(LOG_ERR, "Unexpected signal: %d", signo);
@@ -410,279 +568,1208 @@ static void* signal_thread(void* arg)
 	}
 }
 
-void* send_updates(void* arg)
+/* Appends one update string to enc, starting a new chunk when the current one is full */
+static void put_update(struct update_encoder* enc, const char* mode, const char* filename,
+                       const char* desc)
 {
-	struct client* p;                       /* Pointer to traverse through client list */
-	struct direntry* entry;         /* Pointer to traverse through a direntry list */
-	struct direntrylist* tmp;       /* Used as tmp storage to swap prevdir and curdir */
-	int sent;                                       /* How many updates have been sent so far */
-	int diffs;                                      /* The number of differences in monitored directory */
-	int more_diffs;                         /* If diffs > 254, save how many more need to be sent */
+	append_diff(update_buff, mode, filename, desc);
+
+	if (enc->count == UPDATE_CHUNK) {
+		enc->count_at = enc->ub->len;
+		enc->count = 0;
+		if (updatebuf_put_byte(enc->ub, 0) < 0)
+			goto fail;
+	}
 
-	// Get number of differences found in monitored directory
-	diffs = difference_direntrylist();
-	more_diffs = 0;
+	if (updatebuf_put_string(enc->ub, update_buff) < 0)
+		goto fail;
 
-	// If there are more than 254 changed entries, send the first 254 updates
-	// then send in separate update the rest of the updates
-	if (diffs > 254) {
-		more_diffs = diffs - 254;
-		diffs = 254;
+	// The count of a chunk is only known once it is done
+	enc->ub->data[enc->count_at] = (byte)++enc->count;
+	return;
+
+ fail:
+	kill_clients("Unrecoverable server error! ; Exiting now!");
+	syslog(LOG_ERR, "Cannot grow update buffer");
+	exit(1);
+}
+
+struct updatebuf* encode_updates()
+{
+	struct update_encoder enc;      /* The update being built */
+	int i;                                          /* Index of an entry in a snapshot */
+	int emask;                                      /* Differences found for the current entry */
+	const char* name;                       /* Name an entry is reported under */
+
+	// Starts out as a lone count of 0, which is NO_UPDATES
+	if ((enc.ub = new_updatebuf()) == NULL || updatebuf_put_byte(enc.ub, NO_UPDATES) < 0) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot allocate update buffer");
+		exit(1);
+	}
+	enc.count_at = 0;
+	enc.count = 0;
+
+	// Now examine bitmask of each entry in prevdir and see if attributes
+	// have changed or if entry has been renamed or removed
+	for (i = 0; i < prevdir->count; i++) {
+		emask = SNAP_FIELD(prevdir, mask, i);
+		name = SNAP_NAME(prevdir, i);
+
+		// v1 clients have no notion of a rename, and are told of the old
+		// name going away here and of the new one showing up with the
+		// entries that were added
+		if (IS_RENAMED(emask)) {
+			put_update(&enc, "-", name, " ");
+		} else if (IS_MODIFIED(emask)) {
+			if (IS_PERM(emask))
+				put_update(&enc, "!", name, " -> permissions");
+			if (IS_UID(emask))
+				put_update(&enc, "!", name, " -> UID");
+			if (IS_GID(emask))
+				put_update(&enc, "!", name, " -> GID");
+			if (IS_SIZE(emask))
+				put_update(&enc, "!", name, " -> size");
+			if (IS_LAT(emask))
+				put_update(&enc, "!", name, " -> last access time");
+			if (IS_LMT(emask))
+				put_update(&enc, "!", name, " -> last modfied time");
+			if (IS_LFST(emask))
+				put_update(&enc, "!", name, " -> last file status time");
+		} else if (IS_REMOVED(emask)) {
+			put_update(&enc, "-", name, " ");
+		}
 	}
 
-	// LOCK : Make sure clients is not altered while sending updates
+	// Now examine the current state of the monitored directory and see
+	// if any entries have been added
+	for (i = 0; i < curdir->count; i++) {
+		if (IS_ADDED(SNAP_FIELD(curdir, mask, i)))
+			put_update(&enc, "+", SNAP_NAME(curdir, i), " ");
+	}
+	for (i = 0; i < prevdir->count; i++) {
+		if (IS_RENAMED(SNAP_FIELD(prevdir, mask, i)))
+			put_update(&enc, "+", SNAP_NAME(curdir, SNAP_FIELD(prevdir, match, i)), " ");
+	}
+
+	return enc.ub;
+}
+
+/* The ATTR_* bits of a record for the attributes set in a snapshot mask */
+static unsigned long record_attrs(int emask)
+{
+	unsigned long attrs;
+
+	attrs = 0;
+	if (IS_PERM(emask))
+		attrs |= ATTR_PERM;
+	if (IS_UID(emask))
+		attrs |= ATTR_UID;
+	if (IS_GID(emask))
+		attrs |= ATTR_GID;
+	if (IS_SIZE(emask))
+		attrs |= ATTR_SIZE;
+	if (IS_LAT(emask))
+		attrs |= ATTR_LAT;
+	if (IS_LMT(emask))
+		attrs |= ATTR_LMT;
+	if (IS_LFST(emask))
+		attrs |= ATTR_LFST;
+
+	return attrs;
+}
+
+/* Appends one record to ub. new_name is only used by REC_RENAMED. */
+static void put_record(struct updatebuf* ub, byte type, unsigned long attrs,
+                       const char* name, const char* new_name)
+{
+	if (updatebuf_put_record(ub, type, attrs, name, new_name) < 0) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot grow update buffer");
+		exit(1);
+	}
+}
+
+struct updatebuf* encode_frames(int diffs, unsigned long* seq)
+{
+	struct updatebuf* records;      /* Payload of the frame */
+	struct updatebuf* frame;        /* The whole frame */
+	unsigned long count;            /* Number of records */
+	int i;                                          /* Index of an entry in a snapshot */
+	int emask;                                      /* Differences found for the current entry */
+
+	if (diffs == 0)
+		return NULL;
+
+	// One record per entry, whatever changed about it
+	count = 0;
+	for (i = 0; i < prevdir->count; i++) {
+		if (SNAP_FIELD(prevdir, mask, i) & ((1 << RENAMED) | (1 << MODIFIED) | (1 << REMOVED)))
+			count++;
+	}
+	for (i = 0; i < curdir->count; i++) {
+		if (IS_ADDED(SNAP_FIELD(curdir, mask, i)))
+			count++;
+	}
+
+	*seq += count;
+	if ((records = new_updatebuf()) == NULL || updatebuf_put_varint(records, *seq) < 0
+	    || updatebuf_put_varint(records, count) < 0) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot allocate update buffer");
+		exit(1);
+	}
+
+	for (i = 0; i < prevdir->count; i++) {
+		emask = SNAP_FIELD(prevdir, mask, i);
+
+		if (IS_RENAMED(emask))
+			put_record(records, REC_RENAMED, record_attrs(emask), SNAP_NAME(prevdir, i),
+			           SNAP_NAME(curdir, SNAP_FIELD(prevdir, match, i)));
+		else if (IS_MODIFIED(emask))
+			put_record(records, REC_MODIFIED, record_attrs(emask), SNAP_NAME(prevdir, i), NULL);
+		else if (IS_REMOVED(emask))
+			put_record(records, REC_REMOVED, 0, SNAP_NAME(prevdir, i), NULL);
+	}
+
+	for (i = 0; i < curdir->count; i++) {
+		if (IS_ADDED(SNAP_FIELD(curdir, mask, i)))
+			put_record(records, REC_ADDED, 0, SNAP_NAME(curdir, i), NULL);
+	}
+
+	frame = new_frame(FRAME_UPDATES, records->data, records->len);
+	updatebuf_unref(records);
+
+	if (frame == NULL) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot allocate update buffer");
+		exit(1);
+	}
+
+	return frame;
+}
+
+/* Appends one record to ub if f lets it through, as f has it. Returns 1 if
+   it was appended. */
+static int put_filtered(struct updatebuf* ub, struct filter* f, byte type, unsigned long attrs,
+                        const char* name, const char* new_name)
+{
+	byte sent_type;
+
+	sent_type = type;
+	if (!filter_record(f, FRAME_UPDATES, &sent_type, &attrs, name, new_name))
+		return 0;
+
+	// A rename kept as a modification is about the new name
+	put_record(ub, sent_type, attrs, sent_type != type ? new_name : name, new_name);
+	return 1;
+}
+
+struct updatebuf* encode_filtered(struct filter* f, unsigned long seq)
+{
+	struct updatebuf* records;      /* Payload of the frame, after the count */
+	struct updatebuf* frame;        /* The whole frame */
+	unsigned long kept;                     /* Number of records */
+	int i;                                          /* Index of an entry in a snapshot */
+	int emask;                                      /* Differences found for the current entry */
+
+	if ((records = new_updatebuf()) == NULL) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot allocate update buffer");
+		exit(1);
+	}
+
+	kept = 0;
+	for (i = 0; i < prevdir->count; i++) {
+		emask = SNAP_FIELD(prevdir, mask, i);
+
+		if (IS_RENAMED(emask))
+			kept += put_filtered(records, f, REC_RENAMED, record_attrs(emask),
+			                     SNAP_NAME(prevdir, i),
+			                     SNAP_NAME(curdir, SNAP_FIELD(prevdir, match, i)));
+		else if (IS_MODIFIED(emask))
+			kept += put_filtered(records, f, REC_MODIFIED, record_attrs(emask),
+			                     SNAP_NAME(prevdir, i), NULL);
+		else if (IS_REMOVED(emask))
+			kept += put_filtered(records, f, REC_REMOVED, 0, SNAP_NAME(prevdir, i), NULL);
+	}
+
+	for (i = 0; i < curdir->count; i++) {
+		if (IS_ADDED(SNAP_FIELD(curdir, mask, i)))
+			kept += put_filtered(records, f, REC_ADDED, 0, SNAP_NAME(curdir, i), NULL);
+	}
+
+	frame = NULL;
+	if (kept > 0 && (frame = new_records_frame(FRAME_UPDATES, seq, kept, records)) == NULL) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot allocate update buffer");
+		exit(1);
+	}
+	updatebuf_unref(records);
+
+	return frame;
+}
+
+/* Encodes the frame of b once for every filter in use, from the snapshot
+   masks, so no record is encoded for a filter that leaves it out. A filter
+   interned later is left to filter_cached(...). Called by the diff stage
+   with update_lock held. */
+static void encode_filters(struct update_batch* b)
+{
+	struct filter* f;
+	int k;
+
+	// LOCK : The filters in use only change with clients_lock held
 	pthread_mutex_lock(&clients_lock);
+	if (filters.count > 0
+	    && ((b->filters = (struct filter**)malloc(filters.count * sizeof(struct filter*))) == NULL
+	        || (b->filtered = (struct updatebuf**)malloc(filters.count * sizeof(struct updatebuf*)))
+	        == NULL)) {
+		free(b->filters);
+		b->filters = NULL;
+		pthread_mutex_unlock(&clients_lock);
+		return;
+	}
+	for (f = filters.head, k = 0; f != NULL; f = f->next, k++)
+		b->filters[k] = filter_ref(f);
+	b->nfilters = k;
+	// UNLOCK
+	pthread_mutex_unlock(&clients_lock);
 
-	p = clients->head;
-	while (p != NULL) {
-		// LOCK : Make sure client is not removed while update is being
-		//        sent out
-		pthread_mutex_lock(p->c_lock);
+	// What a filter asks for does not change once it is interned
+	for (k = 0; k < b->nfilters; k++)
+		b->filtered[k] = encode_filtered(b->filters[k], b->seq);
+}
+
+/* The frame of b as f lets it through, still owned by b or f, or NULL if
+   nothing is left. Called by the main loop with clients_lock held. */
+static struct updatebuf* batch_filtered(struct update_batch* b, struct filter* f)
+{
+	int k;
+
+	for (k = 0; k < b->nfilters; k++) {
+		if (b->filters[k] == f)
+			return b->filtered[k];
+	}
+
+	return filter_cached(f, b->frame);
+}
+
+struct updatebuf* encode_resync(struct snapshot* snap, unsigned long seq)
+{
+	struct updatebuf* records;      /* Payload of the frame */
+	struct updatebuf* frame;        /* The whole frame */
+	int i;                                          /* Index of an entry in snap */
+
+	if ((records = new_updatebuf()) == NULL || updatebuf_put_varint(records, seq) < 0
+	    || updatebuf_put_varint(records, snap->count) < 0) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot allocate update buffer");
+		exit(1);
+	}
 
-		// Reset
-		sent = 0;
+	for (i = 0; i < snap->count; i++)
+		put_record(records, REC_ADDED, 0, SNAP_NAME(snap, i), NULL);
 
-		// Send number of entries that have changed
-		if (send_byte(p->socket, ((byte)diffs)) <= 0) {
-			syslog(LOG_ERR, "Could not send number of changed entries");
+	frame = new_frame(FRAME_RESYNC, records->data, records->len);
+	updatebuf_unref(records);
+
+	if (frame == NULL) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot allocate update buffer");
+		exit(1);
+	}
+
+	return frame;
+}
+
+void snappages_unref(struct snappages* sp)
+{
+	int k;
+
+	if (__atomic_sub_fetch(&sp->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	for (k = 0; k < sp->count; k++) {
+		if (sp->pages[k] != NULL)
+			updatebuf_unref(sp->pages[k]);
+	}
+	free(sp->pages);
+	free(sp);
+}
+
+struct snappages* get_snappages()
+{
+	struct snappages* sp;
+	struct updatebuf* records;      /* Records of the current page */
+	int i;                                          /* Index of an entry in prevdir */
+	int k;                                          /* Index of the current page */
+	int n;                                          /* Entries in the current page */
+
+	// Every client that connects before the next change is sent the
+	// same pages
+	if (snap_pages != NULL && snap_pages->seq == gseq) {
+		__atomic_add_fetch(&snap_pages->refs, 1, __ATOMIC_RELAXED);
+		return snap_pages;
+	}
+
+	if ((sp = (struct snappages*)calloc(1, sizeof(struct snappages))) == NULL)
+		return NULL;
+	sp->refs = 1;
+	sp->seq = gseq;
+	sp->entries = prevdir->count;
+	sp->count = (prevdir->count + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE + 1;
+	if ((sp->pages = (struct updatebuf**)calloc(sp->count, sizeof(struct updatebuf*))) == NULL) {
+		free(sp);
+		return NULL;
+	}
+
+	// The last page is left empty, which tells the client it is done
+	i = 0;
+	for (k = 0; k < sp->count; k++) {
+		if ((records = new_updatebuf()) == NULL)
+			break;
+		for (n = 0; n < SNAPSHOT_PAGE && i < prevdir->count; n++, i++)
+			put_record(records, REC_ADDED, 0, SNAP_NAME(prevdir, i), NULL);
+		sp->pages[k] = new_records_frame(FRAME_SNAPSHOT, gseq, n, records);
+		updatebuf_unref(records);
+		if (sp->pages[k] == NULL)
+			break;
+	}
+
+	if (k < sp->count) {
+		snappages_unref(sp);
+		return NULL;
+	}
+
+	if (snap_pages != NULL)
+		snappages_unref(snap_pages);
+	snap_pages = sp;
+	__atomic_add_fetch(&sp->refs, 1, __ATOMIC_RELAXED);
+
+	return sp;
+}
+
+/* Stops streaming a snapshot to p */
+static void drop_snapshot(struct client* p)
+{
+	if (p->snap != NULL)
+		snappages_unref(p->snap);
+	p->snap = NULL;
+}
+
+void close_client(struct client* p)
+{
+	p->closing = 1;
+	sendq_clear(&p->out);
+	pending_clear(&p->pending);
+	drop_snapshot(p);
+	shutdown(p->socket, SHUT_RDWR);
+}
+
+/* Queues ub for p, through the name table of p if it has one, then
+   compressed if p asked for it */
+static int push_client(struct client* p, struct updatebuf* ub)
+{
+	struct updatebuf* own;          /* ub with the names of p */
+	struct updatebuf* packed;       /* What is queued */
+	int ret;
+
+	// Names are bound in the order they are queued, which is the order
+	// the client reads them in. So a client with a table gets a frame of
+	// its own, decoded and encoded again here, and compressed again below,
+	// on the main loop. About 70 ns a record, on top of the shared frame.
+	if (p->dict.size == 0)
+		own = updatebuf_ref(ub);
+	else if ((own = namedict_frame(&p->dict, ub)) == NULL)
+		return -1;
+
+	// A frame shared by clients is compressed once for all of them, the
+	// frame of a client with a table is compressed for it alone
+	if (p->compress == COMPRESS_LZ)
+		packed = compress_frame(own, gconfig.compress_min);
+	else
+		packed = updatebuf_ref(own);
+
+	ret = sendq_push(&p->out, packed);
+	updatebuf_unref(packed);
+	updatebuf_unref(own);
+
+	return ret;
+}
+
+/* Has the diff stage encode a resync with its next update, which comes
+   right away */
+static void want_resync(void)
+{
+	__atomic_store_n(&resync_wanted, 1, __ATOMIC_RELEASE);
+	wake_updates();
+}
+
+/* Writes out as much of the queue of p as the socket takes. Once the queue
+   is empty, the next page of a snapshot goes out, or else whatever changes
+   were held back as one frame. */
+static int flush_client(struct client* p)
+{
+	struct updatebuf* ub;           /* The page or the held back changes */
+	struct updatebuf* filtered;     /* The ones the client subscribed to */
+	int ret;
+
+	while ((ret = sendq_flush(&p->out, p->socket)) == 1) {
+		if (p->snap != NULL) {
+			// A page at a time, so a large directory does not fill the
+			// queue up, and before the changes made since
+			ub = filter_frame(p->filter, p->snap->pages[p->snap_next++]);
+			if (p->snap_next == p->snap->count)
+				drop_snapshot(p);
+			if (ub == NULL)
+				continue;
+		} else if (p->pending.count > 0) {
+			// A client whose changes cannot be told is owed a resync,
+			// or it would never hear of them
+			if (pending_encode(&p->pending, &ub) < 0) {
+				syslog(LOG_ERR, "Could not encode held back updates of client %lu, resyncing",
+				       p->id);
+				pending_clear(&p->pending);
+				p->resync = 1;
+				want_resync();
+				break;
+			}
+
+			// Changes that cancelled each other out leave nothing to send
+			if (ub == NULL)
+				break;
+
+			// Neither do changes the client did not subscribe to
+			if (p->filter != NULL) {
+				filtered = filter_frame(p->filter, ub);
+				updatebuf_unref(ub);
+				if ((ub = filtered) == NULL)
+					continue;
+			}
+		} else {
+			break;
 		}
 
-		// Now examine bitmask of each entry in prevdir and see if attributes
-		// have changed or if entry has been removed
-		entry = prevdir->head;
-		while (entry != NULL) {
-			if (IS_MODIFIED(entry->mask)) {
-				if (IS_PERM(entry->mask)) {
-					append_diff(update_buff, "!", entry->filename, " -> permissions");
+		ret = push_client(p, ub);
+		updatebuf_unref(ub);
+		if (ret < 0)
+			return -1;
+	}
 
-					if (send_string(p->socket, update_buff) <= 0)
-						syslog(LOG_ERR, "Could not send string");
+	return ret < 0 ? -1 : 0;
+}
 
-					sent++;
-					if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
-				}
+int queue_client(struct client* p, struct updatebuf* ub)
+{
+	if (push_client(p, ub) < 0 || flush_client(p) < 0) {
+		close_client(p);
+		return -1;
+	}
 
-				if (IS_UID(entry->mask)) {
-					append_diff(update_buff, "!", entry->filename, " -> UID");
+	return 0;
+}
 
-					if (send_string(p->socket, update_buff) <= 0)
-						syslog(LOG_ERR, "Could not send string");
+/* Has the scheduler adapt the period to whether diffs were found, and encodes
+   the new one as a FRAME_PERIOD. Returns NULL if it is the same. Called by
+   the diff stage. */
+static struct updatebuf* encode_period(int diffs)
+{
+	struct updatebuf* ub;
+	byte buf[VARINT_MAX];
+	long period;
 
-					sent++;
-					if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
-				}
+	if ((period = sched_adapt(scheduler, diffs > 0)) == dperiod)
+		return NULL;
+	dperiod = period;
+
+	if ((ub = new_frame(FRAME_PERIOD, buf, put_varint(buf, period))) == NULL)
+		syslog(LOG_ERR, "Cannot encode period");
+
+	return ub;
+}
+
+/* Lists the changes of this update the way the records of encode_frames
+   describe them, for clients that are holding them back */
+static struct pending_change* collect_changes(int diffs, int* count)
+{
+	struct pending_change* changes;
+	struct pending_change* ch;
+	int i;                                          /* Index of an entry in a snapshot */
+	int emask;                                      /* Differences found for the current entry */
+
+	if ((changes = (struct pending_change*)malloc(diffs * sizeof(struct pending_change))) == NULL) {
+		kill_clients("Unrecoverable server error! ; Exiting now!");
+		syslog(LOG_ERR, "Cannot allocate pending changes");
+		exit(1);
+	}
+
+	ch = changes;
+	for (i = 0; i < prevdir->count; i++) {
+		emask = SNAP_FIELD(prevdir, mask, i);
+		if ((emask & ((1 << RENAMED) | (1 << MODIFIED) | (1 << REMOVED))) == 0)
+			continue;
+
+		ch->dev = SNAP_FIELD(prevdir, dev, i);
+		ch->ino = SNAP_FIELD(prevdir, ino, i);
+		ch->name = SNAP_NAME(prevdir, i);
+		ch->new_name = NULL;
+		ch->attrs = record_attrs(emask);
+
+		if (IS_RENAMED(emask)) {
+			ch->type = REC_RENAMED;
+			ch->new_name = SNAP_NAME(curdir, SNAP_FIELD(prevdir, match, i));
+		} else if (IS_MODIFIED(emask)) {
+			ch->type = REC_MODIFIED;
+		} else {
+			ch->type = REC_REMOVED;
+		}
+		ch++;
+	}
+
+	for (i = 0; i < curdir->count; i++) {
+		if (!IS_ADDED(SNAP_FIELD(curdir, mask, i)))
+			continue;
+
+		ch->type = REC_ADDED;
+		ch->attrs = 0;
+		ch->dev = SNAP_FIELD(curdir, dev, i);
+		ch->ino = SNAP_FIELD(curdir, ino, i);
+		ch->name = SNAP_NAME(curdir, i);
+		ch->new_name = NULL;
+		ch++;
+	}
+
+	*count = ch - changes;
+
+	return changes;
+}
+
+/* Opens the monitored directory again, once its watch is on whatever is at
+   full_path now. Only called by the scan stage. */
+static void reopen_dir(void)
+{
+	int fd;
+
+	if ((fd = open(full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		syslog(LOG_WARNING, "Cannot open directory again: %s", full_path);
+		return;
+	}
+
+	close(dir_fd);
+	dir_fd = fd;
+}
+
+void* scan_updates(void* arg)
+{
+	struct snapshot* snap;          /* Filled in with the directory as it is now */
+	struct dirchangeset changes;    /* Entries reported as changed by the watch */
+	int rescan;                                     /* Whether every entry is looked at */
+
+	rescan = 1;
+	if (watch != NULL) {
+		// The kernel dropped events, so start from scratch
+		rescan = dirwatch_take(watch, &changes) < 0;
+
+		// The scan follows the watch to the directory there is now
+		if (changes.rewatched)
+			reopen_dir();
+
+		// Nothing has happened since the last scan, which the diff
+		// stage still hears of so v1 clients do every period
+		if (!rescan && changes.count == 0) {
+			stageq_push(&scanned, NULL);
+			return((void*)0);
+		}
+	}
+
+	// Waits here while the stages behind are busy with every other
+	// snapshot
+	snap = (struct snapshot*)stageq_pop(&free_snaps);
+	reuse_snapshot(snap);
+
+	// Give the segments of a directory that has since shrunk back
+	mempool_trim(snapseg_pool);
+
+	// Populate the snapshot with entries in directory right now
+	if (rescan) {
+		if (exploredir(snap, dir_fd) < 0) {  /* Global variable: dir_fd */
+			// Send error message to all clients and then exit
+			syslog(LOG_ERR, "Cannot read directory: %s: %s", full_path, strerror(errno));
+			kill_clients("Cannot read directory! ; Exiting now!");
+			exit(1);
+		}
+	} else {
+		refreshdir(snap, last_scan, &changes, dir_fd);
+	}
+
+	if (watch != NULL)
+		clear_dirchangeset(&changes);
+
+	last_scan = snap;
+	stageq_push(&scanned, snap);
+
+	return((void*)0);
+}
 
-				if (IS_GID(entry->mask)) {
-					append_diff(update_buff, "!", entry->filename, " -> GID");
+void* diff_updates(void* arg)
+{
+	struct snapshot* scan;          /* Next snapshot from the scan stage */
+	struct update_batch* b;         /* This update, encoded for every client */
+	int diffs;                                      /* The number of differences in monitored directory */
 
-					if (send_string(p->socket, update_buff) <= 0)
-						syslog(LOG_ERR, "Could not send string");
+	for (;; ) {
+		scan = (struct snapshot*)stageq_pop(&scanned);
 
-					sent++;
-					if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
-				}
+		if ((b = (struct update_batch*)calloc(1, sizeof(struct update_batch))) == NULL) {
+			kill_clients("Unrecoverable server error! ; Exiting now!");
+			syslog(LOG_ERR, "Cannot allocate update");
+			exit(1);
+		}
 
-				if (IS_SIZE(entry->mask)) {
-					append_diff(update_buff, "!", entry->filename, " -> size");
+		// LOCK : prevdir has to match the updates encoded so far for a
+		//        client that asks for a snapshot
+		pthread_mutex_lock(&update_lock);
+
+		// Get number of differences found in monitored directory, and
+		// encode them for every client. A scan that found nothing to
+		// look at is prevdir all over again.
+		curdir = scan != NULL ? scan : prevdir;
+		diffs = scan != NULL ? difference_direntrylist() : 0;
+		b->ub = encode_updates();
+		b->seq = dseq;
+		b->frame = encode_frames(diffs, &b->seq);
+		if (b->frame != NULL) {
+			b->changes = collect_changes(diffs, &b->nchanges);
+			encode_filters(b);
+		}
+		dseq = b->seq;
+
+		// Now the scan becomes the old dir. The changes name entries of
+		// both, so the one it replaces is only handed back to the scan
+		// stage once they are sent.
+		if (scan != NULL) {
+			b->done = prevdir;
+			prevdir = scan;
+			clear_snapshot_masks(prevdir);
+		}
+		curdir = NULL;
 
-					if (send_string(p->socket, update_buff) <= 0)
-						syslog(LOG_ERR, "Could not send string");
+		// Everything there is after this update, if a client is owed it
+		if (__atomic_exchange_n(&resync_wanted, 0, __ATOMIC_ACQ_REL))
+			b->resync = encode_resync(prevdir, dseq);
 
-					sent++;
-					if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
-				}
+		b->period = encode_period(diffs);
+		b->period_ms = dperiod;
+		dbatch++;
 
-				if (IS_LAT(entry->mask)) {
-					append_diff(update_buff, "!", entry->filename, " -> last access time");
+		// UNLOCK
+		pthread_mutex_unlock(&update_lock);
 
-					if (send_string(p->socket, update_buff) <= 0)
-						syslog(LOG_ERR, "Could not send string");
+		// Waits here while the main loop is behind
+		stageq_push(&encoded, b);
+	}
 
-					sent++;
-					if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
-				}
+	return((void*)0);
+}
 
-				if (IS_LMT(entry->mask)) {
-					append_diff(update_buff, "!", entry->filename, " -> last modfied time");
+void send_updates(struct update_batch* b)
+{
+	struct client* p;                       /* Pointer to traverse through client list */
+	struct updatebuf* out;          /* What the current client gets */
+	int wanted;                                     /* Whether a client is still owed a resync */
+	int queued;                                     /* Whether anything was queued for the client */
+	int i;
 
-					if (send_string(p->socket, update_buff) <= 0)
-						syslog(LOG_ERR, "Could not send string");
+	wanted = 0;
 
-					sent++;
-					if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
-				}
+	// LOCK : Make sure clients is not altered while sending updates
+	pthread_mutex_lock(&clients_lock);
 
-				if (IS_LFST(entry->mask)) {
-					append_diff(update_buff, "!", entry->filename, " -> last file status time");
+	// Clients that resume from here on pick up after this update
+	if (b->frame != NULL) {
+		journal_append(&journal, gseq + 1, b->seq, b->frame);
+		gseq = b->seq;
+	}
 
-					if (send_string(p->socket, update_buff) <= 0)
-						syslog(LOG_ERR, "Could not send string");
+	// Clients that connect from here on are told of the new period in
+	// their handshake
+	gperiod = b->period_ms;
 
-					sent++;
-					if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
-				}
-			} else if (IS_REMOVED(entry->mask)) {
-				append_diff(update_buff, "-", entry->filename, " ");
+	p = clients->head;
+	while (p != NULL) {
+		// LOCK : Make sure client is not removed while update is being
+		//        queued
+		pthread_mutex_lock(p->c_lock);
 
-				if (send_string(p->socket, update_buff) <= 0)
-					syslog(LOG_ERR, "Could not send string");
+		// v2 clients are not sent anything when nothing changed
+		out = p->version == PROTO_V1 ? b->ub : b->frame;
+		if (p->closing)
+			out = NULL;
+
+		// A client that came back after its updates left the journal
+		// starts over from the state after an update that comes with
+		// everything there is, and is sent nothing until then
+		if (p->resync && !p->closing) {
+			if (b->resync != NULL) {
+				p->resync = 0;
+				out = b->resync;
+			} else {
+				wanted = 1;
+				out = NULL;
+			}
+		}
 
-				sent++;
-				if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
+		// A v2 client that still has something queued gets this update
+		// merged into what it has not been sent yet, so it is only ever
+		// one frame behind however many updates it misses. So does one
+		// that is still being sent a snapshot.
+		if (out == b->frame && out != NULL
+		    && (p->out.head != NULL || p->pending.count > 0 || p->snap != NULL)) {
+			for (i = 0; i < b->nchanges; i++) {
+				if (pending_merge(&p->pending, &b->changes[i]) < 0)
+					break;
 			}
 
-			entry = entry->next;
+			if (i < b->nchanges) {
+				syslog(LOG_ERR, "Could not hold back updates");
+				close_client(p);
+			}
+			p->pending.seq = gseq;
+			out = NULL;
 		}
 
-		// Now examine the current state of the monitored directory and see
-		// if any entries have been added
-		entry = curdir->head;
-		while (entry != NULL) {
-			if (IS_ADDED(entry->mask)) {
-				append_diff(update_buff, "+", entry->filename, " ");
+		// Only what the client subscribed to, which every client with
+		// the same filter shares
+		if (out != NULL && p->filter != NULL)
+			out = out == b->frame ? batch_filtered(b, p->filter) : filter_cached(p->filter, out);
+
+		// The client is not keeping up. A v2 client can be told to start
+		// over from the state after this update, or the next one that
+		// comes with it, everything it has not started reading is dropped.
+		if (out != NULL && p->out.bytes + out->len > gconfig.queue_max) {
+			if (p->version == PROTO_V2 && gconfig.overflow == OVERFLOW_RESYNC) {
+				syslog(LOG_WARNING, "Client %lu fell behind, resyncing", p->id);
+				sendq_drop(&p->out);
+				pending_clear(&p->pending);
+				drop_snapshot(p);
+				out = b->resync;
+				if (out == NULL) {
+					p->resync = 1;
+					wanted = 1;
+				} else if (p->filter != NULL) {
+					out = filter_cached(p->filter, out);
+				}
+			} else {
+				syslog(LOG_WARNING, "Client %lu fell behind, disconnecting", p->id);
+				close_client(p);
+				out = NULL;
+			}
+		}
 
-				if (send_string(p->socket, update_buff) <= 0)
-					syslog(LOG_ERR, "Could not send string");
+		// The update and the period are queued first and written out
+		// together
+		queued = 0;
+		if (out != NULL) {
+			if (push_client(p, out) < 0) {
+				syslog(LOG_ERR, "Could not send updates");
+				close_client(p);
+			}
+			queued = 1;
+		}
 
-				sent++;
-				if (sent == diffs && more_diffs > 0) send_byte(p->socket, (byte)more_diffs);
+		if (b->period != NULL && p->version == PROTO_V2 && !p->closing) {
+			if (push_client(p, b->period) < 0) {
+				syslog(LOG_ERR, "Could not send period");
+				close_client(p);
 			}
+			queued = 1;
+		}
 
-			entry = entry->next;
+		if (queued && !p->closing && flush_client(p) < 0) {
+			syslog(LOG_ERR, "Could not send updates");
+			close_client(p);
 		}
 
 		// UNLOCK
 		pthread_mutex_unlock(p->c_lock);
 		p = p->next;
 	}
+
+	// Filters whose clients have all gone since are let go of here
+	for (i = 0; i < b->nfilters; i++) {
+		if (b->filtered[i] != NULL)
+			updatebuf_unref(b->filtered[i]);
+		filter_release(&filters, b->filters[i]);
+	}
+	filterset_flush(&filters);
 	// UNLOCK
 	pthread_mutex_unlock(&clients_lock);
 
-	// Now reverse the roles of prevdir and curdir
-	// i.e. the curdir becomes the old dir
-	reuse_direntrylist(prevdir);
-	tmp = prevdir;
-	prevdir = curdir;
-	curdir = tmp;
+	if (wanted)
+		want_resync();
+
+	updatebuf_unref(b->ub);
+	if (b->frame != NULL)
+		updatebuf_unref(b->frame);
+	if (b->resync != NULL)
+		updatebuf_unref(b->resync);
+	if (b->period != NULL)
+		updatebuf_unref(b->period);
+	free(b->changes);
+	free(b->filters);
+	free(b->filtered);
+
+	// Nothing refers to the entries of the old snapshot any more
+	if (b->done != NULL)
+		stageq_push(&free_snaps, b->done);
+	free(b);
+	fbatch++;
+}
 
+/* Sends out every update encoded so far, so that gseq catches up with
+   prevdir. Called by the main loop with update_lock held. */
+static void drain_updates(void)
+{
+	while (fbatch != dbatch)
+		send_updates((struct update_batch*)stageq_pop(&encoded));
+}
 
-	// Clear bitmasks
-	entry = prevdir->head;
-	while (entry != NULL) {
-		entry->mask = 0;
-		entry = entry->next;
-	}
+/* Sends END_COM followed by msg, all in one system call */
+static int send_end_com(int socketfd, const char* msg)
+{
+	struct iovec iov[2];
+	byte head[2];                   /* END_COM and the length of msg */
 
-	return((void*)0);
+	head[0] = END_COM;
+	head[1] = strlen(msg);
+	iov[0].iov_base = head;
+	iov[0].iov_len = 2;
+	iov[1].iov_base = (void*)msg;
+	iov[1].iov_len = head[1];
+
+	if (send_iov(socketfd, iov, 2) != 2 + head[1])
+		return -1;
+
+	return 0;
 }
 
-int send_error(int socket, const char* err_msg)
+int send_error(unsigned long id, const char* err_msg)
 {
 	struct client* p;               /* Used to hold client reference */
+	struct updatebuf* ub;           /* END_COM and the message */
 
 	// Try to find client in clients linked list
-	if ((p = find_client_ref(socket)) == NULL) {
+	if ((p = find_client_ref(id)) == NULL) {
 		syslog(LOG_ERR, "Could not find client to disconnect from.");
 		return -1;
-	} else {
-		// LOCK : Make all updates have been sent to client first
-		pthread_mutex_lock(p->c_lock);
+	}
 
-		if (send_byte(p->socket, END_COM) <= 0) {
-			syslog(LOG_ERR, "Could not send error byte");
-			return -1;
-		}
+	if ((ub = new_updatebuf()) == NULL || updatebuf_put_byte(ub, END_COM) < 0
+	    || updatebuf_put_string(ub, err_msg) < 0) {
+		if (ub != NULL)
+			updatebuf_unref(ub);
+		syslog(LOG_ERR, "Could not send error");
+		return -1;
+	}
 
-		if (send_string(p->socket, err_msg) <= 0) {
-			syslog(LOG_ERR, "Could not send error string");
-			return -1;
-		}
-		// UNLOCK
+	// LOCK : Make all updates have been queued for the client first
+	pthread_mutex_lock(p->c_lock);
+
+	if (p->closing || queue_client(p, ub) < 0) {
 		pthread_mutex_unlock(p->c_lock);
+		updatebuf_unref(ub);
+		syslog(LOG_ERR, "Could not send error");
+		return -1;
 	}
+	// UNLOCK
+	pthread_mutex_unlock(p->c_lock);
+
+	updatebuf_unref(ub);
 
 	return 0;
 }
 
 int send_error2(int socket, const char* err_msg)
 {
-	if (send_byte(socket, END_COM) <= 0) {
-		syslog(LOG_ERR, "Could not send error byte");
+	if (send_end_com(socket, err_msg) < 0) {
+		syslog(LOG_ERR, "Could not send error");
+		return -1;
+	}
+
+	return 0;
+}
+
+int init_client(struct conn* c)
+{
+	struct iovec iov[3];            /* Pieces of the handshake */
+	byte head[3];                   /* 0xFE, 0xED and the length of the path */
+	byte period;                    /* The refresh period, in whole seconds */
+
+	// LOCK : An update must either go out before the handshake, or
+	//        reach the client after it
+	pthread_mutex_lock(&clients_lock);
+
+	// No more clients are being accepted
+	if (clients->count >= gconfig.max_clients) {
+		pthread_mutex_unlock(&clients_lock);
+		syslog(LOG_INFO, "No more clients can be accepted.");
+		send_error2(c->fd, "No more clients can be accepted.");
+		return -1;
+	}
+
+	// Send 0xFE, 0xED, the monitored directory name/path and the
+	// refresh period all at once
+	head[0] = INIT_CLIENT1;
+	head[1] = INIT_CLIENT2;
+	head[2] = strlen(init_dir);
+	period = (gperiod + 999) / 1000;
+	iov[0].iov_base = head;
+	iov[0].iov_len = 3;
+	iov[1].iov_base = (void*)init_dir;
+	iov[1].iov_len = head[2];
+	iov[2].iov_base = &period;
+	iov[2].iov_len = 1;
+
+	// A client that is gone already only takes itself down
+	if (send_iov(c->fd, iov, 3) != 4 + head[2]) {
+		pthread_mutex_unlock(&clients_lock);
+		syslog(LOG_WARNING, "Cannot send handshake");
 		return -1;
 	}
 
-	if (send_string(socket, err_msg) <= 0) {
-		syslog(LOG_ERR, "Could not send error string");
+	// Add client to clients
+	if (add_client_ref(c->fd, c->id) == NULL) {
+		pthread_mutex_unlock(&clients_lock);
 		return -1;
 	}
 
+	// UNLOCK
+	pthread_mutex_unlock(&clients_lock);
+
 	return 0;
 }
 
-void* init_client(void* arg)
+int negotiate_client(struct conn* c)
 {
-	int socketfd;                   /* Socket fd of new client */
-	size_t len;                     /* String length */
-	int socket_buff[1];             /* Buffer used to send socket back to main thread */
-
-	socketfd = (int)arg;
-	len = strlen(init_dir);
+	struct client* p;                       /* The client being upgraded */
+	struct updatebuf* frame;        /* FRAME_HELLO_ACK */
+	struct updatebuf* ub;           /* Marker, then the frame */
+	struct updatebuf* missed;       /* An update from the journal, filtered */
+	struct filter* f;                       /* What the client subscribes to */
+	struct snappages* sp;           /* Entries there are, for a client that asked */
+	byte hello[HELLO_MAX];          /* TLVs sent by the client */
+	byte ack[12 + 7 * VARINT_MAX];  /* TLVs sent back */
+	unsigned long len;                      /* Bytes of TLVs in hello */
+	unsigned long tlv_len;          /* Length of the value of a TLV */
+	unsigned long version;          /* Protocol version asked for */
+	unsigned long epoch;            /* Run of the server the client was connected to */
+	unsigned long seq;                      /* Last change the client saw of it */
+	unsigned long i;                        /* Offset of the current TLV */
+	unsigned long filter_at;        /* Offset of the value of TLV_FILTER */
+	unsigned long filter_len;       /* Its length, 0 if there is none */
+	unsigned long dict_size;        /* Names the client is willing to bind */
+	unsigned long codec;            /* Compression the client understands */
+	long from;                                      /* First update in the journal the client missed */
+	byte tag;                                       /* Tag of the current TLV */
+	int resume;                                     /* Whether the client has been here before */
+	int snapshot;                           /* Whether it asked for the entries there are */
+	int resync;                                     /* Whether it is owed a resync */
+	int n;
+
+	// All of it is buffered, so none of this waits on the socket
+	if (reader_byte(c->in) != REQ_HELLO || reader_varint(c->in, &len) < 0
+	    || len > HELLO_MAX || reader_buff(c->in, hello, len) < 0) {
+		syslog(LOG_ERR, "Cannot read hello from client");
+		return -1;
+	}
 
-	// No more clients are being accepted, remove socket from master list,
-	// and wait until it has been removed properly
-	if (clients->count == MAX_CLIENTS) {
-		syslog(LOG_INFO, "No more clients can be accepted.");
-		// Tell main thread to remove socket from master list
-		socket_buff[0] = socketfd;
-		write(remove_client_pipes[1], socket_buff, (int)1);
-
-		// Make sure that the socket is removed from
-		// the master list before preceding any farther
-		// (Removes a race condition which would cause
-		// select() to break)
-		pthread_mutex_lock(&slock);
-		while (done == 0)
-			pthread_cond_wait(&sready, &slock);
-		done = 0;
-		pthread_mutex_unlock(&slock);
-
-		// Send the error now
-		send_error2(socketfd, "No more clients can be accepted.");
+	// Pick out the tags that are understood, skip over the rest
+	version = PROTO_V1;
+	resume = 0;
+	filter_at = 0;
+	filter_len = 0;
+	dict_size = 0;
+	codec = COMPRESS_NONE;
+	snapshot = 0;
+	for (i = 0; i < len; i += tlv_len) {
+		tag = hello[i++];
+		if (i >= len || (n = get_varint(hello + i, len - i, &tlv_len)) < 0 || tlv_len > len - i - n) {
+			syslog(LOG_ERR, "Malformed hello from client");
+			return -1;
+		}
+		i += n;
+
+		if (tag == TLV_VERSION && get_varint(hello + i, tlv_len, &version) < 0)
+			version = PROTO_V1;
+		else if (tag == TLV_RESUME && (n = get_varint(hello + i, tlv_len, &epoch)) >= 0
+		         && get_varint(hello + i + n, tlv_len - n, &seq) >= 0)
+			resume = 1;
+		else if (tag == TLV_DICT && get_varint(hello + i, tlv_len, &dict_size) < 0)
+			dict_size = 0;
+		else if (tag == TLV_COMPRESS && get_varint(hello + i, tlv_len, &codec) < 0)
+			codec = COMPRESS_NONE;
+		else if (tag == TLV_SNAPSHOT)
+			snapshot = 1;
+		else if (tag == TLV_FILTER) {
+			filter_at = i;
+			filter_len = tlv_len;
+		}
+	}
 
-		close(socketfd);
-		pthread_exit((void*)1);
+	// Nothing changes for a client that only speaks v1
+	if (version < PROTO_V2)
+		return 0;
+	version = PROTO_V2;
+
+	// A filter that cannot be understood is ignored, the client gets
+	// every update then
+	f = NULL;
+	if (filter_len > 0 && (f = new_filter(hello + filter_at, filter_len)) == NULL)
+		syslog(LOG_WARNING, "Malformed filter from client %lu", c->id);
+
+	// LOCK : prevdir is only the state after gseq once every update
+	//        encoded so far is sent, and it has to stay so until the
+	//        client is switched over
+	if (snapshot) {
+		pthread_mutex_lock(&update_lock);
+		drain_updates();
 	}
 
-	// Add client to clients linked list
+	// LOCK : Make sure the client is not removed meanwhile, and that no
+	//        update is sent out while the journal is looked at
 	pthread_mutex_lock(&clients_lock);
-	add_client_ref(socketfd);
-	pthread_mutex_unlock(&clients_lock);
+	if ((p = find_client_ref(c->id)) == NULL) {
+		if (f != NULL)
+			free_filter(f);
+		pthread_mutex_unlock(&clients_lock);
+		if (snapshot)
+			pthread_mutex_unlock(&update_lock);
+		syslog(LOG_ERR, "Could not find client to upgrade.");
+		return -1;
+	}
 
-	// Send 0xFE
-	if (send_byte(socketfd, INIT_CLIENT1) != 1) {
-		syslog(LOG_WARNING, "Cannot send init client 1");
-		exit(1);
+	// LOCK : Switch over in between two updates, after whatever is
+	//        still queued
+	pthread_mutex_lock(p->c_lock);
+
+	// Clients that ask for the same thing share one filter
+	filter_release(&filters, p->filter);
+	p->filter = f != NULL ? filter_intern(&filters, f) : NULL;
+
+	// Names are only bound from the first frame after the ack on. A
+	// client whose table cannot be allocated gets them as they are.
+	if (dict_size > DICT_MAX)
+		dict_size = DICT_MAX;
+	free_namedict(&p->dict);
+	if (init_namedict(&p->dict, dict_size) < 0) {
+		syslog(LOG_WARNING, "Cannot allocate name table of client %lu", p->id);
+		dict_size = 0;
 	}
 
-	// Send 0xED
-	if (send_byte(socketfd, INIT_CLIENT2) != 1) {
-		syslog(LOG_WARNING, "Cannot send init client 2");
-		exit(1);
+	// Only what the client understands, and only if the server
+	// compresses at all
+	if (codec != COMPRESS_LZ || gconfig.compress_min <= 0)
+		codec = COMPRESS_NONE;
+	p->compress = codec;
+
+	// A client that comes back is sent the updates it missed. If they
+	// are gone, or it was connected to an earlier run of the server, it
+	// starts over with the next update.
+	from = -1;
+	if (resume && epoch == gepoch && seq == gseq)
+		from = journal.count;
+	else if (resume && epoch == gepoch && seq < gseq)
+		from = journal_find(&journal, seq);
+
+	if (from < 0) {
+		p->resync = resume;
+		seq = gseq;
 	}
 
-	// Send monitored directory name/path
-	if (send_string(socketfd, init_dir) != len) {
-		syslog(LOG_WARNING, "Cannot send path directory");
-		exit(1);
+	// One that does not pick up where it left off can be given the
+	// entries there are instead, which leaves nothing to resync
+	sp = NULL;
+	if (from < 0 && snapshot && (sp = get_snappages()) == NULL)
+		syslog(LOG_WARNING, "Cannot page out snapshot for client %lu", p->id);
+	if (sp != NULL)
+		p->resync = 0;
+
+	n = 0;
+	ack[n++] = TLV_VERSION;
+	ack[n] = put_varint(ack + n + 1, version);
+	n += 1 + ack[n];
+	ack[n++] = TLV_RESUME;
+	ack[n] = put_varint(ack + n + 1, gepoch);
+	ack[n] += put_varint(ack + n + 1 + ack[n], seq);
+	n += 1 + ack[n];
+	ack[n++] = TLV_PERIOD;
+	ack[n] = put_varint(ack + n + 1, gperiod);
+	n += 1 + ack[n];
+	if (dict_size > 0) {
+		ack[n++] = TLV_DICT;
+		ack[n] = put_varint(ack + n + 1, dict_size);
+		n += 1 + ack[n];
+	}
+	if (codec != COMPRESS_NONE) {
+		ack[n++] = TLV_COMPRESS;
+		ack[n] = put_varint(ack + n + 1, codec);
+		n += 1 + ack[n];
+	}
+	if (sp != NULL) {
+		ack[n++] = TLV_SNAPSHOT;
+		ack[n] = put_varint(ack + n + 1, sp->entries);
+		n += 1 + ack[n];
 	}
 
-	// Send the refresh period
-	if (send_byte(socketfd, gperiod) != 1) {
-		syslog(LOG_WARNING, "Cannot send period");
-		exit(1);
+	// The pages follow the ack as the socket takes them
+	drop_snapshot(p);
+	p->snap = sp;
+	p->snap_next = 0;
+
+	// END_COM followed by an empty string tells the client where v2 starts
+	ub = NULL;
+	if ((frame = new_frame(FRAME_HELLO_ACK, ack, n)) == NULL || (ub = new_updatebuf()) == NULL
+	    || updatebuf_put_byte(ub, END_COM) < 0 || updatebuf_put_byte(ub, 0) < 0
+	    || updatebuf_put(ub, frame->data, frame->len) < 0) {
+		syslog(LOG_ERR, "Cannot allocate hello ack");
+		close_client(p);
+	} else if (!p->closing && queue_client(p, ub) < 0) {
+		syslog(LOG_ERR, "Could not send hello ack");
 	}
 
-	return((void*)0);
+	if (resume && from >= 0)
+		syslog(LOG_INFO, "Client %lu resumed, %ld updates behind", p->id,
+		       (long)journal.count - from);
+
+	for (; from >= 0 && from < journal.count && !p->closing; from++) {
+		if ((missed = filter_frame(p->filter, journal_frame(&journal, from))) == NULL)
+			continue;
+		if (queue_client(p, missed) < 0)
+			syslog(LOG_ERR, "Could not send missed updates");
+		updatebuf_unref(missed);
+	}
+
+	p->version = version;
+	resync = p->resync;
+	// UNLOCK
+	pthread_mutex_unlock(p->c_lock);
+	// UNLOCK
+	pthread_mutex_unlock(&clients_lock);
+	// UNLOCK
+	if (snapshot)
+		pthread_mutex_unlock(&update_lock);
+
+	// Rather than wait for the next scan
+	if (resync)
+		want_resync();
+
+	if (frame != NULL)
+		updatebuf_unref(frame);
+	if (ub != NULL)
+		updatebuf_unref(ub);
+
+	return 0;
 }
 
 void* remove_client(void* arg)
@@ -695,11 +1782,14 @@ void* remove_client(void* arg)
 	// LOCK : Make sure clients is not altered
 	//        while trying to remove client ref
 	pthread_mutex_lock(&clients_lock);
-	remove_client_ref(targ->socket);
+	remove_client_ref(targ->id);
 	pthread_mutex_unlock(&clients_lock);
 
+	// This thread has the socket to itself now, so it may block
+	fcntl(targ->socket, F_SETFL, fcntl(targ->socket, F_GETFL) & ~O_NONBLOCK);
+
 	// Now disconnect from client nicely
-	disconnect_from_client(targ->socket, 0);
+	disconnect_from_client(targ->socket, targ->req);
 
 	// Free thread arg
 	free(targ);
@@ -707,35 +1797,69 @@ void* remove_client(void* arg)
 	return((void*)0);
 }
 
-void kill_clients(int pipe, const char* msg)
+/* Writes out what is queued for p, waiting for its socket to take it until
+   deadline. Called with c_lock of p held. Returns 0 once it is all out. */
+static int drain_client(struct client* p, const struct timespec* deadline)
+{
+	struct pollfd pfd;
+	struct timespec now;
+	long ms;                                        /* Time left until deadline */
+	int ret;
+
+	pfd.fd = p->socket;
+	pfd.events = POLLOUT;
+
+	while ((ret = sendq_flush(&p->out, p->socket)) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (deadline->tv_sec - now.tv_sec) * 1000L
+		     + (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+		if (ms <= 0 || (poll(&pfd, 1, ms) < 0 && errno != EINTR))
+			return -1;
+	}
+
+	return ret;
+}
+
+void kill_clients(const char* msg)
 {
 	struct client* p;                       /* Used to traverse clients linked list */
-	int socket_buff[1];                     /* Send socket fd to main thread to remove from
-	                                                           master fd list */
+	struct timespec deadline;       /* Until when the error messages may take */
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += KILL_DRAIN_MS / 1000;
+	deadline.tv_nsec += (KILL_DRAIN_MS % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
 
 	// LOCK : Make sure clients is not altered while removing all client connections
 	pthread_mutex_lock(&clients_lock);
 	if (clients->count > 0) {
 		p = clients->head;
 		while (p != NULL) {
-			// Send the socket fd to the main thread to remove
-			// it from the master fd list
-			socket_buff[0] = p->socket;
-			write(pipe, socket_buff, 1);
-
-			// Make sure that the socket is removed from
-			// the master list before preceding any farther
-			// (Removes a race condition which would cause
-			// select() to break)
-			pthread_mutex_lock(&slock);
-			while (done == 0)
-				pthread_cond_wait(&sready, &slock);
-			done = 0;
-			pthread_mutex_unlock(&slock);
-
-			send_error(p->socket, msg);
-			close(p->socket);
-			remove_client_ref(p->socket);
+			// LOCK : The queue is shared with the main loop. Only the
+			//        error is left to go out after what is under way.
+			pthread_mutex_lock(p->c_lock);
+			sendq_drop(&p->out);
+			pending_clear(&p->pending);
+			drop_snapshot(p);
+			pthread_mutex_unlock(p->c_lock);
+
+			send_error(p->id, msg);
+
+			// LOCK : Write the error out before the socket goes
+			pthread_mutex_lock(p->c_lock);
+			if (!p->closing && drain_client(p, &deadline) < 0)
+				syslog(LOG_WARNING, "Could not send error to client %lu", p->id);
+			// UNLOCK
+			pthread_mutex_unlock(p->c_lock);
+
+			// Closing the socket here could hand its number to a new
+			// connection while the main loop still watches the old one,
+			// so it is only shut down. The main loop closes it.
+			shutdown(p->socket, SHUT_RDWR);
+			remove_client_ref(p->id);
 
 			p = clients->head;
 		}
@@ -744,108 +1868,138 @@ void kill_clients(int pipe, const char* msg)
 	pthread_mutex_unlock(&clients_lock);
 }
 
-int disconnect_from_client(int socketfd, int pipe)
+int disconnect_from_client(int socketfd, const byte* req)
 {
-	byte b;
-
-	if ((b = read_byte(socketfd)) != REQ_REMOVE1) {
-		syslog(LOG_ERR, "Anticipated 0xDE: Received: 0x%x", b);
+	if (req[0] != REQ_REMOVE1) {
+		syslog(LOG_ERR, "Anticipated 0xDE: Received: 0x%x", req[0]);
 		close(socketfd);
 		return -1;
 	}
 
-	if ((b = read_byte(socketfd)) != REQ_REMOVE2) {
-		syslog(LOG_ERR, "Anticipated 0xAD: Received: 0x%x", b);
+	if (req[1] != REQ_REMOVE2) {
+		syslog(LOG_ERR, "Anticipated 0xAD: Received: 0x%x", req[1]);
 		close(socketfd);
 		return -1;
 	}
 
-	if (send_byte(socketfd, END_COM) != 1) {
-		syslog(LOG_ERR, "Could not send byte!");
+	if (send_end_com(socketfd, GOOD_BYE) < 0) {
+		syslog(LOG_ERR, "Could not send goodbye");
 		close(socketfd);
 		return -1;
 	}
+	// Close socket now
+	close(socketfd);
 
-	if (send_string(socketfd, GOOD_BYE) != 7) {
-		syslog(LOG_ERR, "Could not send string");
-		close(socketfd);
+	return 0;
+}
+
+/* Bucket of the client with the given id. Ids are handed out in order, so
+   the low bits alone spread them out evenly. */
+#define CLIENT_BUCKET(id)       ((id) & (clients->table_size - 1))
+
+/* Doubles the number of buckets of clients and rehashes every client */
+static int grow_client_table(void)
+{
+	struct client** table;          /* The bigger table */
+	struct client* ct;
+	unsigned long size;
+
+	size = clients->table_size * 2;
+	if ((table = (struct client**)calloc(size, sizeof(struct client*))) == NULL)
 		return -1;
+
+	free(clients->table);
+	clients->table = table;
+	clients->table_size = size;
+
+	for (ct = clients->head; ct != NULL; ct = ct->next) {
+		ct->hnext = table[CLIENT_BUCKET(ct->id)];
+		table[CLIENT_BUCKET(ct->id)] = ct;
 	}
-	// Close socket now
-	close(socketfd);
 
 	return 0;
 }
 
-void add_client_ref(int socketfd)
+struct client* add_client_ref(int socketfd, unsigned long id)
 {
 	struct client *ct;      /* New client reference */
 
-	if (clients == NULL) {
-		clients = (struct clientlist*)malloc(sizeof(struct clientlist));
-		clients->head = NULL;
-		clients->tail = NULL;
-		clients->count = 0;
-	}
+	// Keep about one client per bucket. If the table cannot grow, the
+	// chains just get longer.
+	if (clients->count >= clients->table_size && grow_client_table() < 0)
+		syslog(LOG_WARNING, "Cannot grow client table");
 
 	// Try to allocate space for a new client
 	ct = (struct client*)malloc(sizeof(struct client));
 	if (ct == NULL) {
 		syslog(LOG_ERR, "Cannot malloc new client thread");
-		return;
+		return NULL;
 	}
 
 	// Initialize client ref
 	ct->c_lock = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
 	pthread_mutex_init(ct->c_lock, NULL);
 	ct->socket = socketfd;
+	ct->id = id;
+	ct->version = PROTO_V1;
+	ct->closing = 0;
+	ct->resync = 0;
+	sendq_init(&ct->out, sendq_pool);
+	pending_init(&ct->pending, pending_pool);
+	ct->filter = NULL;
+	init_namedict(&ct->dict, 0);
+	ct->compress = COMPRESS_NONE;
+	ct->snap = NULL;
+	ct->snap_next = 0;
 	ct->next = NULL;
 	ct->prev = NULL;
 
 	if (clients->head == NULL) {
 		clients->head = ct;
 		clients->tail = clients->head;
-	} else if (clients->head == clients->tail) {
-		clients->head->next = ct;
-		ct->prev = clients->head;
-		clients->tail = clients->head->next;
 	} else {
 		clients->tail->next = ct;
 		ct->prev = clients->tail;
 		clients->tail = ct;
 	}
 
+	ct->hnext = clients->table[CLIENT_BUCKET(id)];
+	clients->table[CLIENT_BUCKET(id)] = ct;
+
 	clients->count++;
+
+	return ct;
 }
 
-void remove_client_ref(int socketfd)
+void remove_client_ref(unsigned long id)
 {
 	struct client* ct;              /* Client ref to remove */
-	struct client* tmp;             /* Tmp storage */
+	struct client** link;           /* Where ct is linked from in its bucket */
 
-	if ((ct = find_client_ref(socketfd)) == NULL) {
-		syslog(LOG_ERR, "Could not find client.");
-		exit(1);
+	link = &clients->table[CLIENT_BUCKET(id)];
+	while ((ct = *link) != NULL && ct->id != id)
+		link = &ct->hnext;
+
+	if (ct == NULL) {
+		syslog(LOG_INFO, "Client was already removed.");
+		return;
 	}
 
 	// If lock is currently locked, maybe server is trying to send
 	// out data. Wait until lock is aquired.
 	pthread_mutex_lock(ct->c_lock);
 
-	if (clients->count == 1) {
-		clients->head = clients->head->next;
-		clients->tail = clients->head;
-	} else if (ct == clients->head) {
-		clients->head = clients->head->next;
-		clients->head->prev = NULL;
-	} else if (ct == clients->tail) {
-		clients->tail = clients->tail->prev;
-		clients->tail->next = NULL;
-	} else {
-		tmp = ct->next;
-		ct->prev->next = tmp;
-		tmp->prev = ct->prev;
-	}
+	*link = ct->hnext;
+
+	if (ct->prev == NULL)
+		clients->head = ct->next;
+	else
+		ct->prev->next = ct->next;
+
+	if (ct->next == NULL)
+		clients->tail = ct->prev;
+	else
+		ct->next->prev = ct->prev;
 
 	// UNLOCK
 	pthread_mutex_unlock(ct->c_lock);
@@ -853,6 +2007,12 @@ void remove_client_ref(int socketfd)
 	// Deallocate client now
 	ct->prev = NULL;
 	ct->next = NULL;
+	ct->hnext = NULL;
+	sendq_clear(&ct->out);
+	pending_clear(&ct->pending);
+	drop_snapshot(ct);
+	filter_release(&filters, ct->filter);
+	free_namedict(&ct->dict);
 	pthread_mutex_destroy(ct->c_lock);
 	free(ct->c_lock);
 	free(ct);
@@ -860,38 +2020,222 @@ void remove_client_ref(int socketfd)
 	clients->count--;
 }
 
-struct client* find_client_ref(int socketfd)
+struct client* find_client_ref(unsigned long id)
 {
-	struct client* p;       /* Client ref with socketfd as its socket */
+	struct client* p;       /* Client ref with the connection id */
 
-	p = clients->head;
-	while (p != NULL) {
-		if (p->socket == socketfd) {
-			return p;
+	p = clients->table[CLIENT_BUCKET(id)];
+	while (p != NULL && p->id != id)
+		p = p->hnext;
+
+	return p;
+}
+
+/* Starts watching fd, edge triggered. Returns the new connection, or NULL. */
+static struct conn* add_conn(int fd, int type)
+{
+	struct epoll_event ev;
+	struct conn* c;
+
+	if ((c = (struct conn*)mempool_alloc(conn_pool, sizeof(struct conn))) == NULL)
+		return NULL;
+
+	c->fd = fd;
+	c->type = type;
+	c->id = next_conn_id++;
+	c->in = NULL;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		mempool_free(conn_pool, c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/* Stops watching c, and closes its socket unless someone else takes it over */
+static void free_conn(struct conn* c, int close_fd)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	free(c->in);
+	if (close_fd)
+		close(c->fd);
+	mempool_free(conn_pool, c);
+}
+
+/* Accepts every pending connection, the listener is non-blocking */
+static void accept_clients(struct conn* listener)
+{
+	struct sockaddr_in remote_addr; /* Remote connection info */
+	socklen_t addr_len;                     /* Address length */
+	struct conn* c;                                 /* Connection of the new client */
+	int newfd;                                      /* New connection socket fd */
+
+	for (;; ) {
+		addr_len = sizeof(remote_addr);
+		newfd = accept4(listener->fd, (struct sockaddr*)&remote_addr, &addr_len, SOCK_NONBLOCK);
+
+		if (newfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				syslog(LOG_WARNING, "Cannot accept new client: %s", strerror(errno));
+			return;
 		}
 
-		p = p->next;
+		if ((c = add_conn(newfd, CONN_CLIENT)) == NULL) {
+			syslog(LOG_WARNING, "Cannot watch new client.");
+			close(newfd);
+			continue;
+		}
+
+		syslog(LOG_INFO, "New connection from: %s:%d",
+		       inet_ntoa(remote_addr.sin_addr),
+		       ntohs(remote_addr.sin_port));
+		// Add client to clients list in order to receive
+		// updates
+		if (init_client(c) < 0)
+			free_conn(c, 1);
+	}
+}
+
+/* Sends out the updates the diff stage has queued so far */
+static void take_updates(struct conn* c)
+{
+	void* item;
+	uint64_t n;
+
+	// Reset first, an update queued after this wakes the main loop again
+	if (read(c->fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		syslog(LOG_WARNING, "Cannot read update queue: %s", strerror(errno));
+
+	while (stageq_trypop(&encoded, &item) == 0)
+		send_updates((struct update_batch*)item);
+}
+
+/* Writes out what is queued for a client whose socket has room again */
+static void flush_conn(struct conn* c)
+{
+	struct client* p;
+
+	// LOCK : Make sure the client is not removed meanwhile
+	pthread_mutex_lock(&clients_lock);
+	if ((p = find_client_ref(c->id)) != NULL) {
+		// LOCK : The queue is shared with send_updates
+		pthread_mutex_lock(p->c_lock);
+		if (!p->closing && flush_client(p) < 0)
+			close_client(p);
+		// UNLOCK
+		pthread_mutex_unlock(p->c_lock);
 	}
+	// UNLOCK
+	pthread_mutex_unlock(&clients_lock);
+}
+
+/* Whether the bytes a client has sent so far hold a whole request. Returns 1
+   if they do, 0 if the rest is still on its way, and -1 for a hello that can
+   never be read. */
+static int request_ready(const byte* buff, size_t len)
+{
+	unsigned long hello_len;        /* Bytes of TLVs in a hello */
+	int n;
+
+	// Anything else is the two bytes of a remove request
+	if (buff[0] != REQ_HELLO)
+		return len >= 2 ? 1 : 0;
+
+	if ((n = get_varint(buff + 1, len - 1, &hello_len)) < 0)
+		return len - 1 >= VARINT_MAX ? -1 : 0;
+	if (hello_len > HELLO_MAX)
+		return -1;
+
+	return len >= 1 + n + hello_len ? 1 : 0;
+}
+
+/* Handles everything a client has sent, and writes out whatever its socket
+   has room for. Edge triggered, so the socket is read from until it has
+   nothing more to say. What it has sent is buffered in the reader of c, so
+   a request that comes in more than one segment waits for the rest. */
+static void handle_client(struct conn* c, int events, pthread_attr_t* tattr)
+{
+	struct thread_arg* targ;        /* Used to pass arguments to threads */
+	pthread_t tid;                          /* Passed to pthread_create */
+	ssize_t n;                                      /* Bytes read in, -1 once hung up */
+	int ready;                                      /* Whether a whole request has arrived */
+
+	if (events & EPOLLOUT)
+		flush_conn(c);
+
+	for (;; ) {
+		// The buffer is only kept while part of a request is waiting
+		if (c->in == NULL && (c->in = new_reader(c->fd)) == NULL) {
+			syslog(LOG_ERR, "Cannot allocate reader for client %lu", c->id);
+			n = -1;
+		} else {
+			n = reader_recv(c->in);
+		}
+
+		ready = 0;
+		if (c->in != NULL && reader_pending(c->in) > 0)
+			ready = request_ready(reader_data(c->in), reader_pending(c->in));
+
+		// Nothing more for now. The rest of a request that came in
+		// more than one segment is a new edge.
+		if (n >= 0 && ready == 0) {
+			if (reader_pending(c->in) == 0) {
+				free(c->in);
+				c->in = NULL;
+			}
+			return;
+		}
+
+		// Hung up, or shut down by kill_clients, maybe half way through
+		// a request
+		if (ready == 0) {
+			// LOCK : The client may already have been removed
+			pthread_mutex_lock(&clients_lock);
+			remove_client_ref(c->id);
+			// UNLOCK
+			pthread_mutex_unlock(&clients_lock);
+
+			free_conn(c, 1);
+			return;
+		}
 
-	return NULL;
+		// A hello upgrades the protocol, anything else is
+		// a disconnect
+		if (reader_data(c->in)[0] == REQ_HELLO && ready > 0 && negotiate_client(c) == 0)
+			continue;
+
+		// Handle disconnect, remove_client closes the socket
+		targ = (struct thread_arg*)malloc(sizeof(struct thread_arg));
+		targ->socket = c->fd;
+		targ->id = c->id;
+		targ->req[0] = 0;
+		targ->req[1] = 0;
+		if (reader_pending(c->in) >= 2)
+			reader_buff(c->in, targ->req, 2);
+
+		free_conn(c, 0);
+		pthread_create(&tid, tattr, remove_client, (void*)targ);
+		return;
+	}
 }
 
 int start_server(int port_number, const char* dir_name, int period)
 {
 	pthread_t tid;                                  /* Passed to pthread_create */
-	struct thread_arg* targ;                /* Used to pass arguments to threads */
 	pthread_attr_t tattr;                   /* Specifies that thread should be detached */
-	fd_set master;                                  /* Keep track of all connections / pipes to multiplex */
-	fd_set read_fds;                        /* Copy of master for select to populate */
-	int fdmax;                                              /* Highest numbered file descriptor */
-	int i;                                                  /* Used to index the master fd list */
+	struct epoll_event events[MAX_EVENTS];  /* Filled in by epoll_wait */
+	struct conn* c;                                 /* Connection an event is for */
+	struct rlimit rl;                               /* Limit on open file descriptors */
+	struct snapshot* snap;                  /* A snapshot for the scan stage */
+	int nevents;                                    /* Number of events returned */
+	int i;                                                  /* Index of an event */
 	int listener;                                   /* Listening socket of the server */
-	int newfd;                                      /* New connection socket fd */
 	struct sockaddr_in local_addr;  /* Local connection info */
-	struct sockaddr_in remote_addr; /* Remote connection info */
-	socklen_t addr_len;                     /* Address length */
-	int pipe_buff[1];                               /* Get sockets into here */
-	pipe_buff[0] = 0;
 
 	// Init signal mask
 	struct sigaction sa;
@@ -904,26 +2248,63 @@ int start_server(int port_number, const char* dir_name, int period)
 	pthread_attr_init(&tattr);
 	pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
 
-	// Initialize the memory pool to store the direntries
-	direntry_pool = init_mempool(sizeof(struct direntry), 512);
+	// Initialize the memory pool to store the snapshot segments
+	snapseg_pool = init_mempool(sizeof(struct snapseg), SNAPSEG_POOL);
+	if (snapseg_pool == NULL) {
+		syslog(LOG_ERR, "Cannot allocate memory pool");
+		exit(1);
+	}
+
+	// Initialize the memory pools to store the connections and
+	// what is queued for them
+	conn_pool = init_mempool(sizeof(struct conn), CONN_POOL);
+	sendq_pool = init_mempool(sizeof(struct sendq_entry), SENDQ_POOL);
+	pending_pool = init_mempool(sizeof(struct pending_entry), PENDING_POOL);
+	if (conn_pool == NULL || sendq_pool == NULL || pending_pool == NULL) {
+		syslog(LOG_ERR, "Cannot allocate memory pool");
+		exit(1);
+	}
 
-	// Set done to 0
-	done = 0;
+	// Keep the latest updates around for clients that come back. The
+	// epoch tells them apart from the updates of an earlier run.
+	if (init_journal(&journal, JOURNAL_SIZE, gconfig.journal_max) < 0) {
+		syslog(LOG_ERR, "Cannot allocate journal");
+		exit(1);
+	}
+	gepoch = ((unsigned long)time(NULL) << 16) ^ getpid();
+	gseq = 0;
 
 	// Initialize the clients linked list
 	clients = (struct clientlist*)malloc(sizeof(struct clientlist));
 	clients->head = NULL;
 	clients->tail = NULL;
 	clients->count = 0;
+	clients->table_size = CLIENT_TABLE_MIN;
+	clients->table = (struct client**)calloc(clients->table_size, sizeof(struct client*));
+	if (clients->table == NULL) {
+		syslog(LOG_ERR, "Cannot allocate client table");
+		exit(1);
+	}
 
 	// Copy into global init_dir
 	strcpy(init_dir, dir_name);
 	gperiod = period;
 
-	// Initialize pipe
-	if (pipe(remove_client_pipes) < 0) {
-		syslog(LOG_ERR, "Cannot create IPC in server.");
-		exit(1);
+	// The period is fixed unless given a range to adapt within, which
+	// it starts out in
+	if (gconfig.period_max == 0) {
+		gconfig.period_min = period;
+		gconfig.period_max = period;
+	} else if (gperiod < gconfig.period_min) {
+		gperiod = gconfig.period_min;
+	} else if (gperiod > gconfig.period_max) {
+		gperiod = gconfig.period_max;
+	}
+
+	// Every connection is a file descriptor, so allow as many as we may
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
 	}
 
 	// Get full path of the directory
@@ -932,6 +2313,16 @@ int start_server(int port_number, const char* dir_name, int period)
 		exit(1);
 	}
 
+	// Keep the directory open for the lifetime of the server
+	if ((dir_fd = open(full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		syslog(LOG_ERR, "Cannot open directory: %s", full_path);
+		exit(1);
+	}
+
+	// Stat each scan batch through io_uring if the kernel lets us
+	if (gconfig.scan_engine == SCAN_URING && (ring = uring_init(SCAN_BATCH)) == NULL)
+		syslog(LOG_WARNING, "io_uring unavailable, using synchronous scans");
+
 #ifdef DAEMONIZE
 	create_daemon("dirapp");
 #endif
@@ -949,15 +2340,26 @@ int start_server(int port_number, const char* dir_name, int period)
 	sigaddset(&mask, SIGHUP);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGINT);
-	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGUSR1);
 
 	// Set the mask
 	if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
 		syslog(LOG_WARNING, "pthread_sigmask failed");
 
-	// Initialize file descriptor lists
-	FD_ZERO(&master);
-	FD_ZERO(&read_fds);
+	// Start the scan workers, for whenever entries are stat'ed synchronously
+	// (including after a broken ring)
+	if (gconfig.scan_workers == 0)
+		gconfig.scan_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (gconfig.scan_workers > MAX_SCAN_WORKERS)
+		gconfig.scan_workers = MAX_SCAN_WORKERS;
+	if (gconfig.scan_workers > 1)
+		scan_pool = workpool_init(gconfig.scan_workers);
+
+	// Create the epoll instance of the main loop
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		syslog(LOG_ERR, "Cannot create epoll instance");
+		exit(1);
+	}
 
 	// Setup local connection info
 	memset(&local_addr, 0, sizeof(local_addr));
@@ -975,87 +2377,96 @@ int start_server(int port_number, const char* dir_name, int period)
 	}
 
 	// Now listen!
-	if (listen(listener, MAX_CLIENTS) < 0) {
+	if (listen(listener, gconfig.backlog) < 0) {
 		syslog(LOG_ERR, "Cannot listen on socket");
 		exit(1);
 	}
 
 	syslog(LOG_INFO, "Starting server!");
 
-	// Have select check for incoming data
-	FD_SET(remove_client_pipes[0], &master);
-	FD_SET(listener, &master);
-	fdmax = listener;
+	// Have epoll check for incoming connections. Edge triggered, so
+	// accept must not block once they have all been taken.
+	if (fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK) < 0
+	    || add_conn(listener, CONN_LISTENER) == NULL) {
+		syslog(LOG_ERR, "Cannot watch listener socket");
+		exit(1);
+	}
+
+	// Initialize the queues in between the stages of the updates, and
+	// the snapshots the scan stage takes turns filling in. With no more
+	// of them, it waits for the stages behind it to catch up.
+	if ((updates_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+	    || stageq_init(&scanned, PIPELINE_DEPTH, -1) < 0
+	    || stageq_init(&encoded, PIPELINE_DEPTH, updates_fd) < 0
+	    || stageq_init(&free_snaps, PIPELINE_DEPTH, -1) < 0) {
+		syslog(LOG_ERR, "Cannot create update queues");
+		exit(1);
+	}
+
+	// Initialize the snapshots
+	prevdir = init_snapshot(snapseg_pool);
+	if (prevdir == NULL) {
+		syslog(LOG_ERR, "Cannot allocate snapshots");
+		exit(1);
+	}
+	for (i = 0; i < PIPELINE_DEPTH; i++) {
+		if ((snap = init_snapshot(snapseg_pool)) == NULL) {
+			syslog(LOG_ERR, "Cannot allocate snapshots");
+			exit(1);
+		}
+		stageq_push(&free_snaps, snap);
+	}
 
-	// Initialize the direntry lists
-	prevdir = init_direntrylist();
-	curdir = init_direntrylist();
+	// Watch the directory before the first scan, so that nothing which
+	// happens in between is missed. Without inotify, every update rescans.
+	if ((watch = dirwatch_init(full_path, wake_updates)) != NULL) {
+		pthread_create(&tid, &tattr, dirwatch_thread, (void*)watch);
+	}
 
 	// Initially populate list of file entries in monitored directory
-	exploredir(prevdir, (const char*)full_path);
+	if (exploredir(prevdir, dir_fd) < 0) {
+		syslog(LOG_ERR, "Cannot read directory: %s: %s", full_path, strerror(errno));
+		exit(1);
+	}
+	last_scan = prevdir;
+	dperiod = gperiod;
+
+	// The main loop sends out what the diff stage encodes
+	if (add_conn(updates_fd, CONN_UPDATES) == NULL
+	    || pthread_create(&tid, &tattr, diff_updates, NULL) != 0) {
+		syslog(LOG_ERR, "Cannot start diff stage");
+		exit(1);
+	}
+
+	// Scans are run one at a time by the scheduler, from here on
+	if ((scheduler = sched_init(gperiod, gconfig.period_min, gconfig.period_max, gconfig.overrun,
+	                            scan_updates, NULL)) == NULL) {
+		syslog(LOG_ERR, "Cannot start scan scheduler");
+		exit(1);
+	}
 
 	// Start signal thread
 	pthread_create(&tid, NULL, signal_thread, NULL);
 
-	int errno = 0;
-
 	// Main server loop
 	while (1) {
-		read_fds = master;
-
-		if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
-			syslog(LOG_ERR, "select: %s", strerror(errno));
+		if ((nevents = epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
 			exit(1);
 		}
 
-		for (i = 0; i <= fdmax; i++) {
-			if (FD_ISSET(i, &read_fds)) {
-				if (i == listener) {
-					addr_len = sizeof(remote_addr);
-					newfd = accept(listener, (struct sockaddr*)&remote_addr, &addr_len);
-
-					if (newfd == -1) {
-						syslog(LOG_WARNING, "Cannot new client.");
-					} else {
-						FD_SET(newfd, &master);
-						if (newfd > fdmax) {
-							fdmax = newfd;
-						}
-
-						syslog(LOG_INFO, "New connection from: %s:%d",
-						       inet_ntoa(remote_addr.sin_addr),
-						       ntohs(remote_addr.sin_port));
-						// Add client to clients list in order to receive
-						// updates
-						pthread_create(&tid, &tattr, init_client, (void*)newfd);
-					}
-				} else if (i == remove_client_pipes[0]) {
-					// Get the file descriptor of the socket that is to
-					// be removed and store into the first position of
-					// tmp_buff
-					if (read(remove_client_pipes[0], pipe_buff, 1) <= 0) {
-						syslog(LOG_ERR, "Cannot read in socket to close.");
-					} else {
-						// Remove socket from master list
-						pthread_mutex_lock(&slock);
-						FD_CLR(pipe_buff[0], &master);
-						done = 1;
-						pthread_mutex_unlock(&slock);
-
-						// Tell kill_clients or whoever they
-						// can procede
-						pthread_cond_signal(&sready);
-					}
-				} else {
-					// Handle disconnect
-					targ = (struct thread_arg*)malloc(sizeof(struct thread_arg));
-					targ->socket = i;
-					targ->pipe = remove_client_pipes[1];
-
-					pthread_create(&tid, &tattr, remove_client, (void*)targ);
-					FD_CLR(i, &master);
-				}
-			}
+		// Only the sockets that are ready are looked at
+		for (i = 0; i < nevents; i++) {
+			c = (struct conn*)events[i].data.ptr;
+
+			if (c->type == CONN_LISTENER)
+				accept_clients(c);
+			else if (c->type == CONN_UPDATES)
+				take_updates(c);
+			else
+				handle_client(c, events[i].events, &tattr);
 		}
 	}
 
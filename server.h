@@ -19,10 +19,21 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stdint.h>
 #include <pthread.h>
 #include <sys/stat.h>
 
 #include "common.h"
+#include "dirwatch.h"
+#include "snapshot.h"
+#include "updatebuf.h"
+#include "journal.h"
+#include "pending.h"
+#include "sendq.h"
+#include "filter.h"
+#include "namedict.h"
+#include "sched.h"
+#include "stageq.h"
 
 #define PERM                            0
 #define UID                                     1
@@ -33,8 +44,53 @@
 #define LFST                            6
 #define ADDED                           7
 #define REMOVED                         8
-#define MODIFIED                        9
-#define CHECKED                         10
+#define RENAMED                         9
+#define MODIFIED                        10
+#define CHECKED                         11
+
+#define DIRENT_BUFF                     32768           /* Bytes of raw directory entries read at once */
+#define SCAN_BATCH                      256                     /* Entries stat'ed in one go */
+#define SCAN_PARALLEL_MIN               32                      /* Smaller batches are not split up */
+#define MAX_SCAN_WORKERS                64                      /* Max threads that share a batch */
+#define SNAPSEG_POOL                    16                      /* Snapshot segments in each slab of the pool */
+#define UPDATE_BUFF                     256                     /* Longest update string, with terminator */
+#define UPDATE_CHUNK                    254                     /* Most strings after one count byte */
+
+#define MAX_EVENTS                      64                      /* Most events handled per epoll_wait() */
+#define CONN_POOL                       64                      /* Connections in each slab of the pool */
+#define CLIENT_TABLE_MIN                64                      /* Initial buckets of the client registry */
+#define DEFAULT_MAX_CLIENTS             10000           /* Clients served at once, unless set with -c */
+#define DEFAULT_BACKLOG                 1024            /* Pending connections, unless set with -b */
+#define DEFAULT_QUEUE_MAX               (4 << 20)       /* Bytes queued for a client, unless set with -q */
+#define SENDQ_POOL                      256                     /* Send queue entries in each slab of the pool */
+#define PENDING_POOL                    256                     /* Pending entries in each slab of the pool */
+#define JOURNAL_SIZE                    4096            /* Most updates kept for clients that come back */
+#define DEFAULT_JOURNAL_MAX             (16 << 20)      /* Bytes of updates kept, unless set with -j */
+#define DEFAULT_COMPRESS_MIN            COMPRESS_MIN    /* Smallest frame compressed, unless set with -z */
+#define SNAPSHOT_PAGE                   1024            /* Entries in each FRAME_SNAPSHOT */
+#define MIN_PERIOD_MS                   50                      /* Shortest period between two scans */
+#define MAX_PERIOD_MS                   255000          /* Longest, what v1 clients can be told */
+#define KILL_DRAIN_MS                   2000            /* Longest kill_clients waits for the sockets
+                                                           to take the error message */
+#define PIPELINE_DEPTH                  2                       /* Scans, and updates, a stage may be ahead
+                                                           of the next one by */
+
+#define OVERFLOW_DISCONNECT             0                       /* A client that falls behind is dropped */
+#define OVERFLOW_RESYNC                 1                       /* A v2 client that falls behind is resynced */
+
+#define CONN_LISTENER           0                       /* The listening socket */
+#define CONN_CLIENT                     1                       /* A connected client */
+#define CONN_UPDATES                    2                       /* eventfd of the queue of encoded updates */
+
+#define SCAN_SYNC                       0                       /* One statx call per entry */
+#define SCAN_URING                      1                       /* A batch of statx calls through io_uring */
+
+/* How entries are looked up, relative to the open directory */
+#define DIRENTRY_STATX_FLAGS    (AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC)
+
+/* Attributes compared by difference_direntrylist(), plus the inode to match on */
+#define DIRENTRY_STATX_MASK     (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE | \
+	                         STATX_ATIME | STATX_MTIME | STATX_CTIME | STATX_INO)
 
 #define CLR_MASK(mask)          (mask = 0)
 
@@ -47,6 +103,7 @@
 #define SET_LFST(mask)          (mask ^= (1 << LFST))
 #define SET_ADDED(mask)         (mask ^= (1 << ADDED))
 #define SET_REMOVED(mask)       (mask ^= (1 << REMOVED))
+#define SET_RENAMED(mask)       (mask ^= (1 << RENAMED))
 #define SET_MODIFIED(mask)      (mask |= (1 << MODIFIED))
 #define SET_CHECKED(mask)       (mask ^= (1 << CHECKED))
 
@@ -59,40 +116,125 @@
 #define IS_LFST(mask)           (mask & (1 << LFST))
 #define IS_ADDED(mask)          (mask & (1 << ADDED))
 #define IS_REMOVED(mask)        (mask & (1 << REMOVED))
+#define IS_RENAMED(mask)        (mask & (1 << RENAMED))
 #define IS_MODIFIED(mask)       (mask & (1 << MODIFIED))
 #define IS_CHECKED(mask)        (mask & (1 << CHECKED))
 
 /* Ensure mutual exclusion for clients (defined in server.c) */
 extern pthread_mutex_t clients_lock;
 
+/* Server settings given on the command line (defined in server.c) */
+struct server_config {
+	int scan_engine;                        /* SCAN_SYNC or SCAN_URING */
+	int scan_workers;                       /* Threads that share a synchronous batch, 0 for one per CPU */
+	int max_clients;                        /* Clients served at once, the rest are turned away */
+	int backlog;                            /* Connections the kernel queues up before they are accepted */
+	long queue_max;                         /* High-water mark of a client's send queue, in bytes */
+	int overflow;                           /* OVERFLOW_DISCONNECT or OVERFLOW_RESYNC */
+	long journal_max;                       /* Bytes of updates kept for clients that come back */
+	long compress_min;                      /* Smallest frame compressed for clients that asked,
+	                                           0 to never compress */
+	int overrun;                            /* SCHED_* policy for a tick that comes during a scan */
+	long period_min;                        /* Range the period adapts within, in milliseconds,
+	                                           both 0 to keep it fixed */
+	long period_max;
+};
+
+extern struct server_config gconfig;
+
+/* prevdir as FRAME_SNAPSHOT pages, encoded once for every client that asks
+   for it before the next change */
+struct snappages {
+	int refs;                                       /* Clients streaming it, and the server while
+	                                           it is current */
+	unsigned long seq;                      /* Change the entries are the state after */
+	int entries;                            /* Entries listed */
+	int count;                                      /* Number of pages, the last one empty */
+	struct updatebuf** pages;
+};
+
 /* Contains information about connected clients. */
 struct client {
 	struct client* next;
 	struct client* prev;
+	struct client* hnext;                   /* Next client in the same bucket */
+	unsigned long id;                       /* Id of the connection, never reused */
 	int socket;
-	pthread_mutex_t* c_lock;
+	int version;                            /* PROTO_V1 or PROTO_V2 */
+	int closing;                            /* Shut down, waiting for the main loop to close it */
+	int resync;                                     /* Owed a FRAME_RESYNC by the next update */
+	struct sendq out;                       /* Written out by whoever finds the socket writable */
+	struct pending pending;                 /* v2 changes held back while out is not empty */
+	struct filter* filter;                  /* What a v2 client subscribed to, NULL for
+	                                           everything. Protected by clients_lock. */
+	struct namedict dict;                   /* Names bound on the connection, unused unless
+	                                           the client asked for TLV_DICT */
+	int compress;                           /* COMPRESS_* codec agreed on with a v2 client */
+	struct snappages* snap;                 /* Snapshot being streamed to the client, NULL
+	                                           once every page has been queued */
+	int snap_next;                          /* Next page of snap to queue */
+	pthread_mutex_t* c_lock;                /* Also protects out, pending and snap */
+};
+
+/* A socket watched by the main loop, handed back by epoll with each of its
+   events. Only the main thread allocates, frees or closes a connection, other
+   threads shut a socket down and leave the rest to it. */
+struct conn {
+	int fd;
+	int type;                                       /* CONN_LISTENER, CONN_CLIENT or CONN_UPDATES */
+	unsigned long id;                       /* Identifies the client, since fds are reused */
+	struct reader* in;                      /* What a client has sent of a request so far,
+	                                           NULL while nothing is waiting */
 };
 
-/* Linked list of connected clients. */
+/* Linked list of connected clients, in the order they connected, along with
+   a hash of them by connection id. */
 struct clientlist {
 	struct client* head;
 	struct client* tail;
 	int count;
+	struct client** table;                  /* Buckets, chained through hnext */
+	unsigned long table_size;               /* Number of buckets, a power of 2 */
 };
 
-/* Contains information about directory items. */
-struct direntry {
-	int mask;
-	char filename[MAX_FILENAME];
-	struct stat attrs;
-	struct direntry* next;
+/* One update, encoded by the diff stage and sent out by the main loop. It
+   holds everything clients can be sent, so the snapshots move on without
+   waiting for it. */
+struct update_batch {
+	struct updatebuf* ub;                   /* For v1 clients */
+	struct updatebuf* frame;                /* For v2 clients, NULL if nothing changed */
+	struct updatebuf* resync;               /* Everything there is after this update, only
+	                                           if a client was owed it */
+	struct updatebuf* period;               /* FRAME_PERIOD, if the period changed */
+	long period_ms;
+	struct pending_change* changes;         /* For v2 clients that hold changes back */
+	int nchanges;
+	struct filter** filters;                /* Filters in use when the update was encoded */
+	struct updatebuf** filtered;            /* frame as each of them lets it through, NULL
+	                                           if nothing is left */
+	int nfilters;
+	unsigned long seq;                      /* Sequence number of the last change */
+	struct snapshot* done;                  /* Snapshot the changes name entries of, handed
+	                                           back to the scan stage once they are sent */
 };
 
-/* Linked list of directory items. */
-struct direntrylist {
-	int count;
-	struct direntry* head;
-	struct direntry* tail;
+/* Raw directory entry as returned by the getdents64 system call. */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct statx;
+
+/* A batch of entries being stat'ed by the scan workers. */
+struct stat_job {
+	const char** names;
+	struct statx* stx;
+	int* results;
+	int dirfd;
 };
 
 /*
@@ -108,9 +250,50 @@ void create_daemon(const char* name);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  send_updates(void* arg)
- *  Description:  Sends updates (if available) to any connected clients.
- *	  Arguments:  None
+ *         Name:  scan_updates(void* arg)
+ *  Description:  The scan stage of the update pipeline. Fills a snapshot in with the
+ *				  directory as it is now, only looking at what the watch reported if
+ *				  there is one, and hands it to the diff stage. Waits for the diff
+ *				  stage to give an older snapshot back if it has fallen behind. Run
+ *				  by the worker of the scan scheduler, every period.
+ *	  Arguments:  arg : Unused
+ *        Locks:  None, only the scan stage fills snapshots in
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void* scan_updates(void* arg);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  diff_updates(void* arg)
+ *  Description:  The diff stage of the update pipeline, a thread of its own. Diffs
+ *				  each snapshot from the scan stage against prevdir and encodes the
+ *				  update for every kind of client, as an update_batch queued for the
+ *				  main loop. Encoding reads the marks the diff left on the snapshots,
+ *				  so the two are one stage. The scheduler adapts the period to
+ *				  whether anything changed.
+ *	  Arguments:  arg : Unused
+ *        Locks:  update_lock : Held while prevdir and curdir are worked on
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void* diff_updates(void* arg);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  send_updates(struct update_batch* b)
+ *  Description:  Sends an update to any connected clients, and frees it. The update
+ *				  is encoded once, and the same bytes are queued for every client.
+ *				  Nothing blocks, whatever a socket does not take right away is
+ *				  written by the main loop. A client whose queue would go past
+ *				  gconfig.queue_max is dropped, or for a v2 client with
+ *				  OVERFLOW_RESYNC, has its unsent updates replaced by a FRAME_RESYNC.
+ *				  A v2 client with a filter only gets the records it subscribed to,
+ *				  filtered once for every client with the same filter. A client owed
+ *				  a resync gets nothing until an update comes with one. v2 clients
+ *				  are sent a FRAME_PERIOD if the period changed. Run by the main
+ *				  loop, in the order the updates were encoded.
+ *	  Arguments:  b : The update, which the snapshot it is done with is handed back from
  *        Locks:  clients_lock : Ensure clients is not changed while sending out
  *                               updates
  *				  c_lock       : Aquires lock to a client when sending updates, so
@@ -120,13 +303,13 @@ void create_daemon(const char* name);
  *      Returns:  (void)
  * =====================================================================================
  */
-void* send_updates(void* arg);
+void send_updates(struct update_batch* b);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  send_error(int socket, const char* err_msg)
- *  Description:  Sends err_msg to the connected client based on the socket fd
- *	  Arguments:  socket  : The socket of the connected client to send the error to
+ *         Name:  send_error(unsigned long id, const char* err_msg)
+ *  Description:  Sends err_msg to the connected client based on the connection id
+ *	  Arguments:  id      : The connection id of the client to send the error to
  *				  err_msg : The error message to send to the client
  *        Locks:  c_lock  : Aquires lock to a client when sending an error, so
  *						    client cannot be removed and other updates have been sent
@@ -134,7 +317,7 @@ void* send_updates(void* arg);
  *      Returns:  1 if no errors, -1 on error
  * =====================================================================================
  */
-int send_error(int socket, const char* err_msg);
+int send_error(unsigned long id, const char* err_msg);
 
 /*
  * ===  FUNCTION  ======================================================================
@@ -146,18 +329,20 @@ int send_error(int socket, const char* err_msg);
  *      Returns:  1 if no errors, -1 on error
  * =====================================================================================
  */
-int send_error(int socket, const char* err_msg);
+int send_error2(int socket, const char* err_msg);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  disconnect_from_client(int socket, int pipe)
+ *         Name:  disconnect_from_client(int socket, const byte* req)
  *  Description:  Sends the disconnect sequence of bytes to client to signal disconnection
  *	  Arguments:  socket  : The socket of the connected client to send the disconnect
  *							signal to
+ *				  req     : The two bytes of the remove request, as read in by the
+ *							main loop
  *      Returns:  1 if no errors, -1 on error
  * =====================================================================================
  */
-int disconnect_from_client(int socket, int pipe);
+int disconnect_from_client(int socket, const byte* req);
 
 /*
  * ===  FUNCTION  ======================================================================
@@ -165,7 +350,7 @@ int disconnect_from_client(int socket, int pipe);
  *  Description:  Starts the server functionality of dirapp.
  *	  Arguments:  port_number : The port number which to bind the server to
  *                                dir_name    : The name/path of directory to monitor
- *				  period      : Time interval to check for updates
+ *				  period      : Milliseconds between two checks for updates
  *        Locks:  None
  *      Returns:  0
  * =====================================================================================
@@ -175,8 +360,9 @@ int start_server(int port_number, const char* dir_name, int period);
 /*
  * ===  FUNCTION  ======================================================================
  *         Name:  signal_thread(void* arg)
- *  Description:  Used to spawn a thread that will handle any incoming signal
- *	  Arguments:  arg : The 'period' variable
+ *  Description:  Handles the signals sent to the server. SIGUSR1 logs what the scan
+ *				  scheduler has been through.
+ *	  Arguments:  arg : Unused
  *        Locks:  None
  *      Returns:  (void)
  * =====================================================================================
@@ -185,14 +371,17 @@ static void* signal_thread(void* arg);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  init_client(int socket)
- *  Description:  Handles a client on a separate thread.
- *	  Arguments:  socket : Represents the socket of the new client
- *        Locks:  clients_lock : Will be locked through a call to add_client_ref(...)
- *      Returns:  (void)
+ *         Name:  init_client(struct conn* c)
+ *  Description:  Sends the handshake to a newly accepted client and adds it to
+ *				  clients, or turns it away if there are too many. Runs in the main
+ *				  loop, the handshake is small enough to never block on a new socket.
+ *	  Arguments:  c : The connection of the new client
+ *        Locks:  clients_lock : No update can be sent in between the handshake and
+ *								 adding the client
+ *      Returns:  0 on success, -1 if the connection should be closed
  * =====================================================================================
  */
-void* init_client(void* arg);
+int init_client(struct conn* c);
 
 /*
  * ===  FUNCTION  ======================================================================
@@ -208,140 +397,285 @@ void* remove_client(void* arg);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  add_client_ref(int socketfd)
- *  Description:  Adds new client to a list of clients.
- *	  Arguments:  socketfd: The socket used to identify the client
- *        Locks:  None
- *      Returns:  (void)
+ *         Name:  add_client_ref(int socketfd, unsigned long id)
+ *  Description:  Adds new client to a list of clients, growing the hash of clients
+ *				  once there are more clients than buckets.
+ *	  Arguments:  socketfd : The socket of the client
+ *				  id       : The connection id used to identify the client
+ *        Locks:  None, clients_lock must be held
+ *      Returns:  The new client, or NULL if memory could not be allocated
  * =====================================================================================
  */
-void add_client_ref(int socketfd);
+struct client* add_client_ref(int socketfd, unsigned long id);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  remove_client_ref(int socketfd)
- *  Description:  Removes a client from a list of clients.
- *	  Arguments:  socketfd: The socket used to identify the client
+ *         Name:  remove_client_ref(unsigned long id)
+ *  Description:  Removes a client from a list of clients, if it is still there.
+ *	  Arguments:  id : The connection id used to identify the client
  *        Locks:  c_lock : Ensure client is not currently receiving updates before
  *						   removing
  *      Returns:  void
  * =====================================================================================
  */
-void remove_client_ref(int socketfd);
+void remove_client_ref(unsigned long id);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  find_client_ref(int socketfd)
+ *         Name:  find_client_ref(unsigned long id)
  *  Description:  Retrieves a pointer to the partiular client
- *	  Arguments:  socketfd: The socket used to identify the client
- *        Locks:  None
- *      Returns:  A pointer that represents the client given by the socket
+ *	  Arguments:  id : The connection id used to identify the client
+ *        Locks:  None, clients_lock must be held
+ *      Returns:  A pointer that represents the client given by the id, or NULL
  *                Free?:  No
  * =====================================================================================
  */
-struct client* find_client_ref(int socketfd);
+struct client* find_client_ref(unsigned long id);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  init_direntrylist()
- *  Description:  Initializes and returns a new direntrylist
- *	  Arguments:  None
+ *         Name:  stat_direntries(names, stx, results, n, dirfd)
+ *  Description:  Gets the attributes of n entries in the directory open as dirfd.
+ *				  All n are submitted at once through io_uring if it is available,
+ *				  otherwise they are split between the scan workers. Only the attributes
+ *				  in DIRENTRY_STATX_MASK are filled in, and symlinks are not followed.
+ *    Arguments:  names   : The names of the entries to stat
+ *				  stx     : Receives the attributes of each entry
+ *				  results : Set to 0 or -errno for each entry
+ *				  n       : Number of entries, at most SCAN_BATCH
+ *				  dirfd   : The open directory that holds the entries
  *        Locks:  None
- *      Returns:  A pointer that represents a list of entries within a directory or
- *				  NULL if memory could not be allocated
- *                Free?:  Yes
+ *      Returns:  0
  * =====================================================================================
  */
-struct direntrylist* init_direntrylist();
+int stat_direntries(const char** names, struct statx* stx, int* results, int n, int dirfd);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  add_direntry(struct direntrylist* list, struct direntry* entry)
- *  Description:  Adds a direntry to a given direntrylist
- *    Arguments:  list  : Directory list
- *				  entry : Entry to add from the directory list
+ *         Name:  exploredir(struct snapshot* snap, int dirfd)
+ *  Description:  Builds a snapshot with the name and attributes of all files in
+ *				  the directory open as dirfd. The entries are streamed in with
+ *				  getdents64 through dirent_buff, in no particular order.
+ *    Arguments:  snap  : Store the results of the exploration in here
+ *				  dirfd : The open directory to explore
  *        Locks:  None
- *      Returns:  1 on success, -1 on fail
+ *      Returns:  0 on success, -1 with errno set if the directory cannot be rewound
+ *				  or read, snap then holds whatever was read before
+ *        Free?:  No
  * =====================================================================================
  */
-int add_direntry(struct direntrylist* list, struct direntry* entry);
+int exploredir(struct snapshot* snap, int dirfd);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  reuse_direntrylist(struct direntrylist* list)
- *  Description:  Removes all direntries in the given list, so the list can be reused
- *    Arguments:  list  : A directory list to recycle
+ *         Name:  refreshdir(snap, prev, changes, dirfd)
+ *  Description:  Builds a snapshot from the previous contents of the directory,
+ *				  only looking at the entries that the watch reported as changed
+ *    Arguments:  snap    : Store the results of the refresh in here
+ *				  prev    : The previous contents/attributes of the directory
+ *				  changes : The names of the entries that have changed since prev
+ *				  dirfd   : The open directory to refresh
  *        Locks:  None
- *      Returns:  (void)
+ *      Returns:  0
  * =====================================================================================
  */
-void reuse_direntrylist(struct direntrylist* list);
+int refreshdir(struct snapshot* snap, struct snapshot* prev,
+               struct dirchangeset* changes, int dirfd);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  find_direntry(struct direntrylist* list, struct direntry* entry)
- *  Description:  Finds the corresponding entry with same inode id in the specified
- *                direntrylist instance
- *    Arguments:  list  : A directory list to search through
- *				  entry : The entry to find in list
- *        Locks:  None
- *      Returns:  The reference to the direntry with same ionode as entry or NULL if
- *				  not found
+ *         Name:  difference_direntrylist()
+ *  Description:  Finds all the differences in the monitored directory by setting a
+ *				  bit mask associated with each file entry with all the differences
+ *				  found. An entry that kept its inode but not its name is marked
+ *				  RENAMED, with match set to the index of its new entry. curdir is
+ *				  the snapshot from the scan stage, prevdir the one before it.
+ *    Arguments:  None
+ *        Locks:  None, update_lock must be held
+ *      Returns:  The number of differences found in the monitored directory
  * =====================================================================================
  */
-struct direntry* find_direntry(struct direntrylist* list, struct direntry* entry);
+int difference_direntrylist();
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  exploredir(struct direntrylist* list, const char* path)
- *  Description:  Builds a direntrylist with the name and attributes of all files in
- *				  the directory specified by path
- *    Arguments:  list : Store the results of the exploration in here
- *				  path : The name/path of directory to explore
+ *         Name:  append_diff(buff, mode, filename, desc)
+ *  Description:  Writes the mode, filename, and description of an update to buff,
+ *				  cut short to fit in UPDATE_BUFF bytes
+ *    Arguments:  buff     : Where to write the update, UPDATE_BUFF bytes long
+ *				  mode     : ! (modified), - (removed), + (added) or > (renamed)
+ *				  filename : Name of the entry the update is about
+ *				  desc     : Human readable description of the update
  *        Locks:  None
- *      Returns:  A pointer to a directory entry list with the most up-to-date info
- *        Free?:  Yes
+ *      Returns:  (void)
  * =====================================================================================
  */
-int exploredir(struct direntrylist* list, const char* path);
+void append_diff(byte* buff, const char* mode, const char* filename, const char* desc);
+
+/* An update being encoded, as chunks of a count byte followed by that many
+   strings. */
+struct update_encoder {
+	struct updatebuf* ub;
+	size_t count_at;                        /* Offset of the count of the current chunk */
+	int count;                                      /* Strings in the current chunk */
+};
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  difference_direntrylist()
- *  Description:  Finds all the differences in the monitored directory by setting a
- *				  bit mask associated with each file entry with all the differences
- *				  found
+ *         Name:  encode_updates()
+ *  Description:  Encodes the differences marked by difference_direntrylist() the way
+ *				  clients expect them, in chunks of at most UPDATE_CHUNK strings. An
+ *				  update without differences is a lone NO_UPDATES byte. A rename is
+ *				  a removal of the old name and an addition of the new one, as v1
+ *				  clients know no other way to be told of it.
  *    Arguments:  None
- *        Locks:  None
- *      Returns:  The number of differences found in the monitored directory
+ *        Locks:  None, update_lock must be held
+ *      Returns:  The encoded update, with one reference held by the caller
+ *        Free?:  Yes, with updatebuf_unref
  * =====================================================================================
  */
-int difference_direntrylist();
+struct updatebuf* encode_updates();
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  append_diff(buff, mode, filename, desc)
- *  Description:  Appends the mode, filename, and description of an update to buff
- *    Arguments:  list : Store the results of the exploration in here
- *				  path : The name/path of directory to explore
+ *         Name:  encode_frames(int diffs, unsigned long* seq)
+ *  Description:  Encodes the differences marked by difference_direntrylist() as a
+ *				  single protocol v2 FRAME_UPDATES, one record per entry, however
+ *				  many entries changed. Each record is one change, numbered on from
+ *				  *seq.
+ *    Arguments:  diffs : Number of differences found
+ *				  seq   : Sequence number of the last change so far, advanced to the
+ *				          last change in the frame
+ *        Locks:  None, update_lock must be held
+ *      Returns:  The encoded frame with one reference held by the caller, or NULL if
+ *				  nothing changed
+ *        Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* encode_frames(int diffs, unsigned long* seq);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  encode_filtered(struct filter* f, unsigned long seq)
+ *  Description:  Encodes the differences marked by difference_direntrylist() that f
+ *				  lets through, straight from the snapshot masks, as the frame
+ *				  filter_frame(...) would make of the one from encode_frames(...)
+ *    Arguments:  f   : The filter
+ *				  seq : Sequence number of the last change of the update
+ *        Locks:  None, update_lock must be held
+ *      Returns:  The encoded frame with one reference held by the caller, or NULL if
+ *				  f lets nothing through
+ *        Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* encode_filtered(struct filter* f, unsigned long seq);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  encode_resync(struct snapshot* snap, unsigned long seq)
+ *  Description:  Encodes a FRAME_RESYNC that lists every entry of snap as a
+ *				  REC_ADDED record
+ *    Arguments:  snap : The snapshot to list
+ *				  seq  : Sequence number of the last change snap reflects
+ *        Locks:  None, update_lock must be held
+ *      Returns:  The encoded frame with one reference held by the caller
+ *        Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* encode_resync(struct snapshot* snap, unsigned long seq);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  get_snappages()
+ *  Description:  Returns prevdir as FRAME_SNAPSHOT pages of SNAPSHOT_PAGE entries,
+ *				  encoding it unless it already has been since the last change
+ *    Arguments:  None
+ *        Locks:  None, update_lock must be held
+ *      Returns:  The pages with one reference held by the caller, or NULL if memory
+ *				  could not be allocated
+ *        Free?:  Yes, with snappages_unref
+ * =====================================================================================
+ */
+struct snappages* get_snappages();
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  snappages_unref(struct snappages* sp)
+ *  Description:  Drops a reference to sp, and frees it along with its pages once
+ *				  nobody holds one
+ *    Arguments:  sp : The pages
  *        Locks:  None
- *      Returns:  A pointer to a directory entry list with the most up-to-date info
- *        Free?:  Yes
+ *      Returns:  (void)
  * =====================================================================================
  */
-void append_diff(byte* buff, const char* mode, const char* filename, const char* desc);
+void snappages_unref(struct snappages* sp);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  queue_client(struct client* p, struct updatebuf* ub)
+ *  Description:  Queues ub for p and writes out as much of the queue as the socket
+ *				  takes right away. The frames of a client with a name table are
+ *				  re-encoded with it first. Once the queue is empty, the next page of
+ *				  a snapshot being streamed, or else the changes held back, are
+ *				  queued. A client whose socket is broken is shut down.
+ *    Arguments:  p  : The client
+ *				  ub : The bytes to send, a reference is taken
+ *        Locks:  None, c_lock of p must be held
+ *      Returns:  0 on success, -1 if the client was shut down
+ * =====================================================================================
+ */
+int queue_client(struct client* p, struct updatebuf* ub);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  close_client(struct client* p)
+ *  Description:  Drops everything queued for p and shuts its socket down. The main
+ *				  loop removes p and closes the socket once it sees the hang up.
+ *    Arguments:  p : The client
+ *        Locks:  None, c_lock of p must be held
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void close_client(struct client* p);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  negotiate_client(struct conn* c)
+ *  Description:  Reads a REQ_HELLO from a client that has been sent the v1 handshake,
+ *				  and switches it over to the newest protocol both sides speak. The
+ *				  hello is read from the reader of c, which the main loop fills in
+ *				  until all of it has arrived. A client that resumes is sent the updates it missed
+ *				  from the journal, or a FRAME_RESYNC with the next update if they
+ *				  are gone. A TLV_FILTER subscribes the client to part of the updates
+ *				  only, a TLV_DICT has names sent as references to a table of the
+ *				  connection, and a TLV_COMPRESS has large frames compressed. A client
+ *				  that does not resume and sends a TLV_SNAPSHOT is streamed the
+ *				  entries there are, a page at a time as its socket takes them,
+ *				  before any update.
+ *    Arguments:  c : The connection of the client
+ *        Locks:  update_lock  : prevdir only matches gseq once the updates encoded
+ *				                 so far are sent, taken only if a snapshot is asked
+ *				                 for
+ *				  clients_lock : Make sure the client is not removed meanwhile
+ *				  c_lock       : The switch happens in between two updates
+ *      Returns:  0 on success, -1 if the hello could not be read
+ * =====================================================================================
+ */
+int negotiate_client(struct conn* c);
 
 /*
  * ===  FUNCTION  ======================================================================
- *         Name:  kill_clients(int pipe, const char* message)
- *  Description:  Removes all connected clients
- *    Arguments:  pipe    : Send socket to remove back to main thread
- *				  message : The message to send to clients explaining disconnect
+ *         Name:  kill_clients(const char* message)
+ *  Description:  Removes all connected clients. Whatever updates they have not
+ *				  started on are dropped, and the error message is written out before
+ *				  their sockets are shut down, waiting up to KILL_DRAIN_MS in all for
+ *				  them to take it. The main loop closes them once it sees the hang up.
+ *    Arguments:  message : The message to send to clients explaining disconnect
  *        Locks:  clients_lock : Make sure clients is not altered while sending error
  *				  c_lock       : Make sure server is not currently sending updates to
  *                               particular client
  *      Returns:  (void)
  * =====================================================================================
  */
-void kill_clients(int pipe, const char* message);
+void kill_clients(const char* message);
 #endif
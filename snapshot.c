@@ -0,0 +1,265 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  snapshot.c
+ *
+ *    Description:  A compact snapshot of the contents/attributes of a directory,
+ *					stored as parallel arrays with the names in one arena.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/2026 10:12:40
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+struct snapshot* init_snapshot(struct mempool* pool)
+{
+	struct snapshot* snap;          /* New snapshot */
+
+	snap = (struct snapshot*)calloc(1, sizeof(struct snapshot));
+	if (snap == NULL)
+		return NULL;
+
+	snap->pool = pool;
+
+	// Start small, everything grows along with the snapshot
+	snap->names_cap = SNAP_NAMES_MIN;
+	snap->names = (char*)malloc(snap->names_cap);
+	snap->index_size = SNAP_INDEX_MIN;
+	snap->index = (int*)malloc(snap->index_size * sizeof(int));
+	if (snap->names == NULL || snap->index == NULL) {
+		free(snap->names);
+		free(snap->index);
+		free(snap);
+		return NULL;
+	}
+
+	// Every byte set means every slot is SNAP_NONE
+	memset(snap->index, 0xFF, snap->index_size * sizeof(int));
+
+	return snap;
+}
+
+void reuse_snapshot(struct snapshot* snap)
+{
+	int i;
+
+	// Return segments back to pool
+	for (i = 0; i < snap->nsegs; i++) {
+		mempool_free(snap->pool, snap->segs[i]);
+		snap->segs[i] = NULL;
+	}
+
+	snap->nsegs = 0;
+	snap->count = 0;
+	snap->names_len = 0;
+
+	// Keep the index at its size, the next scan is likely just as big
+	memset(snap->index, 0xFF, snap->index_size * sizeof(int));
+}
+
+/* Position in an index of index_size slots to start looking for a (dev, ino) pair */
+static unsigned long index_slot(dev_t dev, ino_t ino, int index_size)
+{
+	unsigned long long h;
+
+	// Mix the bits, since inode numbers tend to be close together
+	h = ((unsigned long long)ino ^ ((unsigned long long)dev << 32)) * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+
+	return (unsigned long)(h & (index_size - 1));
+}
+
+/* Puts entry i of snap in the first free slot of index, starting from its own */
+static void index_entry(struct snapshot* snap, int* index, int index_size, int i)
+{
+	unsigned long slot;
+
+	slot = index_slot(SNAP_FIELD(snap, dev, i), SNAP_FIELD(snap, ino, i), index_size);
+	while (index[slot] != SNAP_NONE)
+		slot = (slot + 1) & (index_size - 1);
+
+	index[slot] = i;
+}
+
+/* Doubles the index of snap and puts every entry back in */
+static int grow_index(struct snapshot* snap)
+{
+	int* index;                                     /* The bigger index */
+	int i;
+
+	index = (int*)malloc(snap->index_size * 2 * sizeof(int));
+	if (index == NULL)
+		return -1;
+
+	memset(index, 0xFF, snap->index_size * 2 * sizeof(int));
+
+	free(snap->index);
+	snap->index = index;
+	snap->index_size *= 2;
+
+	for (i = 0; i < snap->count; i++)
+		index_entry(snap, snap->index, snap->index_size, i);
+
+	return 0;
+}
+
+/* Makes room for one more entry and a name of len bytes, with terminator */
+static int reserve_entry(struct snapshot* snap, size_t len)
+{
+	struct snapseg** segs;
+	char* names;
+	size_t cap;
+
+	// Keep the index at most half full, so lookups stay short
+	if ((snap->count + 1) * 2 > snap->index_size && grow_index(snap) < 0)
+		return -1;
+
+	if (snap->names_len + len > snap->names_cap) {
+		cap = snap->names_cap;
+		while (snap->names_len + len > cap)
+			cap *= 2;
+		if ((names = (char*)realloc(snap->names, cap)) == NULL)
+			return -1;
+		snap->names = names;
+		snap->names_cap = cap;
+	}
+
+	// The last segment is full (or there is none yet)
+	if (snap->count == snap->nsegs * SNAP_SEG_ENTRIES) {
+		if (snap->nsegs == snap->segs_cap) {
+			cap = snap->segs_cap == 0 ? 16 : snap->segs_cap * 2;
+			segs = (struct snapseg**)realloc(snap->segs, cap * sizeof(struct snapseg*));
+			if (segs == NULL)
+				return -1;
+			snap->segs = segs;
+			snap->segs_cap = cap;
+		}
+
+		snap->segs[snap->nsegs] = (struct snapseg*)mempool_alloc(snap->pool, sizeof(struct snapseg));
+		if (snap->segs[snap->nsegs] == NULL)
+			return -1;
+		snap->nsegs++;
+	}
+
+	return 0;
+}
+
+/* Appends the name of a new entry i to the arena */
+static void add_name(struct snapshot* snap, int i, const char* name, size_t len)
+{
+	memcpy(snap->names + snap->names_len, name, len);
+	SNAP_FIELD(snap, name, i) = (unsigned int)snap->names_len;
+	snap->names_len += len;
+}
+
+int snapshot_add(struct snapshot* snap, const char* name, const struct snapattrs* attrs)
+{
+	struct snapseg* seg;
+	size_t len;
+	int i;
+	int j;
+
+	len = strlen(name) + 1;
+	if (reserve_entry(snap, len) < 0)
+		return -1;
+
+	i = snap->count++;
+	seg = SNAP_SEG(snap, i);
+	j = SNAP_SLOT(i);
+
+	seg->dev[j] = attrs->dev;
+	seg->ino[j] = attrs->ino;
+	seg->mode[j] = attrs->mode;
+	seg->uid[j] = attrs->uid;
+	seg->gid[j] = attrs->gid;
+	seg->size[j] = attrs->size;
+	seg->atime[j] = attrs->atime;
+	seg->mtime[j] = attrs->mtime;
+	seg->ctime[j] = attrs->ctime;
+	seg->mask[j] = 0;
+	seg->match[j] = SNAP_NONE;
+	add_name(snap, i, name, len);
+
+	index_entry(snap, snap->index, snap->index_size, i);
+
+	return i;
+}
+
+int snapshot_copy(struct snapshot* snap, struct snapshot* from, int i)
+{
+	struct snapattrs attrs;
+
+	snapshot_get(from, i, &attrs);
+
+	return snapshot_add(snap, SNAP_NAME(from, i), &attrs);
+}
+
+void snapshot_get(struct snapshot* snap, int i, struct snapattrs* attrs)
+{
+	struct snapseg* seg;
+	int j;
+
+	seg = SNAP_SEG(snap, i);
+	j = SNAP_SLOT(i);
+
+	attrs->dev = seg->dev[j];
+	attrs->ino = seg->ino[j];
+	attrs->mode = seg->mode[j];
+	attrs->uid = seg->uid[j];
+	attrs->gid = seg->gid[j];
+	attrs->size = seg->size[j];
+	attrs->atime = seg->atime[j];
+	attrs->mtime = seg->mtime[j];
+	attrs->ctime = seg->ctime[j];
+}
+
+int snapshot_find(struct snapshot* snap, dev_t dev, ino_t ino, const char* name, int skip)
+{
+	int first;                                      /* First match under another name */
+	int i;
+	unsigned long slot;
+
+	// Check for equality based on the device and the inode, which
+	// together are unique even if something else is mounted inside
+	// the monitored directory
+	first = SNAP_NONE;
+	slot = index_slot(dev, ino, snap->index_size);
+	while ((i = snap->index[slot]) != SNAP_NONE) {
+		if (SNAP_FIELD(snap, ino, i) == ino && SNAP_FIELD(snap, dev, i) == dev) {
+			if (strcmp(SNAP_NAME(snap, i), name) == 0)
+				return i;
+			if (first == SNAP_NONE && (SNAP_FIELD(snap, mask, i) & skip) == 0)
+				first = i;
+		}
+
+		slot = (slot + 1) & (snap->index_size - 1);
+	}
+
+	return first;
+}
+
+void clear_snapshot_masks(struct snapshot* snap)
+{
+	int i;
+	int n;                                          /* Entries in the current segment */
+
+	for (i = 0; i < snap->nsegs; i++) {
+		n = snap->count - i * SNAP_SEG_ENTRIES;
+		if (n > SNAP_SEG_ENTRIES)
+			n = SNAP_SEG_ENTRIES;
+
+		memset(snap->segs[i]->mask, 0, n * sizeof(int));
+		memset(snap->segs[i]->match, 0xFF, n * sizeof(int));
+	}
+}
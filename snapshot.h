@@ -0,0 +1,186 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  snapshot.h
+ *
+ *    Description:  A compact snapshot of the contents/attributes of a directory. The
+ *					attributes compared by the diff are kept in parallel arrays, in
+ *					fixed size segments, and the names are packed into one string
+ *					arena. An entry is identified by its index in the snapshot.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/2026 09:47:13
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "mempool.h"
+
+#define SNAP_SEG_SHIFT          10
+#define SNAP_SEG_ENTRIES        (1 << SNAP_SEG_SHIFT)   /* Entries in a segment */
+#define SNAP_SEG_MASK           (SNAP_SEG_ENTRIES - 1)
+
+#define SNAP_INDEX_MIN          64                      /* Initial slots in the index */
+#define SNAP_NAMES_MIN          4096                    /* Initial bytes in the name arena */
+#define SNAP_NONE               (-1)                    /* No entry */
+
+/* The segment and the slot in it of entry i */
+#define SNAP_SEG(snap, i)       ((snap)->segs[(i) >> SNAP_SEG_SHIFT])
+#define SNAP_SLOT(i)            ((i) & SNAP_SEG_MASK)
+
+/* A field of entry i, can be assigned to */
+#define SNAP_FIELD(snap, field, i)      (SNAP_SEG(snap, i)->field[SNAP_SLOT(i)])
+
+/* Two timestamps are the same to the nanosecond */
+#define SNAP_TIME_EQ(a, b)      ((a).tv_sec == (b).tv_sec && (a).tv_nsec == (b).tv_nsec)
+
+/* The name of entry i */
+#define SNAP_NAME(snap, i)      ((snap)->names + SNAP_FIELD(snap, name, i))
+
+/* Attributes of one entry, used to move an entry in and out of a snapshot */
+struct snapattrs {
+	dev_t dev;
+	ino_t ino;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	off_t size;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+};
+
+/* SNAP_SEG_ENTRIES entries, one array per attribute */
+struct snapseg {
+	dev_t dev[SNAP_SEG_ENTRIES];
+	ino_t ino[SNAP_SEG_ENTRIES];
+	off_t size[SNAP_SEG_ENTRIES];
+	struct timespec atime[SNAP_SEG_ENTRIES];
+	struct timespec mtime[SNAP_SEG_ENTRIES];
+	struct timespec ctime[SNAP_SEG_ENTRIES];
+	mode_t mode[SNAP_SEG_ENTRIES];
+	uid_t uid[SNAP_SEG_ENTRIES];
+	gid_t gid[SNAP_SEG_ENTRIES];
+	unsigned int name[SNAP_SEG_ENTRIES];            /* Offset of the name in the arena */
+	int mask[SNAP_SEG_ENTRIES];                     /* Differences found by the diff */
+	int match[SNAP_SEG_ENTRIES];                    /* Index of the new entry of a rename */
+};
+
+/* The contents/attributes of a directory, indexed by (dev, ino) */
+struct snapshot {
+	int count;
+	struct snapseg** segs;
+	int nsegs;                                      /* Segments in use */
+	int segs_cap;                                   /* Room in segs */
+	char* names;                                    /* Arena of null terminated names */
+	size_t names_len;
+	size_t names_cap;
+	int* index;                                     /* Open addressing, linear probing */
+	int index_size;                                 /* Slots in index, a power of 2 */
+	struct mempool* pool;                           /* Where segments come from */
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  init_snapshot(struct mempool* pool)
+ *  Description:  Initializes and returns a new, empty snapshot
+ *	  Arguments:  pool : Memory pool that segments are allocated from
+ *        Locks:  None
+ *      Returns:  A new snapshot or NULL if memory could not be allocated
+ *		  Free?:  Yes
+ * =====================================================================================
+ */
+struct snapshot* init_snapshot(struct mempool* pool);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  reuse_snapshot(struct snapshot* snap)
+ *  Description:  Removes every entry of snap, so it can be reused. Segments go back
+ *				  to the pool, the arena and the index keep their size.
+ *	  Arguments:  snap : The snapshot to recycle
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void reuse_snapshot(struct snapshot* snap);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  snapshot_add(struct snapshot* snap, const char* name, attrs)
+ *  Description:  Appends an entry to snap and its index, with a clear mask
+ *	  Arguments:  snap  : The snapshot to add to
+ *				  name  : Name of the entry
+ *				  attrs : Attributes of the entry
+ *        Locks:  None
+ *      Returns:  Index of the new entry or -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int snapshot_add(struct snapshot* snap, const char* name, const struct snapattrs* attrs);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  snapshot_copy(struct snapshot* snap, struct snapshot* from, int i)
+ *  Description:  Appends entry i of from to snap, with a clear mask
+ *	  Arguments:  snap : The snapshot to add to
+ *				  from : The snapshot to copy from
+ *				  i    : Index of the entry in from
+ *        Locks:  None
+ *      Returns:  Index of the new entry or -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int snapshot_copy(struct snapshot* snap, struct snapshot* from, int i);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  snapshot_get(struct snapshot* snap, int i, struct snapattrs* attrs)
+ *  Description:  Copies the attributes of entry i of snap into attrs
+ *	  Arguments:  snap  : The snapshot to read from
+ *				  i     : Index of the entry
+ *				  attrs : Receives the attributes
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void snapshot_get(struct snapshot* snap, int i, struct snapattrs* attrs);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  snapshot_find(struct snapshot* snap, dev, ino, name, skip)
+ *  Description:  Finds an entry with the given device and inode id through the index.
+ *				  Hard links share both, so an entry that also has the given name
+ *				  wins over the others. Entries with any of the skip bits set in
+ *				  their mask are only returned if they have the given name.
+ *	  Arguments:  snap : The snapshot to search through
+ *				  dev  : Device of the entry
+ *				  ino  : Inode id of the entry
+ *				  name : Preferred name of the entry
+ *				  skip : Mask bits of entries to pass over
+ *        Locks:  None
+ *      Returns:  Index of the entry or SNAP_NONE if not found
+ * =====================================================================================
+ */
+int snapshot_find(struct snapshot* snap, dev_t dev, ino_t ino, const char* name, int skip);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  clear_snapshot_masks(struct snapshot* snap)
+ *  Description:  Clears the mask and match of every entry in snap
+ *	  Arguments:  snap : The snapshot to clear
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void clear_snapshot_masks(struct snapshot* snap);
+
+#endif  // SNAPSHOT_H
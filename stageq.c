@@ -0,0 +1,96 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  stageq.c
+ *
+ *    Description:  A bounded queue between two stages of the update pipeline.
+ *
+ *        Version:  1.0
+ *        Created:  23/10/2026 09:26:05
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "stageq.h"
+
+int stageq_init(struct stageq* q, unsigned long size, int event_fd)
+{
+	if ((q->slots = (void**)calloc(size, sizeof(void*))) == NULL)
+		return -1;
+
+	q->size = size;
+	q->head = 0;
+	q->tail = 0;
+	q->event_fd = event_fd;
+	if (sem_init(&q->items, 0, 0) < 0 || sem_init(&q->space, 0, size) < 0) {
+		free(q->slots);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Takes the item at the head, once items has been taken down for it */
+static void* take(struct stageq* q)
+{
+	unsigned long head;
+	void* item;
+
+	// Pairs with the release of the producer, the slot is filled in
+	head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	(void)__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	item = q->slots[head % q->size];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	sem_post(&q->space);
+
+	return item;
+}
+
+void stageq_push(struct stageq* q, void* item)
+{
+	unsigned long tail;
+	uint64_t one = 1;
+
+	while (sem_wait(&q->space) < 0 && errno == EINTR)
+		;
+
+	tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	q->slots[tail % q->size] = item;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	sem_post(&q->items);
+
+	// Nothing is lost if this fails while the counter is already up,
+	// the consumer is woken by the write that put it there
+	if (q->event_fd >= 0)
+		(void)write(q->event_fd, &one, sizeof(one));
+}
+
+void* stageq_pop(struct stageq* q)
+{
+	while (sem_wait(&q->items) < 0 && errno == EINTR)
+		;
+
+	return take(q);
+}
+
+int stageq_trypop(struct stageq* q, void** item)
+{
+	if (sem_trywait(&q->items) < 0)
+		return -1;
+
+	*item = take(q);
+
+	return 0;
+}
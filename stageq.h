@@ -0,0 +1,90 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  stageq.h
+ *
+ *    Description:  A bounded queue between two stages of the update pipeline, with
+ *					one thread pushing and one thread popping. The slots are handed
+ *					over without a lock, a semaphore counts the items and another the
+ *					free slots, so a stage only ever sleeps when the queue is empty
+ *					or, which holds back the stage in front of it, full.
+ *
+ *        Version:  1.0
+ *        Created:  23/10/2026 09:12:37
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef STAGEQ_H
+#define STAGEQ_H
+
+#include <semaphore.h>
+
+struct stageq {
+	void** slots;
+	unsigned long size;                     /* Number of slots */
+	unsigned long head;                     /* Slots taken so far, only moved by the consumer */
+	unsigned long tail;                     /* Slots filled so far, only moved by the producer */
+	sem_t items;                            /* Filled slots not taken yet */
+	sem_t space;                            /* Free slots */
+	int event_fd;                           /* eventfd written to after each push, -1 for none */
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  stageq_init(struct stageq* q, unsigned long size, int event_fd)
+ *  Description:  Initializes an empty queue
+ *	  Arguments:  q        : The queue
+ *				  size     : Most items it holds
+ *				  event_fd : eventfd to wake the consumer through, for one that waits
+ *							 on more than the queue, or -1
+ *        Locks:  None
+ *      Returns:  0 on success, -1 on error
+ * =====================================================================================
+ */
+int stageq_init(struct stageq* q, unsigned long size, int event_fd);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  stageq_push(struct stageq* q, void* item)
+ *  Description:  Adds item at the tail, waiting for room if the queue is full.
+ *				  Only ever called by one thread.
+ *	  Arguments:  q    : The queue
+ *				  item : Anything, including NULL
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void stageq_push(struct stageq* q, void* item);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  stageq_pop(struct stageq* q)
+ *  Description:  Takes the item at the head, waiting for one if the queue is empty.
+ *				  Only ever called by one thread.
+ *	  Arguments:  q : The queue
+ *        Locks:  None
+ *      Returns:  The item
+ * =====================================================================================
+ */
+void* stageq_pop(struct stageq* q);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  stageq_trypop(struct stageq* q, void** item)
+ *  Description:  Takes the item at the head, if there is one. Called by the same
+ *				  thread as stageq_pop(...).
+ *	  Arguments:  q    : The queue
+ *				  item : Receives the item
+ *        Locks:  None
+ *      Returns:  0 if an item was taken, -1 if the queue is empty
+ * =====================================================================================
+ */
+int stageq_trypop(struct stageq* q, void** item);
+
+#endif  // STAGEQ_H
@@ -0,0 +1,226 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  updatebuf.c
+ *
+ *    Description:  A reference counted buffer that holds the encoded bytes of one
+ *					update.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/2026 14:18:02
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "updatebuf.h"
+
+struct updatebuf* new_updatebuf()
+{
+	struct updatebuf* ub;
+
+	ub = (struct updatebuf*)malloc(sizeof(struct updatebuf));
+	if (ub == NULL)
+		return NULL;
+
+	ub->cap = UPDATEBUF_MIN;
+	if ((ub->data = (byte*)malloc(ub->cap)) == NULL) {
+		free(ub);
+		return NULL;
+	}
+
+	ub->refs = 1;
+	ub->len = 0;
+	ub->packed = NULL;
+
+	return ub;
+}
+
+int updatebuf_put(struct updatebuf* ub, const void* data, size_t len)
+{
+	byte* bigger;
+	size_t cap;
+
+	if (ub->len + len > ub->cap) {
+		cap = ub->cap;
+		while (ub->len + len > cap)
+			cap *= 2;
+		if ((bigger = (byte*)realloc(ub->data, cap)) == NULL)
+			return -1;
+		ub->data = bigger;
+		ub->cap = cap;
+	}
+
+	memcpy(ub->data + ub->len, data, len);
+	ub->len += len;
+
+	return 0;
+}
+
+int updatebuf_put_byte(struct updatebuf* ub, byte b)
+{
+	return updatebuf_put(ub, &b, 1);
+}
+
+int updatebuf_put_string(struct updatebuf* ub, const char* str)
+{
+	size_t len;
+
+	len = strlen(str);
+	if (len > 255)
+		len = 255;
+
+	if (updatebuf_put_byte(ub, (byte)len) < 0)
+		return -1;
+
+	return updatebuf_put(ub, str, len);
+}
+
+int updatebuf_put_varint(struct updatebuf* ub, unsigned long v)
+{
+	byte buff[VARINT_MAX];
+
+	return updatebuf_put(ub, buff, put_varint(buff, v));
+}
+
+int updatebuf_put_vstring(struct updatebuf* ub, const char* str)
+{
+	size_t len;
+
+	len = strlen(str);
+	if (updatebuf_put_varint(ub, len) < 0)
+		return -1;
+
+	return updatebuf_put(ub, str, len);
+}
+
+int updatebuf_put_record(struct updatebuf* ub, byte type, unsigned long attrs,
+                         const char* name, const char* new_name)
+{
+	if (updatebuf_put_byte(ub, type) < 0
+	    || ((type == REC_MODIFIED || type == REC_RENAMED) && updatebuf_put_varint(ub, attrs) < 0)
+	    || updatebuf_put_vstring(ub, name) < 0
+	    || (type == REC_RENAMED && updatebuf_put_vstring(ub, new_name) < 0))
+		return -1;
+
+	return 0;
+}
+
+struct updatebuf* new_frame(byte type, const byte* payload, size_t len)
+{
+	struct updatebuf* ub;
+
+	if ((ub = new_updatebuf()) == NULL)
+		return NULL;
+
+	if (updatebuf_put_byte(ub, type) < 0 || updatebuf_put_varint(ub, len) < 0
+	    || updatebuf_put(ub, payload, len) < 0) {
+		updatebuf_unref(ub);
+		return NULL;
+	}
+
+	return ub;
+}
+
+struct updatebuf* new_records_frame(byte type, unsigned long seq, unsigned long count,
+                                    struct updatebuf* records)
+{
+	struct updatebuf* payload;
+	struct updatebuf* ub;
+
+	if ((payload = new_updatebuf()) == NULL)
+		return NULL;
+
+	ub = NULL;
+	if (updatebuf_put_varint(payload, seq) == 0 && updatebuf_put_varint(payload, count) == 0
+	    && updatebuf_put(payload, records->data, records->len) == 0)
+		ub = new_frame(type, payload->data, payload->len);
+	updatebuf_unref(payload);
+
+	return ub;
+}
+
+int get_frame_records(struct updatebuf* frame, unsigned long* seq, unsigned long* count,
+                      const byte** p)
+{
+	const byte* end;
+	unsigned long len;
+	int n;
+
+	*p = frame->data + 1;
+	end = frame->data + frame->len;
+
+	if (frame->len == 0 || (n = get_varint(*p, end - *p, &len)) < 0)
+		return -1;
+	*p += n;
+	if ((n = get_varint(*p, end - *p, seq)) < 0)
+		return -1;
+	*p += n;
+	if ((n = get_varint(*p, end - *p, count)) < 0)
+		return -1;
+	*p += n;
+
+	return 0;
+}
+
+/* Reads a varint length followed by a string from *p, and advances past it */
+static int get_name(const byte** p, const byte* end, char* name)
+{
+	unsigned long len;
+	int n;
+
+	if ((n = get_varint(*p, end - *p, &len)) < 0 || len > end - *p - n || len >= PATH_MAX)
+		return -1;
+
+	memcpy(name, *p + n, len);
+	name[len] = '\0';
+	*p += n + len;
+
+	return 0;
+}
+
+int get_record(const byte** p, const byte* end, byte* type, unsigned long* attrs,
+               char* name, char* new_name)
+{
+	int n;
+
+	if (*p >= end)
+		return -1;
+	*type = *(*p)++;
+
+	*attrs = 0;
+	if (*type == REC_MODIFIED || *type == REC_RENAMED) {
+		if ((n = get_varint(*p, end - *p, attrs)) < 0)
+			return -1;
+		*p += n;
+	}
+
+	if (get_name(p, end, name) < 0 || (*type == REC_RENAMED && get_name(p, end, new_name) < 0))
+		return -1;
+
+	return 0;
+}
+
+struct updatebuf* updatebuf_ref(struct updatebuf* ub)
+{
+	__atomic_add_fetch(&ub->refs, 1, __ATOMIC_RELAXED);
+
+	return ub;
+}
+
+void updatebuf_unref(struct updatebuf* ub)
+{
+	if (__atomic_sub_fetch(&ub->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (ub->packed != NULL && ub->packed != ub)
+			updatebuf_unref(ub->packed);
+		free(ub->data);
+		free(ub);
+	}
+}
@@ -0,0 +1,222 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  updatebuf.h
+ *
+ *    Description:  A reference counted buffer that holds the encoded bytes of one
+ *					update. It is built once per update, is not changed after that,
+ *					and the same bytes are written out to every client.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/2026 14:05:31
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef UPDATEBUF_H
+#define UPDATEBUF_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+#define UPDATEBUF_MIN           4096            /* Initial size of a buffer */
+
+/* Encoded update, shared by everyone who holds a reference to it */
+struct updatebuf {
+	int refs;
+	size_t len;
+	size_t cap;
+	byte* data;
+	struct updatebuf* packed;	/* Compressed copy, made the first time one
+								   is asked for, the buffer itself if it does
+								   not shrink, or NULL */
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  new_updatebuf()
+ *  Description:  Allocates an empty buffer, with one reference held by the caller
+ *	  Arguments:  None
+ *        Locks:  None
+ *      Returns:  A new updatebuf or NULL if memory could not be allocated
+ *		  Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* new_updatebuf();
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  updatebuf_put(struct updatebuf* ub, const void* data, size_t len)
+ *  Description:  Appends len bytes to ub, growing it if needed. Only used while ub
+ *				  is being built, before it is shared.
+ *	  Arguments:  ub   : The buffer to append to
+ *				  data : The bytes to append
+ *				  len  : Number of bytes
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int updatebuf_put(struct updatebuf* ub, const void* data, size_t len);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  updatebuf_put_byte(struct updatebuf* ub, byte b)
+ *  Description:  Appends a single byte to ub
+ *	  Arguments:  ub : The buffer to append to
+ *				  b  : The byte to append
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int updatebuf_put_byte(struct updatebuf* ub, byte b);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  updatebuf_put_string(struct updatebuf* ub, const char* str)
+ *  Description:  Appends str the way send_string(...) sends it, a length byte
+ *				  followed by the characters
+ *	  Arguments:  ub  : The buffer to append to
+ *				  str : The string to append, at most 255 characters
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int updatebuf_put_string(struct updatebuf* ub, const char* str);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  updatebuf_put_varint(struct updatebuf* ub, unsigned long v)
+ *  Description:  Appends v encoded with put_varint(...)
+ *	  Arguments:  ub : The buffer to append to
+ *				  v  : The value to append
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int updatebuf_put_varint(struct updatebuf* ub, unsigned long v);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  updatebuf_put_vstring(struct updatebuf* ub, const char* str)
+ *  Description:  Appends str the way protocol v2 carries strings, a varint length
+ *				  followed by the characters, whatever the length
+ *	  Arguments:  ub  : The buffer to append to
+ *				  str : The string to append
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int updatebuf_put_vstring(struct updatebuf* ub, const char* str);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  updatebuf_put_record(ub, type, attrs, name, new_name)
+ *  Description:  Appends one protocol v2 record: the REC_* type, the ATTR_* bits for
+ *				  REC_MODIFIED and REC_RENAMED, then the name (and the new name for
+ *				  REC_RENAMED)
+ *	  Arguments:  ub       : The buffer to append to
+ *				  type     : REC_* type of the record
+ *				  attrs    : ATTR_* bits of the attributes that were modified
+ *				  name     : Name of the entry, or its old name if it was renamed
+ *				  new_name : New name of a renamed entry, otherwise unused
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if memory could not be allocated
+ * =====================================================================================
+ */
+int updatebuf_put_record(struct updatebuf* ub, byte type, unsigned long attrs,
+                         const char* name, const char* new_name);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  new_frame(byte type, const byte* payload, size_t len)
+ *  Description:  Allocates a buffer that holds one protocol v2 frame, the type, the
+ *				  varint length and then the payload
+ *	  Arguments:  type    : FRAME_* type of the frame
+ *				  payload : The body of the frame
+ *				  len     : Number of bytes in payload
+ *        Locks:  None
+ *      Returns:  A new updatebuf or NULL if memory could not be allocated
+ *		  Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* new_frame(byte type, const byte* payload, size_t len);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  new_records_frame(type, seq, count, records)
+ *  Description:  Allocates a buffer that holds a FRAME_UPDATES or FRAME_RESYNC, the
+ *				  sequence number and the count followed by the records
+ *	  Arguments:  type    : FRAME_UPDATES or FRAME_RESYNC
+ *				  seq     : Sequence number of the last change
+ *				  count   : Number of records
+ *				  records : The encoded records
+ *        Locks:  None
+ *      Returns:  A new updatebuf or NULL if memory could not be allocated
+ *		  Free?:  Yes, with updatebuf_unref
+ * =====================================================================================
+ */
+struct updatebuf* new_records_frame(byte type, unsigned long seq, unsigned long count,
+                                    struct updatebuf* records);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  get_frame_records(frame, seq, count, p)
+ *  Description:  Reads the header of a FRAME_UPDATES or FRAME_RESYNC
+ *	  Arguments:  frame : The whole frame
+ *				  seq   : Receives the sequence number of the last change
+ *				  count : Receives the number of records
+ *				  p     : Receives where the first record starts
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if the frame is malformed
+ * =====================================================================================
+ */
+int get_frame_records(struct updatebuf* frame, unsigned long* seq, unsigned long* count,
+                      const byte** p);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  get_record(p, end, type, attrs, name, new_name)
+ *  Description:  Reads one record written by updatebuf_put_record(...), and advances
+ *				  past it
+ *	  Arguments:  p        : Where the record starts
+ *				  end      : One past the last byte that may be read
+ *				  type     : Receives the REC_* type
+ *				  attrs    : Receives the ATTR_* bits, 0 if the record has none
+ *				  name     : Receives the name, PATH_MAX bytes long
+ *				  new_name : Receives the new name of a REC_RENAMED, PATH_MAX bytes long
+ *        Locks:  None
+ *      Returns:  0 on success, -1 if the record is malformed
+ * =====================================================================================
+ */
+int get_record(const byte** p, const byte* end, byte* type, unsigned long* attrs,
+               char* name, char* new_name);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  updatebuf_ref(struct updatebuf* ub)
+ *  Description:  Takes another reference to ub
+ *	  Arguments:  ub : The buffer to hold on to
+ *        Locks:  None, the count is atomic
+ *      Returns:  ub
+ * =====================================================================================
+ */
+struct updatebuf* updatebuf_ref(struct updatebuf* ub);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  updatebuf_unref(struct updatebuf* ub)
+ *  Description:  Drops a reference to ub, and frees it once there are none left
+ *	  Arguments:  ub : The buffer to let go of
+ *        Locks:  None, the count is atomic
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void updatebuf_unref(struct updatebuf* ub);
+
+#endif  // UPDATEBUF_H
@@ -0,0 +1,197 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  uring.c
+ *
+ *    Description:  A minimal io_uring instance built directly on the system calls,
+ *					so no external library is needed.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/2026 13:21:15
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#define _GNU_SOURCE                     /* struct statx */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* The queue heads and tails are shared with the kernel */
+#define LOAD_ACQUIRE(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* Checks whether the kernel can run statx through the ring */
+static int supports_statx(int fd)
+{
+	struct io_uring_probe* probe;
+	size_t len;
+	int ok;
+
+	len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	if ((probe = (struct io_uring_probe*)calloc(1, len)) == NULL)
+		return 0;
+
+	ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+	     && probe->last_op >= IORING_OP_STATX
+	     && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+
+	return ok;
+}
+
+struct uring* uring_init(unsigned int entries)
+{
+	struct io_uring_params params;
+	struct uring* ring;
+
+	ring = (struct uring*)calloc(1, sizeof(struct uring));
+	if (ring == NULL)
+		return NULL;
+
+	memset(&params, 0, sizeof(params));
+	if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	if (!supports_statx(ring->fd)) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	// Newer kernels map both rings with a single mmap
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = 0;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto fail;
+
+	if (ring->cq_len == 0) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                    ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.array);
+	ring->cq_head = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + params.cq_off.cqes);
+
+	return ring;
+
+ fail:
+	free_uring(ring);
+	return NULL;
+}
+
+int uring_statx(struct uring* ring, int dirfd, int flags, unsigned int mask,
+                struct uring_statx_req* reqs, int n)
+{
+	struct io_uring_sqe* sqe;               /* Submission entry being filled in */
+	struct io_uring_cqe* cqe;               /* Completion entry being reaped */
+	unsigned int tail;                              /* Local copy of the submission tail */
+	unsigned int head;                              /* Local copy of the completion head */
+	int queued;                                             /* Requests put in the ring so far */
+	int completed;                                  /* Requests reaped so far */
+	int to_submit;                                  /* Requests not yet handed to the kernel */
+	int ret;
+
+	queued = 0;
+	completed = 0;
+	to_submit = 0;
+
+	while (completed < n) {
+		// Queue as many requests as can be in flight at once. The
+		// completion queue is at least as big as the submission queue,
+		// so it cannot overflow either.
+		tail = *ring->sq_tail;
+		while (queued < n && queued - completed < ring->sq_entries) {
+			sqe = &ring->sqes[tail & *ring->sq_mask];
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dirfd;
+			sqe->addr = (unsigned long)reqs[queued].name;
+			sqe->len = mask;
+			sqe->off = (unsigned long)reqs[queued].buff;
+			sqe->statx_flags = flags;
+			sqe->user_data = queued;
+
+			ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+			tail++;
+			queued++;
+			to_submit++;
+		}
+		STORE_RELEASE(ring->sq_tail, tail);
+
+		// Submit and wait for at least one completion
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		to_submit -= ret;
+
+		// Reap everything that has completed
+		head = *ring->cq_head;
+		while (head != LOAD_ACQUIRE(ring->cq_tail)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			reqs[cqe->user_data].res = cqe->res;
+			completed++;
+			head++;
+		}
+		STORE_RELEASE(ring->cq_head, head);
+	}
+
+	return 0;
+}
+
+void free_uring(struct uring* ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+
+	close(ring->fd);
+	free(ring);
+}
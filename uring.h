@@ -0,0 +1,99 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  uring.h
+ *
+ *    Description:  A minimal io_uring instance, used by the server to submit the
+ *					statx calls of a whole directory scan batch at once instead of
+ *					making one blocking system call per entry.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/2026 13:04:52
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct statx;
+
+/* A statx request, the result is the return value of the call or -errno */
+struct uring_statx_req {
+	const char* name;
+	struct statx* buff;
+	int res;
+};
+
+/* An io_uring instance with its mapped submission and completion queues */
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	void* sq_ptr;                                   /* Mappings, kept around for munmap */
+	size_t sq_len;
+	void* cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  uring_init(unsigned int entries)
+ *  Description:  Sets up an io_uring instance that can have up to entries requests in
+ *				  flight, and makes sure that the kernel supports statx through it
+ *	  Arguments:  entries : Size of the submission queue
+ *        Locks:  None
+ *      Returns:  A new uring structure or NULL if io_uring is unavailable
+ *		  Free?:  Yes, with free_uring
+ * =====================================================================================
+ */
+struct uring* uring_init(unsigned int entries);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  uring_statx(ring, dirfd, flags, mask, reqs, n)
+ *  Description:  Runs all n statx requests relative to dirfd through ring, submitting
+ *				  as many at once as the queue allows, and waits for all of them
+ *	  Arguments:  ring  : The io_uring instance to use
+ *				  dirfd : Directory the names in reqs are relative to
+ *				  flags : AT_* flags passed to every statx call
+ *				  mask  : STATX_* fields asked for in every statx call
+ *				  reqs  : The requests, each res is filled in on completion
+ *				  n     : Number of requests in reqs
+ *        Locks:  None, a ring must only be used by one thread at a time
+ *      Returns:  0 on success, -1 if the ring itself failed
+ * =====================================================================================
+ */
+int uring_statx(struct uring* ring, int dirfd, int flags, unsigned int mask,
+                struct uring_statx_req* reqs, int n);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  free_uring(struct uring* ring)
+ *  Description:  Unmaps the queues and closes ring
+ *	  Arguments:  ring : The io_uring instance to free
+ *        Locks:  None
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void free_uring(struct uring* ring);
+
+#endif  // URING_H
@@ -0,0 +1,141 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  workpool.c
+ *
+ *    Description:  A fixed pool of worker threads that split a range of indices
+ *					between them.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/2026 15:10:48
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+/* Arguments of a worker thread */
+struct worker_arg {
+	struct workpool* wp;
+	int slice;
+};
+
+/* Runs slice out of nslices of the current job of wp */
+static void run_slice(struct workpool* wp, int slice)
+{
+	int nslices;
+	int from, to;
+
+	nslices = wp->nworkers + 1;
+	from = (int)((long)wp->n * slice / nslices);
+	to = (int)((long)wp->n * (slice + 1) / nslices);
+
+	if (from < to)
+		wp->fn(wp->arg, from, to);
+}
+
+static void* worker_thread(void* arg)
+{
+	struct worker_arg* warg;                /* Which pool and slice this worker runs */
+	struct workpool* wp;
+	unsigned long seen;                             /* Last job that was run */
+
+	warg = (struct worker_arg*)arg;
+	wp = warg->wp;
+	seen = 0;
+
+	for (;; ) {
+		// LOCK : Wait for a new job
+		pthread_mutex_lock(&wp->lock);
+		while (wp->generation == seen)
+			pthread_cond_wait(&wp->start, &wp->lock);
+		seen = wp->generation;
+		pthread_mutex_unlock(&wp->lock);
+
+		run_slice(wp, warg->slice);
+
+		// LOCK : The last worker to finish wakes up the caller
+		pthread_mutex_lock(&wp->lock);
+		if (--wp->pending == 0)
+			pthread_cond_signal(&wp->done);
+		pthread_mutex_unlock(&wp->lock);
+	}
+
+	return((void*)0);
+}
+
+struct workpool* workpool_init(int nthreads)
+{
+	struct workpool* wp;
+	struct worker_arg* warg;
+	pthread_attr_t tattr;                   /* Workers are never joined */
+	int i;
+
+	if (nthreads < 1)
+		return NULL;
+
+	wp = (struct workpool*)calloc(1, sizeof(struct workpool));
+	if (wp == NULL)
+		return NULL;
+
+	wp->nworkers = nthreads - 1;
+	wp->tids = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+	warg = (struct worker_arg*)calloc(nthreads, sizeof(struct worker_arg));
+	if (wp->tids == NULL || warg == NULL) {
+		free(wp->tids);
+		free(warg);
+		free(wp);
+		return NULL;
+	}
+
+	pthread_mutex_init(&wp->lock, NULL);
+	pthread_cond_init(&wp->start, NULL);
+	pthread_cond_init(&wp->done, NULL);
+
+	pthread_attr_init(&tattr);
+	pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+
+	// Slice 0 belongs to whoever calls workpool_run
+	for (i = 0; i < wp->nworkers; i++) {
+		warg[i].wp = wp;
+		warg[i].slice = i + 1;
+		if (pthread_create(&wp->tids[i], &tattr, worker_thread, (void*)&warg[i]) != 0) {
+			// Run the job with the workers that did start
+			wp->nworkers = i;
+			break;
+		}
+	}
+
+	pthread_attr_destroy(&tattr);
+
+	return wp;
+}
+
+void workpool_run(struct workpool* wp, work_fn fn, void* arg, int n)
+{
+	// LOCK : Post the job
+	pthread_mutex_lock(&wp->lock);
+	wp->fn = fn;
+	wp->arg = arg;
+	wp->n = n;
+	wp->pending = wp->nworkers;
+	wp->generation++;
+	pthread_cond_broadcast(&wp->start);
+	pthread_mutex_unlock(&wp->lock);
+
+	run_slice(wp, 0);
+
+	// LOCK : Wait for the rest of the slices
+	pthread_mutex_lock(&wp->lock);
+	while (wp->pending > 0)
+		pthread_cond_wait(&wp->done, &wp->lock);
+	pthread_mutex_unlock(&wp->lock);
+}
@@ -0,0 +1,73 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  workpool.h
+ *
+ *    Description:  A fixed pool of worker threads that split a range of indices
+ *					between them. The server uses it to stat the entries of a scan
+ *					batch concurrently.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/2026 15:02:36
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Connor Moreside (conman720), cmoresid@ualberta.ca
+ *   Organization:  CMPUT 379
+ *
+ * =====================================================================================
+ */
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <pthread.h>
+
+/* Runs the work for the indices from (inclusive) to to (exclusive) */
+typedef void (*work_fn)(void* arg, int from, int to);
+
+/* A fixed pool of worker threads */
+struct workpool {
+	int nworkers;                                   /* Threads in the pool, not counting the caller */
+	pthread_t* tids;
+	pthread_mutex_t lock;                           /* Protects everything below */
+	pthread_cond_t start;                           /* Signalled when a new job is posted */
+	pthread_cond_t done;                            /* Signalled when the last worker finishes */
+	unsigned long generation;                       /* Incremented for every job */
+	int pending;                                    /* Workers still running the current job */
+	work_fn fn;
+	void* arg;
+	int n;
+};
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  workpool_init(int nthreads)
+ *  Description:  Creates a pool where nthreads threads, counting the caller of
+ *				  workpool_run(...), share each job. nthreads - 1 threads are
+ *				  started, and they inherit the signal mask of the caller.
+ *	  Arguments:  nthreads : How many threads run each job
+ *        Locks:  None
+ *      Returns:  A new workpool structure or NULL on error
+ *		  Free?:  No
+ * =====================================================================================
+ */
+struct workpool* workpool_init(int nthreads);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  workpool_run(struct workpool* wp, work_fn fn, void* arg, int n)
+ *  Description:  Splits the indices 0 to n - 1 into one contiguous slice per thread,
+ *				  runs fn on each slice concurrently, and waits for all of them. The
+ *				  caller runs the first slice itself.
+ *	  Arguments:  wp  : The pool to run the job on
+ *				  fn  : The work to run on each slice
+ *				  arg : Passed to fn
+ *				  n   : Number of indices
+ *        Locks:  lock : Held while the job is posted and while waiting for it
+ *      Returns:  (void)
+ * =====================================================================================
+ */
+void workpool_run(struct workpool* wp, work_fn fn, void* arg, int n);
+
+#endif  // WORKPOOL_H